@@ -0,0 +1,98 @@
+#pragma once
+
+// libc includes (available in both C and C++)
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Implementation includes
+#include "constant folding.h"
+
+// Arrays
+//
+//     a = array(n)
+//     a[i] = v
+//     print(a[i])
+//
+// array(n) allocates n zeroed u64 elements on the heap and returns their
+// address; like every other value it is a u64, so arrays can be passed to
+// and returned from functions and stored in other arrays (a[i][j]). The
+// length is kept in the word before the first element. Arrays are never
+// freed.
+//
+// An index is checked against the length unless -fno-bounds-check is given;
+// a bad one prints "array index <i> out of bounds (length <n>)" to stderr and
+// exits with 1. Without the check it is undefined behavior.
+
+// the largest n array(n) accepts, so the size in bytes can't overflow
+#define ARRAY_MAX_LENGTH (1ul << 60)
+
+// pops the index and the array, checks the index (array in %rdi, index in %rsi)
+void emitArrayIndex(Compiler* compiler) {
+    emitLine(compiler, "    pop %rsi");
+    emitLine(compiler, "    pop %rdi");
+    if (!compiler -> options.noBoundsCheck) {
+        emitLine(compiler, "    cmp -8(%rdi), %rsi");
+        emitLine(compiler, "    jae ._.arrayBounds");
+    }
+}
+
+// [array, index] -> [element]
+void emitArrayLoad(Compiler* compiler) {
+    emitArrayIndex(compiler);
+    emitLine(compiler, "    push (%rdi,%rsi,8)");
+}
+
+// [array, index, value] -> []
+void emitArrayStore(Compiler* compiler) {
+    emitLine(compiler, "    pop %rdx");
+    emitArrayIndex(compiler);
+    emitLine(compiler, "    mov %rdx, (%rdi,%rsi,8)");
+}
+
+// ._.array (called like a function with one argument) and ._.arrayBounds
+void emitArrayRuntime(Compiler* compiler) {
+    emitLine(compiler, "    .data");
+    emitLine(compiler, "._.arrayBoundsFormat: .string \"array index %lu out of bounds (length %lu)\\n\"");
+    emitLine(compiler, "._.arrayMemoryFormat: .string \"can't allocate an array of %lu elements\\n\"");
+    emitLine(compiler, "    .text");
+
+    emitLine(compiler, "._.array:");
+    emitLine(compiler, "    push %rbp");
+    emitLine(compiler, "    mov %rsp, %rbp");
+    emitLine(compiler, "    and $0xFFFFFFFFFFFFFFF0, %rsp");
+    emitLine(compiler, "    mov 16(%rbp), %rdi");
+    emitf(compiler, "    mov $%lu, %%rax\n", ARRAY_MAX_LENGTH);
+    emitLine(compiler, "    cmp %rax, %rdi");
+    emitLine(compiler, "    ja ._.arrayMemory");
+    emitLine(compiler, "    inc %rdi");
+    emitLine(compiler, "    mov $8, %esi");
+    emitLine(compiler, "    call calloc");
+    emitLine(compiler, "    test %rax, %rax");
+    emitLine(compiler, "    jz ._.arrayMemory");
+    emitLine(compiler, "    mov 16(%rbp), %rdi");
+    emitLine(compiler, "    mov %rdi, (%rax)");
+    emitLine(compiler, "    add $8, %rax");
+    emitLine(compiler, "    mov %rbp, %rsp");
+    emitLine(compiler, "    pop %rbp");
+    emitLine(compiler, "    ret");
+    emitLine(compiler, "._.arrayMemory:");
+    emitLine(compiler, "    mov stderr(%rip), %rdi");
+    emitLine(compiler, "    lea ._.arrayMemoryFormat(%rip), %rsi");
+    emitLine(compiler, "    mov 16(%rbp), %rdx");
+    emitLine(compiler, "    jmp ._.arrayError");
+
+    // jumped to with the array in %rdi and the index in %rsi
+    emitLine(compiler, "._.arrayBounds:");
+    emitLine(compiler, "    mov -8(%rdi), %rcx");
+    emitLine(compiler, "    mov %rsi, %rdx");
+    emitLine(compiler, "    mov stderr(%rip), %rdi");
+    emitLine(compiler, "    lea ._.arrayBoundsFormat(%rip), %rsi");
+    emitLine(compiler, "    and $0xFFFFFFFFFFFFFFF0, %rsp");
+    emitLine(compiler, "._.arrayError:");
+    emitLine(compiler, "    xor %eax, %eax");
+    emitLine(compiler, "    call fprintf");
+    emitLine(compiler, "    mov $1, %edi");
+    emitLine(compiler, "    call exit");
+}
@@ -0,0 +1,549 @@
+#pragma once
+
+// libc includes (available in both C and C++)
+#include <stdlib.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Implementation includes
+#include "constant folding.h"
+
+// Expression trees, for the places where the compiler has to look at a whole
+// expression before generating code for it.
+//
+// scev.h only needs + - * on literals and variables (parseSum). Anything
+// else makes parseSum return NULL and the caller falls back to the single
+// pass.
+//
+// interpreter.h needs whole function bodies (parseFunctionBody). There,
+// variables are numbered slots (AST_LOCAL), and statements are nodes too,
+// chained through next.
+//
+// select.h parses single expressions with parseOr and a frame scope, and
+// picks instructions for the tree.
+
+typedef enum AstKind {
+    AST_CONST,
+    AST_VAR,
+    AST_REGISTER,                       // a value the generated code keeps in a register
+    AST_LOCAL,                          // slot value of the function being parsed
+    AST_ADD,
+    AST_SUB,
+    AST_MUL,
+    AST_DIV,
+    AST_MOD,
+    AST_SHL,
+    AST_SHR,
+    AST_LT,
+    AST_LE,
+    AST_GT,
+    AST_GE,
+    AST_EQ,
+    AST_NE,
+    AST_BIT_AND,
+    AST_BIT_XOR,
+    AST_BIT_OR,
+    AST_AND,
+    AST_OR,
+    AST_NOT,                            // left == 0
+    AST_BOOL,                           // left != 0
+    AST_CALL,                           // function value, arguments left -> next -> ...
+    AST_INTRINSIC,                      // intrinsic value, arguments like AST_CALL
+
+    // statements
+    AST_ASSIGN,                         // slot value = left
+    AST_IF,                             // if (left) right else otherwise
+    AST_WHILE,                          // while (left) right
+    AST_RETURN,                         // return left
+    AST_EXPRESSION                      // left, for a call
+} AstKind;
+
+typedef struct Ast {
+    AstKind kind;
+    uint64_t value;                     // AST_CONST, slot of AST_LOCAL and AST_ASSIGN, function of AST_CALL, intrinsic of AST_INTRINSIC
+    Slice name;                         // AST_VAR
+    char const *reg;                    // AST_REGISTER
+    struct Ast* left;
+    struct Ast* right;
+    struct Ast* otherwise;
+    struct Ast* next;                   // the next statement or argument
+} Ast;
+
+// owns the nodes built while looking at one construct, they are freed together
+typedef struct AstPool {
+    Ast** nodes;
+    uint64_t count;
+    uint64_t allocated;                 // nodes kept by astPoolReset, reused before allocating new ones
+    uint64_t capacity;
+    Stats* stats;
+} AstPool;
+
+AstPool astPoolCreate(Stats* stats) {
+    AstPool pool = { NULL, 0, 0, 0, stats };
+    return pool;
+}
+
+void astPoolFree(AstPool* pool) {
+    for (uint64_t i = 0; i < pool -> allocated; i++) {
+        free(pool -> nodes[i]);
+    }
+    free(pool -> nodes);
+    pool -> nodes = NULL;
+    pool -> count = 0;
+    pool -> allocated = 0;
+    pool -> capacity = 0;
+}
+
+// forgets the nodes but keeps their memory for the next ones
+void astPoolReset(AstPool* pool, Stats* stats) {
+    pool -> count = 0;
+    pool -> stats = stats;
+}
+
+Ast* astNode(AstPool* pool, AstKind kind, Ast* left, Ast* right) {
+    if (pool -> count == pool -> capacity) {
+        pool -> capacity = pool -> capacity == 0 ? 64 : pool -> capacity * 2;
+        pool -> nodes = (Ast**) (realloc(pool -> nodes, sizeof(Ast*) * pool -> capacity));
+        statsAlloc(pool -> stats, sizeof(Ast*) * pool -> capacity);
+    }
+    if (pool -> count == pool -> allocated) {
+        pool -> nodes[pool -> allocated++] = (Ast*) (malloc(sizeof(Ast)));
+        statsAlloc(pool -> stats, sizeof(Ast));
+    }
+    Ast* ast = pool -> nodes[pool -> count++];
+
+    ast -> kind = kind;
+    ast -> value = 0;
+    ast -> name = sliceConstructorLen(0, 0);
+    ast -> reg = NULL;
+    ast -> left = left;
+    ast -> right = right;
+    ast -> otherwise = NULL;
+    ast -> next = NULL;
+    return ast;
+}
+
+Ast* astConst(AstPool* pool, uint64_t value) {
+    Ast* ast = astNode(pool, AST_CONST, NULL, NULL);
+    ast -> value = value;
+    return ast;
+}
+
+Ast* astVar(AstPool* pool, Slice name) {
+    Ast* ast = astNode(pool, AST_VAR, NULL, NULL);
+    ast -> name = name;
+    return ast;
+}
+
+Ast* astRegister(AstPool* pool, char const *reg) {
+    Ast* ast = astNode(pool, AST_REGISTER, NULL, NULL);
+    ast -> reg = reg;
+    return ast;
+}
+
+bool astIsConst(Ast* ast, uint64_t value) {
+    return ast -> kind == AST_CONST && ast -> value == value;
+}
+
+// the constructors below fold what they can, all the operators wrap around like u64
+
+Ast* astAdd(AstPool* pool, Ast* left, Ast* right) {
+    if (left -> kind == AST_CONST && right -> kind == AST_CONST) {
+        return astConst(pool, left -> value + right -> value);
+    }
+    if (astIsConst(left, 0)) {
+        return right;
+    }
+    if (astIsConst(right, 0)) {
+        return left;
+    }
+    return astNode(pool, AST_ADD, left, right);
+}
+
+Ast* astSub(AstPool* pool, Ast* left, Ast* right) {
+    if (left -> kind == AST_CONST && right -> kind == AST_CONST) {
+        return astConst(pool, left -> value - right -> value);
+    }
+    if (astIsConst(right, 0)) {
+        return left;
+    }
+    return astNode(pool, AST_SUB, left, right);
+}
+
+Ast* astMul(AstPool* pool, Ast* left, Ast* right) {
+    if (left -> kind == AST_CONST && right -> kind == AST_CONST) {
+        return astConst(pool, left -> value * right -> value);
+    }
+    if (astIsConst(left, 0) || astIsConst(right, 0)) {
+        return astConst(pool, 0);
+    }
+    if (astIsConst(left, 1)) {
+        return right;
+    }
+    if (astIsConst(right, 1)) {
+        return left;
+    }
+    return astNode(pool, AST_MUL, left, right);
+}
+
+// true if only blanks are left on the current line
+bool atLineEnd(Compiler* compiler) {
+    char const *p = compiler -> current;
+    while (*p == ' ' || *p == '\t' || *p == '\r') {
+        p++;
+    }
+    return *p == '\n' || *p == 0;
+}
+
+Ast* parseSum(Compiler* compiler, AstPool* pool);
+
+// literal, variable or ( sum )
+Ast* parsePrimary(Compiler* compiler, AstPool* pool) {
+    optionalInt val = consumeLiteral(compiler);
+    if (val.exists) {
+        return astConst(pool, val.item);
+    }
+
+    optionalSlice id = consumeIdentifier(compiler);
+    if (id.exists) {
+        // calls are not pure in general
+        if (!atLineEnd(compiler) && consume(compiler, "(")) {
+            return NULL;
+        }
+        return astVar(pool, id.item);
+    }
+
+    if (consume(compiler, "(")) {
+        Ast* ast = parseSum(compiler, pool);
+        if (ast == NULL || !consume(compiler, ")")) {
+            return NULL;
+        }
+        return ast;
+    }
+
+    return NULL;
+}
+
+// primary * primary ...
+Ast* parseProduct(Compiler* compiler, AstPool* pool) {
+    Ast* ast = parsePrimary(compiler, pool);
+    while (ast != NULL && !atLineEnd(compiler) && consume(compiler, "*")) {
+        Ast* right = parsePrimary(compiler, pool);
+        ast = right == NULL ? NULL : astMul(pool, ast, right);
+    }
+    return ast;
+}
+
+// product + product - product ...
+Ast* parseSum(Compiler* compiler, AstPool* pool) {
+    Ast* ast = parseProduct(compiler, pool);
+    while (ast != NULL && !atLineEnd(compiler)) {
+        if (consume(compiler, "+")) {
+            Ast* right = parseProduct(compiler, pool);
+            ast = right == NULL ? NULL : astAdd(pool, ast, right);
+        }
+        else if (consume(compiler, "-")) {
+            Ast* right = parseProduct(compiler, pool);
+            ast = right == NULL ? NULL : astSub(pool, ast, right);
+        }
+        else {
+            break;
+        }
+    }
+    return ast;
+}
+
+// Function bodies. A scope numbers the variables of the function being parsed, parameters
+// first; without one (variables == NULL) only constant expressions parse. A frame scope is
+// for code generation (select.h): variables are AST_VAR and must be in the symbol table.
+typedef struct AstScope {
+    UnorderedMap* variables;            // name -> slot
+    uint64_t count;
+    uint64_t function;                  // index of the function being parsed, it may call itself
+    bool frame;
+} AstScope;
+
+Ast* parseOr(Compiler* compiler, AstPool* pool, AstScope* scope);
+
+// a call to a pure function or an intrinsic, the name and "(" have been consumed
+Ast* parseCall(Compiler* compiler, AstPool* pool, AstScope* scope, Slice name) {
+    Intrinsic intrinsic = findIntrinsic(name);
+    if (intrinsic != INTRINSIC_NONE) {
+        Ast* call = astNode(pool, AST_INTRINSIC, NULL, NULL);
+        call -> value = intrinsic;
+        Ast** argument = &(call -> left);
+        for (uint64_t i = 0; i < intrinsicArity[intrinsic]; i++) {
+            if (i > 0 && !consume(compiler, ",")) {
+                return NULL;
+            }
+            *argument = parseOr(compiler, pool, scope);
+            if (*argument == NULL) {
+                return NULL;
+            }
+            argument = &((*argument) -> next);
+        }
+        return consume(compiler, ")") ? call : NULL;
+    }
+
+    if (!mapContains(compiler -> functionTable, name)) {
+        return NULL;
+    }
+    uint64_t function = (uint64_t)mapGet(compiler -> functionTable, name);
+    bool self = scope -> variables != NULL && function == scope -> function;
+    if (!self && !compiler -> functions[function].pure) {
+        return NULL;
+    }
+
+    Ast* call = astNode(pool, AST_CALL, NULL, NULL);
+    call -> value = function;
+    Ast** argument = &(call -> left);
+    while (!consume(compiler, ")")) {
+        *argument = parseOr(compiler, pool, scope);
+        if (*argument == NULL) {
+            return NULL;
+        }
+        argument = &((*argument) -> next);
+        consume(compiler, ",");
+    }
+    return call;
+}
+
+// literal, call, variable or ( expression ), parseOr takes care of the parentheses itself
+Ast* parseFactor(Compiler* compiler, AstPool* pool, AstScope* scope) {
+    optionalSlice id = consumeIdentifier(compiler);
+    if (id.exists) {
+        if (consume(compiler, "(")) {
+            // instructions aren't selected for calls, parsing the arguments would be for nothing
+            return scope -> frame ? NULL : parseCall(compiler, pool, scope, id.item);
+        }
+        if (scope -> frame) {
+            return mapContains(compiler -> symbolTable, id.item) ? astVar(pool, id.item) : NULL;
+        }
+        if (scope -> variables == NULL) {
+            return NULL;
+        }
+        if (!mapContains(scope -> variables, id.item)) {
+            mapInsert(scope -> variables, id.item, (int64_t)(scope -> count++));
+        }
+        Ast* local = astNode(pool, AST_LOCAL, NULL, NULL);
+        local -> value = (uint64_t)mapGet(scope -> variables, id.item);
+        return local;
+    }
+
+    optionalInt val = consumeLiteral(compiler);
+    if (val.exists) {
+        return astConst(pool, val.item);
+    }
+
+    if (consume(compiler, "(")) {
+        Ast* ast = parseOr(compiler, pool, scope);
+        consume(compiler, ")");
+        return ast;
+    }
+
+    return NULL;
+}
+
+#define AST_MAX_EXPRESSION_NODES 4096
+
+// trees from parseExpression
+typedef struct AstContext {
+    AstPool* pool;
+    AstScope* scope;
+} AstContext;
+
+AstKind const astOperatorKinds[] = {
+    [OP_SHL] = AST_SHL, [OP_SHR] = AST_SHR, [OP_LE] = AST_LE, [OP_GE] = AST_GE, [OP_EQ] = AST_EQ, [OP_NE] = AST_NE,
+    [OP_AND] = AST_AND, [OP_OR] = AST_OR, [OP_MUL] = AST_MUL, [OP_DIV] = AST_DIV, [OP_MOD] = AST_MOD,
+    [OP_ADD] = AST_ADD, [OP_SUB] = AST_SUB, [OP_LT] = AST_LT, [OP_GT] = AST_GT, [OP_BIT_AND] = AST_BIT_AND,
+    [OP_BIT_XOR] = AST_BIT_XOR, [OP_BIT_OR] = AST_BIT_OR, [OP_NOT] = AST_NOT, [OP_BOOL] = AST_BOOL
+};
+
+bool astOperand(Compiler* compiler, void* context, Operand* result) {
+    AstContext* parse = (AstContext*) context;
+    result -> ast = parseFactor(compiler, parse -> pool, parse -> scope);
+    return result -> ast != NULL;
+}
+
+void astOperator(Compiler* compiler, void* context, Operator op, Operand* left, Operand const *right) {
+    AstContext* parse = (AstContext*) context;
+    left -> ast = astNode(parse -> pool, astOperatorKinds[op], left -> ast, right == NULL ? NULL : right -> ast);
+}
+
+ExpressionHandlers const astHandlers = { true, astOperand, astOperator };
+
+// a whole expression, NULL if some part of it has no tree or it has more than
+// AST_MAX_EXPRESSION_NODES nodes (the walks over trees recurse, the stack machine doesn't)
+Ast* parseOr(Compiler* compiler, AstPool* pool, AstScope* scope) {
+    AstContext context = { pool, scope };
+    Operand result;
+    uint64_t count = pool -> count;
+    compiler -> astNesting++;
+    checkNesting(compiler);
+    bool parsed = parseExpression(compiler, &astHandlers, &context, &result);
+    compiler -> astNesting--;
+    return parsed && pool -> count - count <= AST_MAX_EXPRESSION_NODES ? result.ast : NULL;
+}
+
+bool parseBlock(Compiler* compiler, AstPool* pool, AstScope* scope, Ast** block);
+
+// one statement of a function body, NULL if it has no tree form (print, nested functions)
+Ast* parseStatement(Compiler* compiler, AstPool* pool, AstScope* scope) {
+    char* start = compiler -> current;
+    optionalSlice id = consumeIdentifier(compiler);
+    if (!id.exists) {
+        return NULL;
+    }
+
+    if (sliceEqualString(id.item, "return")) {
+        Ast* value = parseOr(compiler, pool, scope);
+        return value == NULL ? NULL : astNode(pool, AST_RETURN, value, NULL);
+    }
+
+    if (sliceEqualString(id.item, "if") || sliceEqualString(id.item, "while")) {
+        bool isIf = sliceEqualString(id.item, "if");
+        if (!consume(compiler, "(")) {
+            return NULL;
+        }
+        Ast* condition = parseOr(compiler, pool, scope);
+        if (condition == NULL || !consume(compiler, ")")) {
+            return NULL;
+        }
+        Ast* body = NULL;
+        if (!parseBlock(compiler, pool, scope, &body)) {
+            return NULL;
+        }
+        Ast* statement = astNode(pool, isIf ? AST_IF : AST_WHILE, condition, body);
+
+        char* beforeElse = compiler -> current;
+        optionalSlice next = consumeIdentifier(compiler);
+        if (isIf && next.exists && sliceEqualString(next.item, "else")) {
+            if (!parseBlock(compiler, pool, scope, &(statement -> otherwise))) {
+                return NULL;
+            }
+        }
+        else {
+            compiler -> current = beforeElse;
+        }
+        return statement;
+    }
+
+    if (sliceEqualString(id.item, "print") || sliceEqualString(id.item, "fun") || sliceEqualString(id.item, "else")) {
+        return NULL;
+    }
+
+    if (consume(compiler, "=")) {
+        Ast* value = parseOr(compiler, pool, scope);
+        if (value == NULL) {
+            return NULL;
+        }
+        if (!mapContains(scope -> variables, id.item)) {
+            mapInsert(scope -> variables, id.item, (int64_t)(scope -> count++));
+        }
+        Ast* assign = astNode(pool, AST_ASSIGN, value, NULL);
+        assign -> value = (uint64_t)mapGet(scope -> variables, id.item);
+        return assign;
+    }
+
+    // a call on its own
+    compiler -> current = start;
+    Ast* call = parseFactor(compiler, pool, scope);
+    if (call == NULL || call -> kind != AST_CALL) {
+        return NULL;
+    }
+    return astNode(pool, AST_EXPRESSION, call, NULL);
+}
+
+// { statements } into the list at block (NULL if empty)
+bool parseBlock(Compiler* compiler, AstPool* pool, AstScope* scope, Ast** block) {
+    if (!consume(compiler, "{")) {
+        return false;
+    }
+    *block = NULL;
+    while (!consume(compiler, "}")) {
+        Ast* statement = parseStatement(compiler, pool, scope);
+        if (statement == NULL) {
+            return false;
+        }
+        *block = statement;
+        block = &(statement -> next);
+    }
+    return true;
+}
+
+// the tree of the body of function (just after its "{") into its FunctionInfo, false if it has
+// statements that have none. Leaves compiler -> current where it was.
+bool parseFunctionBody(Compiler* compiler, AstPool* pool, uint64_t function, char* body) {
+    char* savedPointer = compiler -> current;
+    AstScope scope = { mapCreate(compiler -> stats), 0, function };
+
+    // the parameters are the first slots
+    compiler -> current = compiler -> functions[function].params;
+    while (!consume(compiler, ")")) {
+        optionalSlice parameterName = consumeIdentifier(compiler);
+        if (!parameterName.exists) {
+            break;
+        }
+        mapInsert(scope.variables, parameterName.item, (int64_t)(scope.count++));
+        consume(compiler, ",");
+    }
+
+    // parseBlock wants the "{" back
+    compiler -> current = body - 1;
+    bool parsed = parseBlock(compiler, pool, &scope, &(compiler -> functions[function].body));
+    compiler -> functions[function].numSlots = scope.count;
+
+    freeMap(scope.variables);
+    compiler -> current = savedPointer;
+    return parsed;
+}
+
+// true if every variable in the tree is in the symbol table
+bool astVariablesKnown(Compiler* compiler, Ast* ast) {
+    if (ast == NULL) {
+        return true;
+    }
+    if (ast -> kind == AST_VAR && !mapContains(compiler -> symbolTable, ast -> name)) {
+        return false;
+    }
+    return astVariablesKnown(compiler, ast -> left) && astVariablesKnown(compiler, ast -> right);
+}
+
+// pushes the value of the tree, the same stack discipline as expression()
+void emitAst(Compiler* compiler, Ast* ast) {
+    switch (ast -> kind) {
+        case AST_CONST:
+            emitf(compiler, "    mov $%lu, %%rdi\n", ast -> value);
+            emitLine(compiler, "    push %rdi");
+            return;
+        case AST_VAR:
+            emitf(compiler, "    push %ld(%%rbp)\n", mapGet(compiler -> symbolTable, ast -> name));
+            return;
+        case AST_REGISTER:
+            emitf(compiler, "    push %s\n", ast -> reg);
+            return;
+        default:
+            break;
+    }
+
+    emitAst(compiler, ast -> left);
+    emitAst(compiler, ast -> right);
+    emitLine(compiler, "    pop %rsi");
+    emitLine(compiler, "    pop %rdi");
+    switch (ast -> kind) {
+        case AST_ADD:
+            emitLine(compiler, "    add %rsi, %rdi");
+            break;
+        case AST_SUB:
+            emitLine(compiler, "    sub %rsi, %rdi");
+            break;
+        case AST_MUL:
+            emitLine(compiler, "    imul %rsi, %rdi");
+            break;
+        default:
+            fail(compiler);
+    }
+    emitLine(compiler, "    push %rdi");
+}
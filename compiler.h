@@ -8,23 +8,242 @@
 #include <stdlib.h>
 #include <ctype.h>
 #include <stdio.h>
+#include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
 
 // Implementation includes
 #include "constant folding.h"
-
-// The plan is to honor as many C operators as possible with
-// the same precedence and associativity
-// e<n> implements operators with precedence 'n' (smaller is higher)
+#include "profile.h"
+#include "scev.h"
+#include "memo.h"
+#include "interpreter.h"
+#include "stack.h"
+#include "array.h"
+#include "parallel.h"
+#include "select.h"
+#include "debug.h"
+#include "reach.h"
+#include "stream.h"
+#include "slots.h"
+#include "unroll.h"
 
 void expression(Compiler* compiler, bool effects);
 
-// () [] . -> ...
-void e1(Compiler* compiler, bool effects) {
+// puts the parameters listed after params (just after the "(") into the symbol table and
+// returns how many there are. The first parameter was pushed first, so it is the furthest
+// from %rbp, frameOffset is what lies between %rbp and the last one.
+int64_t declareParameters(Compiler* compiler, char* params, int64_t frameOffset) {
+    int64_t numParams = 0;
+
+    compiler -> current = params;
+
+    // find the number of parameters in this function to malloc the parameter array
+    while (!consume(compiler, ")")) {
+        optionalSlice parameterName = consumeIdentifier(compiler);
+        if (!parameterName.exists) {
+            fail(compiler);
+        }
+        numParams++;
+        consume(compiler, ",");
+    }
+
+    compiler -> current = params;
+
+    int64_t offset = (numParams * 8) + frameOffset;
+
+    // consume parameters
+    while (!consume(compiler, ")")) {
+        optionalSlice parameterName = consumeIdentifier(compiler);
+        if (!parameterName.exists) {
+            fail(compiler);
+        }
+        mapInsert(compiler -> symbolTable, parameterName.item, offset);
+        offset -= 8;
+        consume(compiler, ",");
+    }
+
+    return numParams;
+}
+
+// records a function declaration, returns its index in compiler -> functions
+uint64_t addFunction(Compiler* compiler, Slice name, uint64_t line, char* params, uint64_t numParams) {
+    if (compiler -> countFunctions == compiler -> capacityFunctions) {
+        compiler -> capacityFunctions = compiler -> capacityFunctions == 0 ? 16 : compiler -> capacityFunctions * 2;
+        compiler -> functions = (FunctionInfo*) (realloc(compiler -> functions, sizeof(FunctionInfo) * compiler -> capacityFunctions));
+        statsAlloc(compiler -> stats, sizeof(FunctionInfo) * compiler -> capacityFunctions);
+    }
+    uint64_t index = compiler -> countFunctions++;
+    FunctionInfo* function = &(compiler -> functions[index]);
+    function -> name = name;
+    function -> line = line;
+    function -> numParams = numParams;
+    function -> params = params;
+    function -> returnExpression = NULL;
+    function -> inlining = false;
+    function -> pure = false;
+    function -> evaluable = false;
+    function -> bodyText = NULL;
+    function -> body = NULL;
+    function -> numSlots = 0;
+    function -> memoized = false;
+    function -> code = NULL;
+    function -> codeLength = 0;
+    mapInsert(compiler -> functionTable, name, (int64_t)index);
+    return index;
+}
+
+FunctionInfo* findFunction(Compiler* compiler, Slice name) {
+    if (!mapContains(compiler -> functionTable, name)) {
+        return NULL;
+    }
+    return &(compiler -> functions[mapGet(compiler -> functionTable, name)]);
+}
+
+// the expression e if the body starting at body is just "return e" and e doesn't call name
+char* findReturnExpression(Compiler* compiler, char* body, Slice name) {
+    char* returnExpression = NULL;
+    compiler -> current = body;
+
+    optionalSlice id = consumeIdentifier(compiler);
+    if (id.exists && sliceEqualString(id.item, "return")) {
+        returnExpression = compiler -> current;
+        while (compiler -> current[0] != '\n' && compiler -> current[0] != 0) {
+            if (!isalpha(compiler -> current[0])) {
+                compiler -> current++;
+                continue;
+            }
+            char const *start = compiler -> current;
+            while (isalnum(compiler -> current[0])) {
+                compiler -> current++;
+            }
+            if (sliceEqualSlice(sliceConstructorEnd(start, compiler -> current), name)) {
+                returnExpression = NULL;
+                break;
+            }
+        }
+        if (!consume(compiler, "}")) {
+            returnExpression = NULL;
+        }
+    }
+
+    compiler -> current = body;
+    return returnExpression;
+}
+
+// evaluates the body of a function that is just "return e" in place of a call to it, the
+// arguments have been pushed already
+void inlineCall(Compiler* compiler, FunctionInfo* function, bool effects) {
+    char* callerPointer = compiler -> current;
+    UnorderedMap* callerTable = compiler -> symbolTable;
+
+    // the same layout as in a call, without the return address
+    compiler -> symbolTable = mapCreate(compiler -> stats);
+    declareParameters(compiler, function -> params, 0);
+    emitLine(compiler, "    push %rbp");
+    emitLine(compiler, "    mov %rsp, %rbp");
+
+    compiler -> current = function -> returnExpression;
+    function -> inlining = true;
+    expression(compiler, effects);
+    function -> inlining = false;
+
+    emitLine(compiler, "    pop %rax");
+    emitLine(compiler, "    pop %rbp");
+    if (function -> numParams > 0) {
+        emitf(compiler, "    add $%lu, %%rsp\n", function -> numParams * 8);
+    }
+    emitLine(compiler, "    push %rax");
+
+    freeMap(compiler -> symbolTable);
+    compiler -> symbolTable = callerTable;
+    compiler -> current = callerPointer;
+}
+
+// [x] -> [f(x)], with the instruction if the cpu has it (see intrinsics.h) and with fallback if it doesn't
+void emitBitCount(Compiler* compiler, char const *instruction, uint64_t feature, char const *fallback) {
+    uint64_t label = compiler -> countIntrinsic++;
+    emitLine(compiler, "    pop %rdi");
+    emitf(compiler, "    testb $%lu, ._.cpuFeatures(%%rip)\n", feature);
+    emitf(compiler, "    jz .LintrinsicFallback%lu\n", label);
+    // popcnt, lzcnt and tzcnt wait for the old value of the destination on some cpus
+    emitLine(compiler, "    xor %eax, %eax");
+    emitf(compiler, "    %s %%rdi, %%rax\n", instruction);
+    emitf(compiler, "    jmp .LintrinsicEnd%lu\n", label);
+    emitf(compiler, ".LintrinsicFallback%lu:\n", label);
+    emitf(compiler, "    call %s\n", fallback);
+    emitf(compiler, ".LintrinsicEnd%lu:\n", label);
+    emitLine(compiler, "    push %rax");
+}
+
+// a call to an intrinsic, the name and "(" have been consumed
+void intrinsicCall(Compiler* compiler, Intrinsic intrinsic, bool effects) {
+    for (uint64_t i = 0; i < intrinsicArity[intrinsic]; i++) {
+        if (i > 0) {
+            consumeOrFail(compiler, ",");
+        }
+        expression(compiler, effects);
+    }
+    consumeOrFail(compiler, ")");
+
+    switch (intrinsic) {
+        case INTRINSIC_POPCOUNT:
+            emitBitCount(compiler, "popcnt", CPU_POPCNT, "._.popcount");
+            break;
+        case INTRINSIC_CLZ:
+            emitBitCount(compiler, "lzcnt", CPU_LZCNT, "._.clz");
+            break;
+        case INTRINSIC_CTZ:
+            emitBitCount(compiler, "tzcnt", CPU_TZCNT, "._.ctz");
+            break;
+        case INTRINSIC_MIN:
+        case INTRINSIC_MAX:
+            emitLine(compiler, "    pop %rsi");
+            emitLine(compiler, "    pop %rax");
+            emitLine(compiler, "    cmp %rsi, %rax");
+            emitLine(compiler, intrinsic == INTRINSIC_MIN ? "    cmova %rsi, %rax" : "    cmovb %rsi, %rax");
+            emitLine(compiler, "    push %rax");
+            break;
+        case INTRINSIC_MULHI:
+            emitLine(compiler, "    pop %rsi");
+            emitLine(compiler, "    pop %rax");
+            emitLine(compiler, "    mul %rsi");
+            emitLine(compiler, "    push %rdx");
+            break;
+        case INTRINSIC_BSWAP:
+            emitLine(compiler, "    pop %rax");
+            emitLine(compiler, "    bswap %rax");
+            emitLine(compiler, "    push %rax");
+            break;
+        default:
+            fail(compiler);
+    }
+}
+
+// literal, variable, call or ( expression )
+void primary(Compiler* compiler, bool effects) {
     optionalSlice id = consumeIdentifier(compiler);
     if (id.exists) {
-        if (consume(compiler, "(")) {
+        if (sliceEqualString(id.item, "array") && consume(compiler, "(")) {
+            expression(compiler, effects);
+            consumeOrFail(compiler, ")");
+            emitLine(compiler, "    call ._.array");
+            emitLine(compiler, "    pop %r15");
+            emitLine(compiler, "    push %rax");
+        }
+        else if (consume(compiler, "(")) {
+            optionalInt folded = foldCalls(compiler, (char*)(id.item.start), true);
+            if (folded.exists) {
+                emitf(compiler, "    mov $%lu, %%rdi\n", folded.item);
+                emitLine(compiler, "    push %rdi");
+                return;
+            }
+
+            Intrinsic intrinsic = findIntrinsic(id.item);
+            if (intrinsic != INTRINSIC_NONE) {
+                intrinsicCall(compiler, intrinsic, effects);
+                return;
+            }
 
             // this is a function call
             uint64_t numParams = 0;
@@ -33,18 +252,25 @@ void e1(Compiler* compiler, bool effects) {
                 consume(compiler, ",");
                 numParams++;
             }
-            printf("    call ._.");
-            printSlice(id.item);
-            printf("\n");
+
+            FunctionInfo* function = findFunction(compiler, id.item);
+            if (function != NULL && function -> numParams == numParams && shouldInline(compiler, function)) {
+                inlineCall(compiler, function, effects);
+                return;
+            }
+
+            emitf(compiler, "    call ._.");
+            emitSlice(compiler, id.item);
+            emitf(compiler, "\n");
             for (size_t i = 0; i < numParams; i++) {
-                puts("    pop %r15");            // pop the parameters that were just pushed onto the stack
+                emitLine(compiler, "    pop %r15");            // pop the parameters that were just pushed onto the stack
             }
-            puts("    push %rax");
+            emitLine(compiler, "    push %rax");
         }
         else {
             // get the correct value from its offset stored in the map
             int64_t offset = mapGet(compiler -> symbolTable, id.item);
-            printf("    push %ld(%%rbp)\n", offset);
+            emitf(compiler, "    push %ld(%%rbp)\n", offset);
         }
 
         return;
@@ -52,8 +278,8 @@ void e1(Compiler* compiler, bool effects) {
         
     optionalInt val = consumeLiteral(compiler);
     if (val.exists) {
-        printf("    mov $%lu, %%rdi\n", val.item);
-        puts("    push %rdi");
+        emitf(compiler, "    mov $%lu, %%rdi\n", val.item);
+        emitLine(compiler, "    push %rdi");
         return;
     }
 
@@ -66,272 +292,254 @@ void e1(Compiler* compiler, bool effects) {
     fail(compiler);
 }
 
-// ++ -- unary+ unary- ... (Right)
-void e2(Compiler* compiler, bool effects) {
-    bool neg = false;
-    bool encounteredNeg = false;
+// An expression through the stack: parseExpression with handlers that push every operand
+// and pop the operands of every operator. A parenthesized expression is an operand of its
+// own here, it gets folded or has instructions selected by expression(), until they nest
+// STACK_MAX_NESTING deep. Deeper ones are parsed by parseExpression, which doesn't recurse.
+#define STACK_MAX_NESTING 16
+
+// primary, then [ index ]s
+bool stackOperand(Compiler* compiler, void* context, Operand* result) {
+    bool effects = *(bool*) context;
+    compiler -> stackNesting++;
+    checkNesting(compiler);
+    primary(compiler, effects);
+    compiler -> stackNesting--;
+
+    while (consume(compiler, "[")) {
+        expression(compiler, effects);
+        consumeOrFail(compiler, "]");
+        emitArrayLoad(compiler);
+    }
+    result -> value = 0;
+    return true;
+}
 
-    // logical not
-    while (true) {
-        if (consume(compiler, "!")) {
-            encounteredNeg = true;
-            neg = !neg;
-        }
-        else {
-            e1(compiler, effects);
-
-            if (neg) {
-                puts("    pop %rdi");
-                puts("    cmp $0, %rdi");
-                puts("    mov $0, %edi");
-                puts("    sete %dil");
-                puts("    push %rdi");
-            }
-            else if (encounteredNeg) {
-                puts("    pop %rdi");
-                puts("    cmp $0, %rdi");
-                puts("    mov $0, %edi");
-                puts("    setne %dil");
-                puts("    push %rdi");
-            }
+// the comparisons leave 0 or 1
+char const *const stackSetInstructions[OP_BINARY_COUNT] = {
+    [OP_LT] = "setb", [OP_LE] = "setbe", [OP_GT] = "seta", [OP_GE] = "setae", [OP_EQ] = "sete", [OP_NE] = "setne"
+};
+
+void stackOperator(Compiler* compiler, void* context, Operator op, Operand* left, Operand const *right) {
+    switch (op) {
+        case OP_NOT:
+        case OP_BOOL:
+            emitLine(compiler, "    pop %rdi");
+            emitLine(compiler, "    cmp $0, %rdi");
+            emitLine(compiler, "    mov $0, %edi");
+            emitLine(compiler, op == OP_NOT ? "    sete %dil" : "    setne %dil");
+            emitLine(compiler, "    push %rdi");
+            return;
 
+        case OP_DIV:
+        case OP_MOD:
+            emitLine(compiler, "    pop %rsi");
+            emitLine(compiler, "    pop %rax");
+            emitLine(compiler, "    xor %edx, %edx");
+            emitLine(compiler, "    div %rsi");
+            emitLine(compiler, op == OP_DIV ? "    push %rax" : "    push %rdx");
             return;
-        }
-    }
-}
 
-// * / % (Left)
-void e3(Compiler* compiler, bool effects) {
-    e2(compiler, effects);
-
-    while (true) {
-        if (consume(compiler, "*")) {
-            e2(compiler, effects);
-            puts("    pop %rsi");
-            puts("    pop %rdi");
-            puts("    imul %rsi, %rdi");
-            puts("    push %rdi");
-        }
-        else if (consume(compiler, "/")) {
-            e2(compiler, effects);
-            puts("    pop %rsi");
-            puts("    pop %rax");
-            puts("    xor %edx, %edx");
-            puts("    div %rsi");
-            puts("    push %rax");
-        }
-        else if (consume(compiler, "%")) {
-            e2(compiler, effects);
-            puts("    pop %rsi");
-            puts("    pop %rax");
-            puts("    xor %edx, %edx");
-            puts("    div %rsi");
-            puts("    push %rdx");
-        }
-        else {
+        case OP_SHL:
+        case OP_SHR:
+            emitLine(compiler, "    pop %rcx");
+            emitLine(compiler, "    pop %rdi");
+            emitLine(compiler, op == OP_SHL ? "    shl %cl, %rdi" : "    shr %cl, %rdi");
+            emitLine(compiler, "    push %rdi");
             return;
-        }
-    }
-}
 
-// (Left) + -
-void e4(Compiler* compiler, bool effects) {
-    e3(compiler, effects);
-
-    while (true) {
-        if (consume(compiler, "+")) {
-            e3(compiler, effects);
-            puts("    pop %rsi");
-            puts("    pop %rdi");
-            puts("    add %rsi, %rdi");
-            puts("    push %rdi");
-        }
-        else if (consume(compiler, "-")) {
-            e3(compiler, effects);
-            puts("    pop %rsi");
-            puts("    pop %rdi");
-            puts("    sub %rsi, %rdi");
-            puts("    push %rdi");
-        }
-        else {
+        case OP_LT:
+        case OP_LE:
+        case OP_GT:
+        case OP_GE:
+        case OP_EQ:
+        case OP_NE:
+            emitLine(compiler, "    pop %rsi");
+            emitLine(compiler, "    pop %rdi");
+            emitLine(compiler, "    cmp %rsi, %rdi");
+            emitLine(compiler, "    mov $0, %edi");
+            emitf(compiler, "    %s %%dil\n", stackSetInstructions[op]);
+            emitLine(compiler, "    push %rdi");
             return;
-        }
+
+        case OP_AND:
+        case OP_OR:
+            emitLine(compiler, "    pop %rsi");
+            emitLine(compiler, "    pop %rdi");
+            emitLine(compiler, "    test %rsi, %rsi");
+            emitLine(compiler, "    setnz %sil");
+            emitLine(compiler, "    test %rdi, %rdi");
+            emitLine(compiler, "    setnz %dil");
+            emitLine(compiler, op == OP_AND ? "    and %rsi, %rdi" : "    or %rsi, %rdi");
+            emitLine(compiler, "    and $1, %rdi");
+            emitLine(compiler, "    push %rdi");
+            return;
+
+        default:
+            break;
     }
+
+    // the rest is one instruction on both operands
+    char const *instruction = op == OP_MUL ? "imul" : op == OP_ADD ? "add" : op == OP_SUB ? "sub" :
+                              op == OP_BIT_AND ? "and" : op == OP_BIT_XOR ? "xor" : "or";
+    emitLine(compiler, "    pop %rsi");
+    emitLine(compiler, "    pop %rdi");
+    emitf(compiler, "    %s %%rsi, %%rdi\n", instruction);
+    emitLine(compiler, "    push %rdi");
 }
 
-// << >>
-void e5(Compiler* compiler, bool effects) {
-    e4(compiler, effects);
+ExpressionHandlers const stackHandlers = { false, stackOperand, stackOperator };
+ExpressionHandlers const stackNestedHandlers = { true, stackOperand, stackOperator };
+
+void stackExpression(Compiler* compiler, bool effects) {
+    Operand result;
+    bool nested = compiler -> stackNesting >= STACK_MAX_NESTING;
+    parseExpression(compiler, nested ? &stackNestedHandlers : &stackHandlers, &effects, &result);
 }
 
-// < <= > >=
-void e6(Compiler* compiler, bool effects) {
-    e5(compiler, effects);
-
-    while (true) {
-        if (consume(compiler, "<=")) {
-            e5(compiler, effects);
-            // v = (v <= u) ? 1 : 0;
-            puts("    pop %rsi");
-            puts("    pop %rdi");
-            puts("    cmp %rsi, %rdi");
-            puts("    mov $0, %edi");
-            puts("    setbe %dil");
-            puts("    push %rdi");
-        }
-        else if (consume(compiler, ">=")) {
-            e5(compiler, effects);
-            // v = (v >= u) ? 1 : 0;
-            puts("    pop %rsi");
-            puts("    pop %rdi");
-            puts("    cmp %rsi, %rdi");
-            puts("    mov $0, %edi");
-            puts("    setae %dil");
-            puts("    push %rdi");
-        }
-        else if (consume(compiler, "<")) {
-            e5(compiler, effects);
-            // v = (v < u) ? 1 : 0;
-            puts("    pop %rsi");
-            puts("    pop %rdi");
-            puts("    cmp %rsi, %rdi");
-            puts("    mov $0, %edi");
-            puts("    setb %dil");
-            puts("    push %rdi");
-        }
-        else if (consume(compiler, ">")) {
-            e5(compiler, effects);
-            // v = (v > u) ? 1 : 0;
-            puts("    pop %rsi");
-            puts("    pop %rdi");
-            puts("    cmp %rsi, %rdi");
-            puts("    mov $0, %edi");
-            puts("    seta %dil");
-            puts("    push %rdi");
-        }
-        else {
-            return;
-        }
+// the value of the expression if constant folding or evaluating pure calls finds it
+optionalInt constantExpression(Compiler* compiler, bool effects) {
+    optionalInt ret = checkExpression(compiler, effects);
+    if (!ret.exists) {
+        // calls to pure functions with constant arguments
+        ret = foldCalls(compiler, compiler -> current, false);
     }
+    return ret;
 }
 
-// == !=
-void e7(Compiler* compiler, bool effects) {
-    e6(compiler, effects);
-
-    while (true) {
-        if (consume(compiler, "==")) {
-            e6(compiler, effects);
-            // v = (v == u) ? 1 : 0;
-            puts("    pop %rsi");
-            puts("    pop %rdi");
-            puts("    cmp %rsi, %rdi");
-            puts("    mov $0, %edi");
-            puts("    sete %dil");
-            puts("    push %rdi");
-        }
-        else if (consume(compiler, "!=")) {
-            e6(compiler, effects);
-            // v = (v != u) ? 1 : 0;
-            puts("    pop %rsi");
-            puts("    pop %rdi");
-            puts("    cmp %rsi, %rdi");
-            puts("    mov $0, %edi");
-            puts("    setne %dil");
-            puts("    push %rdi");
-        }
-        else {
-            return;
-        }
+void expression(Compiler* compiler, bool effects) {
+    optionalInt ret = constantExpression(compiler, effects);
+    if (ret.exists) {
+        // is a literal expression, just push expression found through constant folding
+        emitf(compiler, "    mov $%lu, %%rdi\n", ret.item);
+        emitLine(compiler, "    push %rdi");
+        return;
     }
-}
 
-// (left) &
-void e8(Compiler* compiler, bool effects) {
-    e7(compiler, effects);
+    Ast* tree = selectExpression(compiler);
+    if (tree == NULL) {
+        stackExpression(compiler, effects);
+    }
+    else if (tree -> kind == AST_VAR) {
+        emitf(compiler, "    push %ld(%%rbp)\n", variableOffset(compiler, tree));
+    }
+    else {
+        selectValue(compiler, tree, 0);
+        emitLine(compiler, "    push %rdi");
+    }
 }
 
-// ^
-void e9(Compiler* compiler, bool effects) {
-    e8(compiler, effects);
-}
+// the value of the expression in reg instead of on the stack
+void expressionTo(Compiler* compiler, bool effects, char const *reg) {
+    optionalInt ret = constantExpression(compiler, effects);
+    if (ret.exists) {
+        emitf(compiler, "    mov $%lu, %s\n", ret.item, reg);
+        return;
+    }
 
-// |
-void e10(Compiler* compiler, bool effects) {
-    e9(compiler, effects);
+    Ast* tree = selectExpression(compiler);
+    if (tree == NULL) {
+        stackExpression(compiler, effects);
+        emitf(compiler, "    pop %s\n", reg);
+    }
+    else if (tree -> kind == AST_VAR) {
+        emitf(compiler, "    mov %ld(%%rbp), %s\n", variableOffset(compiler, tree), reg);
+    }
+    else {
+        selectValue(compiler, tree, 0);
+        if (strcmp(reg, "%rdi") != 0) {
+            emitf(compiler, "    mov %%rdi, %s\n", reg);
+        }
+    }
 }
 
-// &&
-void e11(Compiler* compiler, bool effects) {
-    e10(compiler, effects);
-
-    while (true) {
-        if (consume(compiler, "&&")) {
-            e10(compiler, effects);
-            puts("    pop %rsi");
-            puts("    pop %rdi");
-            puts("    test %rsi, %rsi");
-            puts("    setnz %sil");
-            puts("    test %rdi, %rdi");
-            puts("    setnz %dil");
-            puts("    and %rsi, %rdi");
-            puts("    and $1, %rdi");
-            puts("    push %rdi");
-        }
-        else {
-            return;
+// the condition of an if or a while into the flags, returns the code its jump takes when it is true
+ConditionCode condition(Compiler* compiler, bool effects) {
+    optionalInt ret = constantExpression(compiler, effects);
+    if (ret.exists) {
+        emitf(compiler, "    mov $%lu, %%rdi\n", ret.item);
+    }
+    else {
+        Ast* tree = selectExpression(compiler);
+        if (tree != NULL) {
+            return selectCondition(compiler, tree, 0);
         }
+        stackExpression(compiler, effects);
+        emitLine(compiler, "    pop %rdi");
     }
+    emitLine(compiler, "    test %rdi, %rdi");
+    return CC_NE;
 }
 
-// ||
-void e12(Compiler* compiler, bool effects) {
-    e11(compiler, effects);
-    
-    while (true) {
-        if (consume(compiler, "||")) {
-            e11(compiler, effects);
-            puts("    pop %rsi");
-            puts("    pop %rdi");
-            puts("    test %rsi, %rsi");
-            puts("    setnz %sil");
-            puts("    test %rdi, %rdi");
-            puts("    setnz %dil");
-            puts("    or %rsi, %rdi");
-            puts("    and $1, %rdi");
-            puts("    push %rdi");
-        }
-        else {
+// variable = expression, the variable at offset
+void assignment(Compiler* compiler, bool effects, int64_t offset) {
+    optionalInt ret = constantExpression(compiler, effects);
+    if (ret.exists && fitsImmediate(ret.item) && !compiler -> options.noSelect) {
+        emitf(compiler, "    movq $%ld, %ld(%%rbp)\n", (int64_t) ret.item, offset);
+        return;
+    }
+    if (ret.exists) {
+        emitf(compiler, "    mov $%lu, %%rdi\n", ret.item);
+    }
+    else {
+        Ast* tree = selectExpression(compiler);
+        if (tree != NULL) {
+            selectAssignment(compiler, tree, offset);
             return;
         }
+        stackExpression(compiler, effects);
+        emitLine(compiler, "    pop %rdi");
     }
+    emitf(compiler, "    mov %%rdi, %ld(%%rbp)\n", offset);
 }
 
-// (right with special treatment for middle expression) ?:
-void e13(Compiler* compiler, bool effects) {
-    e12(compiler, effects);
-}
+bool statement(Compiler* compiler, bool effects, optionalSlice currentFunction);
 
-// = += -= ...
-void e14(Compiler* compiler, bool effects) {
-    e13(compiler, effects);
+// for every parameter of a tail call to the function itself (arguments up to end, no nested
+// parentheses), the last argument that reads it counting from 1, 0 if none does.
+// Parameter i is at (numParams - i) * 8 + 8(%rbp).
+void lastReaders(Compiler* compiler, char const *arguments, char const *end, uint64_t numParams, uint64_t* readers) {
+    uint64_t argument = 1;
+    for (char const *p = arguments; p < end; ) {
+        if (*p == ',') {
+            argument++;
+        }
+        if (!isAlnumByte(*p)) {
+            p++;
+            continue;
+        }
+        char const *start = p;
+        p = scanAlnum(p);
+        Slice name = sliceConstructorEnd(start, p);
+        if (!isAlphaByte(*start) || !mapContains(compiler -> symbolTable, name)) {
+            continue;
+        }
+        int64_t offset = mapGet(compiler -> symbolTable, name);
+        if (offset >= 16 && offset <= (int64_t) numParams * 8 + 8) {
+            readers[numParams - (offset - 8) / 8] = argument;
+        }
+    }
 }
 
-// ,
-void e15(Compiler* compiler, bool effects) {
-    e14(compiler, effects);
+// { statements }
+void block(Compiler* compiler, bool effects, optionalSlice currentFunction) {
+    consumeOrFail(compiler, "{");
+    while (!consume(compiler, "}")) {
+        if (!statement(compiler, effects, currentFunction)) {
+            fail(compiler);
+        }
+    }
 }
 
-void expression(Compiler* compiler, bool effects) {
-    optionalInt ret = checkExpression(compiler, effects);
-    if (ret.exists) {
-        // is a literal expression, just push expression found through constant folding
-        printf("    mov $%lu, %%rdi\n", ret.item);
-        puts("    push %rdi");
-    }
-    else {
-        e15(compiler, effects);
+// consumes "else" if it comes next
+bool consumeElse(Compiler* compiler) {
+    char* prevPointer = compiler -> current;
+    optionalSlice checkElse = consumeIdentifier(compiler);
+    if (checkElse.exists && sliceEqualString(checkElse.item, "else")) {
+        return true;
     }
+    compiler -> current = prevPointer;
+    return false;
 }
 
 bool statement(Compiler* compiler, bool effects, optionalSlice currentFunction) {
@@ -342,17 +550,24 @@ bool statement(Compiler* compiler, bool effects, optionalSlice currentFunction)
     if (!id.exists) {
         return false;
     }
+    if (currentFunction.exists) {
+        debugLine(compiler, lineOf(compiler, id.item.start));
+    }
 
     if (sliceEqualString(id.item, "print")) {
         consume(compiler, "(");
         expression(compiler, effects);
         consume(compiler, ")");
-        puts("    call ._.print");
-        puts("    pop %r15");
+        emitLine(compiler, "    call ._.print");
+        emitLine(compiler, "    pop %r15");
         return true;
     }
 
     if (sliceEqualString(id.item, "return")) {
+        if (compiler -> parallelBody) {
+            // the body of a pfor isn't a function of its own
+            fail(compiler);
+        }
         char* beforePointer = compiler -> current;
         optionalSlice id = consumeIdentifier(compiler);
 
@@ -389,98 +604,129 @@ bool statement(Compiler* compiler, bool effects, optionalSlice currentFunction)
 
             if (canUseTailRecursion) {
 
+                char* endPointer = compiler -> current;
                 compiler -> current = beforePointer2;
 
-                int64_t offset = (numParams * 8) + 8;
+                uint64_t* readers = (uint64_t*) (calloc(numParams, sizeof(uint64_t)));
+                statsAlloc(compiler -> stats, numParams * sizeof(uint64_t));
+                lastReaders(compiler, beforePointer2, endPointer, numParams, readers);
 
-                // consume parameters
+                // a parameter a later argument reads is overwritten after all of them are evaluated
+                uint64_t argument = 0;
                 while (!consume(compiler, ")")) {
-                    expression(compiler, effects);
-                    puts("    pop %rdi");
-                    printf("    mov %%rdi, %lu(%%rbp)\n", offset);
-                    offset -= 8;
+                    int64_t offset = (numParams - argument) * 8 + 8;
+                    if (argument < numParams && readers[argument] > argument + 1) {
+                        expression(compiler, effects);
+                    }
+                    else {
+                        assignment(compiler, effects, offset);
+                    }
+                    argument++;
                     consume(compiler, ",");
                 }
-
-                puts("    mov %rbp, %rsp");
-                puts("    pop %rbp");
-                printf("    jmp ._.");
-                printSlice(id.item);
-                printf("\n");
+                while (argument > 0) {
+                    argument--;
+                    if (argument < numParams && readers[argument] > argument + 1) {
+                        emitLine(compiler, "    pop %rdi");
+                        emitf(compiler, "    mov %%rdi, %ld(%%rbp)\n", (int64_t) ((numParams - argument) * 8 + 8));
+                    }
+                }
+                free(readers);
+
+                profileFunctionExit(compiler);
+                emitLine(compiler, "    mov %rbp, %rsp");
+                emitLine(compiler, "    pop %rbp");
+                emitf(compiler, "    jmp ._.");
+                emitSlice(compiler, id.item);
+                emitf(compiler, findFunction(compiler, id.item) -> memoized ? ".body\n" : "\n");
                 return true;
             }
         }
 
         compiler -> current = beforePointer;
-        expression(compiler, effects);
-        puts("    pop %rax");
-        puts("    mov %rbp, %rsp");
-        puts("    pop %rbp");
-        puts("    ret");
+        if (currentFunction.exists && compiler -> options.profileCycles) {
+            // reading the cycle counter uses %rax
+            expression(compiler, effects);
+            profileFunctionExit(compiler);
+            emitLine(compiler, "    pop %rax");
+        }
+        else {
+            expressionTo(compiler, effects, "%rax");
+        }
+        emitLine(compiler, "    mov %rbp, %rsp");
+        emitLine(compiler, "    pop %rbp");
+        emitLine(compiler, "    ret");
 
         return true;
     }
 
     if (sliceEqualString(id.item, "if")) {
         // if ... 
-        consumeOrFail(compiler, "(");
-        expression(compiler, effects);
-        consumeOrFail(compiler, ")");
-
+        uint64_t line = lineOf(compiler, id.item.start);
         compiler -> countIf++;
         uint64_t currentIfCounter = compiler -> countIf;
-        puts("    pop %rdi");
-        puts("    test %rdi, %rdi");
 
-        // jumps to label if not true (skip over if statement)
-        printf("    jz ._.skipIf%lu\n", currentIfCounter);
+        // the counter goes first, incq would change the flags the jump needs
+        uint64_t profileSlot = currentFunction.exists ? profileIf(compiler, currentFunction.item, line) : 0;
+        consumeOrFail(compiler, "(");
+        ConditionCode code = condition(compiler, effects);
+        consumeOrFail(compiler, ")");
 
-        // go through the if statement
-        uint64_t countBrackets = 1;
-        consumeOrFail(compiler, "{");
+        // with a profile the arm that runs more often falls through and the other one goes out of line
+        uint64_t thenCount = 0;
+        uint64_t elseCount = 0;
+        bool profiled = currentFunction.exists && profiledIf(compiler, line, &thenCount, &elseCount);
+        ColdRegion region;
 
-        while (countBrackets > 0) {
-            if (consume(compiler, "{")) {
-                countBrackets++;
-                continue;
-            }
-            if (consume(compiler, "}")) {
-                countBrackets--;
-                continue;
+        if (profiled && thenCount < elseCount) {
+            // jumps to the out of line then arm if true
+            emitf(compiler, "    j%s .LthenIf%lu\n", conditionNames[code], currentIfCounter);
+
+            beginColdCode(compiler, &region);
+            emitf(compiler, ".LthenIf%lu:\n", currentIfCounter);
+            if (currentFunction.exists) {
+                profileThenArm(compiler, profileSlot);
             }
+            block(compiler, effects, currentFunction);
+            emitf(compiler, "    jmp .LendIf%lu\n", currentIfCounter);
+            endColdCode(compiler, &region);
 
-            statement(compiler, effects, currentFunction);
+            if (consumeElse(compiler)) {
+                block(compiler, effects, currentFunction);
+            }
+            emitf(compiler, ".LendIf%lu:\n", currentIfCounter);
+            return true;
         }
 
+        // jumps to label if not true (skip over if statement)
+        emitf(compiler, "    j%s .LskipIf%lu\n", conditionNames[code ^ 1], currentIfCounter);
+        if (currentFunction.exists) {
+            profileThenArm(compiler, profileSlot);
+        }
 
-        printf("    jmp ._.endIf%lu\n", currentIfCounter);
-        printf("._.skipIf%lu:\n", currentIfCounter);
+        // go through the if statement
+        block(compiler, effects, currentFunction);
 
         // check if there is an else statement
-        char* prevPointer = compiler -> current;
-        optionalSlice checkElse = consumeIdentifier(compiler);
-        if (checkElse.exists && sliceEqualString(checkElse.item, "else")) {
-            countBrackets = 1;
-            consumeOrFail(compiler, "{");
-
-            while (!consume(compiler, "}")) {
-                if (consume(compiler, "{")) {
-                    countBrackets++;
-                    continue;
-                }
-                if (consume(compiler, "}")) {
-                    countBrackets--;
-                    continue;
-                }
-
-                statement(compiler, effects, currentFunction);
+        if (consumeElse(compiler)) {
+            if (profiled && elseCount < thenCount) {
+                beginColdCode(compiler, &region);
+                emitf(compiler, ".LskipIf%lu:\n", currentIfCounter);
+                block(compiler, effects, currentFunction);
+                emitf(compiler, "    jmp .LendIf%lu\n", currentIfCounter);
+                endColdCode(compiler, &region);
+            }
+            else {
+                emitf(compiler, "    jmp .LendIf%lu\n", currentIfCounter);
+                emitf(compiler, ".LskipIf%lu:\n", currentIfCounter);
+                block(compiler, effects, currentFunction);
             }
         }
         else {
-            compiler -> current = prevPointer;
+            emitf(compiler, ".LskipIf%lu:\n", currentIfCounter);
         }
 
-        printf("._.endIf%lu:\n", currentIfCounter);
+        emitf(compiler, ".LendIf%lu:\n", currentIfCounter);
 
         return true;
     }
@@ -490,38 +736,113 @@ bool statement(Compiler* compiler, bool effects, optionalSlice currentFunction)
 
         compiler -> countWhile++;
         uint64_t currentWhileCounter = compiler -> countWhile;
+        uint64_t line = lineOf(compiler, id.item.start);
+        char* conditionPointer = compiler -> current;
+
+        // loops with a closed form skip over the loop below, unless a runtime guard fails
+        if (currentFunction.exists && !compiler -> options.profile) {
+            closedFormLoop(compiler, currentWhileCounter, conditionPointer);
+        }
 
-        printf("._.startWhile%lu:\n", currentWhileCounter);
+        emitf(compiler, ".LstartWhile%lu:\n", currentWhileCounter);
 
+        // counted loops run several copies of the body per condition (see unroll.h)
+        CountedLoop counted;
+        uint64_t factor = currentFunction.exists ? unrollFactor(compiler, conditionPointer, &counted) : 1;
+
+        compiler -> current = conditionPointer;
+        debugLine(compiler, line);
         consumeOrFail(compiler, "(");
-        expression(compiler, effects);
+        ConditionCode code = condition(compiler, effects);
         consumeOrFail(compiler, ")");
 
-        puts("    pop %rdi");
-        puts("    test %rdi, %rdi");
-
         // jumps to label if not true (skip over while statement)
-        printf("    jz ._.skipWhile%lu\n", currentWhileCounter);
+        emitf(compiler, "    j%s .LskipWhile%lu\n", conditionNames[code ^ 1], currentWhileCounter);
+        if (currentFunction.exists) {
+            profileLoopIteration(compiler, currentFunction.item, line);
+        }
+
+        if (factor > 1) {
+            emitUnrollGuard(compiler, &counted, factor, currentWhileCounter);
+            char* bodyPointer = compiler -> current;
+            for (uint64_t unrolled = 0; unrolled < factor; unrolled++) {
+                compiler -> current = bodyPointer;
+                block(compiler, effects, currentFunction);
+            }
+            emitf(compiler, "    jmp .LstartWhile%lu\n", currentWhileCounter);
+            emitf(compiler, ".LrestWhile%lu:\n", currentWhileCounter);
+            compiler -> current = bodyPointer;
+        }
 
         // go through the while statement
-        consumeOrFail(compiler, "{");
-        uint64_t countBrackets = 1;
+        block(compiler, effects, currentFunction);
+        if (currentFunction.exists) {
+            astPoolFree(&(counted.pool));
+        }
 
-        while (countBrackets > 0) {
-            if (consume(compiler, "{")) {
-                countBrackets++;
-                continue;
-            }
-            if (consume(compiler, "}")) {
-                countBrackets--;
-                continue;
-            }
+        emitf(compiler, "    jmp .LstartWhile%lu\n", currentWhileCounter);
+        emitf(compiler, ".LskipWhile%lu:\n", currentWhileCounter);
+
+        return true;
+    }
 
-            statement(compiler, effects, currentFunction);
+    if (sliceEqualString(id.item, "pfor")) {
+        // pfor (i, lo, hi[, accumulator]) { ... } (see parallel.h)
+        if (!currentFunction.exists) {
+            fail(compiler);
+        }
+        uint64_t label = compiler -> countParallel++;
+        consumeOrFail(compiler, "(");
+        optionalSlice variable = consumeIdentifier(compiler);
+        if (!variable.exists || !mapContains(compiler -> symbolTable, variable.item)) {
+            fail(compiler);
+        }
+        int64_t variableOffset = mapGet(compiler -> symbolTable, variable.item);
+        consumeOrFail(compiler, ",");
+        expression(compiler, effects);
+        consumeOrFail(compiler, ",");
+        expression(compiler, effects);
+        int64_t accumulatorOffset = 0;
+        if (consume(compiler, ",")) {
+            optionalSlice accumulator = consumeIdentifier(compiler);
+            if (!accumulator.exists || !mapContains(compiler -> symbolTable, accumulator.item)) {
+                fail(compiler);
+            }
+            accumulatorOffset = mapGet(compiler -> symbolTable, accumulator.item);
         }
+        consumeOrFail(compiler, ")");
 
-        printf("    jmp ._.startWhile%lu\n", currentWhileCounter);
-        printf("._.skipWhile%lu:\n", currentWhileCounter);
+        emitLine(compiler, "    pop %rdx");
+        emitLine(compiler, "    pop %rsi");
+        emitf(compiler, "    lea .LparallelBody%lu(%%rip), %%rdi\n", label);
+        emitf(compiler, "    mov $%lu, %%rcx\n", compiler -> frameLocals);
+        emitf(compiler, "    mov $%lu, %%r8\n", 16 + 8 * compiler -> frameParams);
+        emitf(compiler, "    mov $%ld, %%r9\n", accumulatorOffset);
+        emitLine(compiler, "    call ._.pfor");
+        if (accumulatorOffset != 0) {
+            emitf(compiler, "    add %%rax, %ld(%%rbp)\n", accumulatorOffset);
+        }
+        emitf(compiler, "    jmp .LparallelEnd%lu\n", label);
+
+        // %rdi = first iteration, %rsi = end; the next one and the end are kept on the stack
+        emitf(compiler, ".LparallelBody%lu:\n", label);
+        emitLine(compiler, "    push %rsi");
+        emitLine(compiler, "    push %rdi");
+        emitf(compiler, ".LparallelLoop%lu:\n", label);
+        emitLine(compiler, "    mov (%rsp), %rax");
+        emitLine(compiler, "    cmp 8(%rsp), %rax");
+        emitf(compiler, "    jae .LparallelExit%lu\n", label);
+        emitf(compiler, "    mov %%rax, %ld(%%rbp)\n", variableOffset);
+        bool parallelBody = compiler -> parallelBody;
+        compiler -> parallelBody = true;
+        block(compiler, effects, currentFunction);
+        compiler -> parallelBody = parallelBody;
+        emitLine(compiler, "    incq (%rsp)");
+        emitf(compiler, "    jmp .LparallelLoop%lu\n", label);
+        emitf(compiler, ".LparallelExit%lu:\n", label);
+        emitLine(compiler, "    add $16, %rsp");
+        emitLine(compiler, "    ret");
+        emitf(compiler, ".LparallelEnd%lu:\n", label);
 
         return true;
     }
@@ -533,52 +854,39 @@ bool statement(Compiler* compiler, bool effects, optionalSlice currentFunction)
 
     if (sliceEqualString(id.item, "fun")) {
         // fun ... 
+        uint64_t line = lineOf(compiler, id.item.start);
         optionalSlice functionName = consumeIdentifier(compiler);
-        if (!functionName.exists) {
+        if (!functionName.exists || sliceEqualString(functionName.item, "array") ||
+                sliceEqualString(functionName.item, "pfor") || findIntrinsic(functionName.item) != INTRINSIC_NONE) {
             fail(compiler);
         }
-        compiler -> symbolTable = mapCreate();
-
-        int64_t numParams = 0;
+        functionName.item = declaredName(compiler, functionName.item);
+        UnorderedMap* topLevelTable = compiler -> symbolTable;
+        compiler -> symbolTable = mapCreate(compiler -> stats);
 
         consume(compiler, "(");
-        char* beforePointer = compiler -> current;
-
-        // find the number of parameters in this function to malloc the parameter array
-        while (!consume(compiler, ")")) {
-            optionalSlice parameterName = consumeIdentifier(compiler);
-            if (!parameterName.exists) {
-                fail(compiler);
-            }
-            numParams++;
-            consume(compiler, ",");
-        }
-
-        compiler -> current = beforePointer;
-
-        int64_t offset = (numParams * 8) + 8;
-
-        // consume parameters
-        while (!consume(compiler, ")")) {
-            optionalSlice parameterName = consumeIdentifier(compiler);
-            if (!parameterName.exists) {
-                fail(compiler);
-            }
-            mapInsert(compiler -> symbolTable, parameterName.item, offset);
-            offset -= 8;
-            consume(compiler, ",");
-        }
+        char* params = compiler -> current;
+        int64_t numParams = declareParameters(compiler, params, 8);
+        uint64_t functionIndex = addFunction(compiler, functionName.item, line, params, numParams);
 
         consumeOrFail(compiler, "{");
         uint64_t countBrackets = 1;
 
-        beforePointer = compiler -> current;
+        char* beforePointer = compiler -> current;
+        compiler -> functions[functionIndex].returnExpression = findReturnExpression(compiler, beforePointer, functionName.item);
+        compiler -> functions[functionIndex].pure = isPureBody(compiler, beforePointer, functionName.item);
+        prepareEvaluation(compiler, functionIndex, beforePointer);
+        phaseBegin(compiler -> stats, PHASE_LOCAL_SCAN);
         
         // points to the last place where there was a newline character
         char* newlinePointer = compiler -> current;
-        offset = -8;
+        int64_t offset = -8;
 
         while (countBrackets > 0) {
+            if (compiler -> current[0] == 0) {
+                // the body doesn't end
+                fail(compiler);
+            }
             if (compiler -> current[0] == '}') {
                 countBrackets--;
                 compiler -> current++;
@@ -592,6 +900,13 @@ bool statement(Compiler* compiler, bool effects, optionalSlice currentFunction)
             if (compiler -> current[0] == '\n') {
                 newlinePointer = compiler -> current;
                 compiler -> current++;
+
+                // the variable of a pfor is a local too
+                optionalSlice variable = parallelVariable(compiler -> current);
+                if (variable.exists && !mapContains(compiler -> symbolTable, variable.item)) {
+                    mapInsert(compiler -> symbolTable, variable.item, offset);
+                    offset -= 8;
+                }
                 continue;
             }
 
@@ -620,15 +935,49 @@ bool statement(Compiler* compiler, bool effects, optionalSlice currentFunction)
             compiler -> current = currentPointer;
         }
 
+        offset = shareSlots(compiler, beforePointer, compiler -> current, offset);
+        statsBytes(compiler -> stats, (uint64_t)(compiler -> current - beforePointer));
+        phaseEnd(compiler -> stats);
+
+        if (compiler -> options.profileCycles) {
+            // a slot for the cycle count at entry
+            compiler -> cycleOffset = offset;
+            offset -= 8;
+        }
+
         // parse through second time, this time actually writing the assembly code 
         compiler -> current = beforePointer;
 
-        printf("._.");
-        printSlice(functionName.item);
-        printf(":\n");
-        puts("    push %rbp");
-        puts("    mov %rsp, %rbp");
-        printf("    sub $%ld, %%rsp\n", -1*(offset+8));
+        // with a profile functions are laid out once they have all been compiled
+        FunctionInfo* function = &(compiler -> functions[functionIndex]);
+        FILE* out = compiler -> out;
+        bool reachable = isReachable(compiler, functionName.item);
+        DeadFunction dead;
+        if (!reachable) {
+            beginDeadFunction(compiler, &dead);
+        }
+        else if (compiler -> profileData != NULL) {
+            compiler -> out = open_memstream(&(function -> code), &(function -> codeLength));
+        }
+
+        debugFunctionStart(compiler, functionName.item);
+        if (shouldMemoize(compiler, function)) {
+            // ends with the ._.<name>.body label
+            emitMemoWrapper(compiler, function);
+            function -> memoized = true;
+        }
+        else {
+            emitf(compiler, "._.");
+            emitSlice(compiler, functionName.item);
+            emitf(compiler, ":\n");
+        }
+        debugLine(compiler, line);
+        emitLine(compiler, "    push %rbp");
+        emitLine(compiler, "    mov %rsp, %rbp");
+        emitf(compiler, "    sub $%ld, %%rsp\n", -1*(offset+8));
+        compiler -> frameLocals = (uint64_t)(-1*(offset+8));
+        compiler -> frameParams = (uint64_t) numParams;
+        profileFunctionEntry(compiler, functionName.item, line);
 
         countBrackets = 1;
         while (countBrackets > 0) {
@@ -640,30 +989,72 @@ bool statement(Compiler* compiler, bool effects, optionalSlice currentFunction)
                 countBrackets++;
                 continue;
             }
-            statement(compiler, effects, functionName);
+            if (!statement(compiler, effects, functionName)) {
+                fail(compiler);
+            }
         }
 
-        puts("    mov %rbp, %rsp");
-        puts("    pop %rbp");
-        puts("    xor %eax, %eax");         // default return value is 0
-        puts("    ret");
+        profileFunctionExit(compiler);
+        emitLine(compiler, "    mov %rbp, %rsp");
+        emitLine(compiler, "    pop %rbp");
+        emitLine(compiler, "    xor %eax, %eax");         // default return value is 0
+        emitLine(compiler, "    ret");
+        debugFunctionEnd(compiler, functionName.item);
+
+        if (!reachable) {
+            endDeadFunction(compiler, &dead);
+        }
+        else if (compiler -> profileData != NULL) {
+            fclose(compiler -> out);
+            compiler -> out = out;
+        }
 
         freeMap(compiler -> symbolTable);
+        compiler -> symbolTable = topLevelTable;
 
         return true;
     }
 
     if (consume(compiler, "=")) {
-        expression(compiler, effects);
+        if (!mapContains(compiler -> symbolTable, id.item)) {
+            // outside a function there are no variables
+            fail(compiler);
+        }
+        assignment(compiler, effects, mapGet(compiler -> symbolTable, id.item));
 
-        puts("    pop %rdi");
-        printf("    mov %%rdi, %ld(%%rbp)\n", mapGet(compiler -> symbolTable, id.item));
+        return true;
+    }
+    else if (consume(compiler, "[")) {
+        // a[i] = v, or a[i][j] = v
+        emitf(compiler, "    push %ld(%%rbp)\n", mapGet(compiler -> symbolTable, id.item));
+        expression(compiler, effects);
+        consumeOrFail(compiler, "]");
+        while (consume(compiler, "[")) {
+            emitArrayLoad(compiler);
+            expression(compiler, effects);
+            consumeOrFail(compiler, "]");
+        }
+        consumeOrFail(compiler, "=");
+        expression(compiler, effects);
+        emitArrayStore(compiler);
 
         return true;
     }
     else {
         // can have a stand-alone function call without doing (var) = (function call)
         if (consume(compiler, "(")) {
+            // a pure call that can be evaluated does nothing
+            if (foldCalls(compiler, (char*)(id.item.start), true).exists) {
+                return true;
+            }
+
+            // an intrinsic leaves its value, which nothing uses
+            Intrinsic intrinsic = findIntrinsic(id.item);
+            if (intrinsic != INTRINSIC_NONE) {
+                intrinsicCall(compiler, intrinsic, effects);
+                emitLine(compiler, "    pop %rax");
+                return true;
+            }
 
             // this is a function call
             uint64_t numParams = 0;
@@ -672,11 +1063,11 @@ bool statement(Compiler* compiler, bool effects, optionalSlice currentFunction)
                 consume(compiler, ",");
                 numParams++;
             }
-            printf("    call ._.");
-            printSlice(id.item);
-            printf("\n");
+            emitf(compiler, "    call ._.");
+            emitSlice(compiler, id.item);
+            emitf(compiler, "\n");
             for (size_t i = 0; i < numParams; i++) {
-                puts("    pop %r15");            // pop the parameters that were just pushed onto the stack
+                emitLine(compiler, "    pop %r15");            // pop the parameters that were just pushed onto the stack
             }
         }
 
@@ -691,17 +1082,293 @@ void statements(Compiler* compiler, bool effects) {
     while (statement(compiler, effects, slice));
 }
 
+// returns a NUL terminated copy of the source without its comments
+char* stripComments(char const *source, uint64_t length, Stats* stats) {
+    phaseBegin(stats, PHASE_STRIP_COMMENTS);
+    uint64_t index = 0;
+    char* prog = (char*)(malloc(sizeof(char) * (length + 1)));
+    statsAlloc(stats, length + 1);
+
+    // memchr looks at a vector of bytes at a time
+    char const *cursor = source;
+    char const *end = source + length;
+    while (cursor < end) {
+        char const *comment = (char const *) (memchr(cursor, '#', (size_t)(end - cursor)));
+        char const *copyEnd = comment == NULL ? end : comment;
+        memcpy(prog + index, cursor, (size_t)(copyEnd - cursor));
+        index += (uint64_t)(copyEnd - cursor);
+        if (comment == NULL) {
+            break;
+        }
+
+        // this line is a comment, skip it
+        char const *newline = (char const *) (memchr(comment, '\n', (size_t)(end - comment)));
+        cursor = newline == NULL ? end : newline;
+    }
+    prog[index] = 0;
+    statsBytes(stats, length);
+    phaseEnd(stats);
+    return prog;
+}
+
+// ._.cpuDetect, called once by main, and the fallbacks of emitBitCount: the argument is in %rdi, the
+// result goes in %rax and only %rcx changes
+void emitIntrinsicRuntime(Compiler* compiler) {
+    emitLine(compiler, "    .bss");
+    emitLine(compiler, "._.cpuFeatures: .zero 8");
+    emitLine(compiler, "    .text");
+
+    emitLine(compiler, "._.cpuDetect:");
+    emitLine(compiler, "    xor %esi, %esi");
+    emitLine(compiler, "    mov $1, %eax");
+    emitLine(compiler, "    cpuid");
+    emitLine(compiler, "    bt $23, %ecx");                    // popcnt
+    emitLine(compiler, "    jnc ._.cpuDetectLzcnt");
+    emitf(compiler, "    or $%d, %%esi\n", CPU_POPCNT);
+    emitLine(compiler, "._.cpuDetectLzcnt:");
+    emitLine(compiler, "    mov $0x80000001, %eax");
+    emitLine(compiler, "    cpuid");
+    emitLine(compiler, "    bt $5, %ecx");                     // abm
+    emitLine(compiler, "    jnc ._.cpuDetectTzcnt");
+    emitf(compiler, "    or $%d, %%esi\n", CPU_LZCNT);
+    emitLine(compiler, "._.cpuDetectTzcnt:");
+    emitLine(compiler, "    xor %eax, %eax");
+    emitLine(compiler, "    cpuid");
+    emitLine(compiler, "    cmp $7, %eax");
+    emitLine(compiler, "    jb ._.cpuDetectDone");
+    emitLine(compiler, "    mov $7, %eax");
+    emitLine(compiler, "    xor %ecx, %ecx");
+    emitLine(compiler, "    cpuid");
+    emitLine(compiler, "    bt $3, %ebx");                     // bmi1
+    emitLine(compiler, "    jnc ._.cpuDetectDone");
+    emitf(compiler, "    or $%d, %%esi\n", CPU_TZCNT);
+    emitLine(compiler, "._.cpuDetectDone:");
+    emitLine(compiler, "    mov %rsi, ._.cpuFeatures(%rip)");
+    emitLine(compiler, "    ret");
+
+    // adds up the bits in pairs, nibbles and bytes, then the bytes with a multiply
+    emitLine(compiler, "._.popcount:");
+    emitLine(compiler, "    mov %rdi, %rax");
+    emitLine(compiler, "    shr %rax");
+    emitLine(compiler, "    movabs $0x5555555555555555, %rcx");
+    emitLine(compiler, "    and %rcx, %rax");
+    emitLine(compiler, "    sub %rax, %rdi");
+    emitLine(compiler, "    movabs $0x3333333333333333, %rcx");
+    emitLine(compiler, "    mov %rdi, %rax");
+    emitLine(compiler, "    and %rcx, %rax");
+    emitLine(compiler, "    shr $2, %rdi");
+    emitLine(compiler, "    and %rcx, %rdi");
+    emitLine(compiler, "    add %rdi, %rax");
+    emitLine(compiler, "    mov %rax, %rdi");
+    emitLine(compiler, "    shr $4, %rdi");
+    emitLine(compiler, "    add %rdi, %rax");
+    emitLine(compiler, "    movabs $0x0F0F0F0F0F0F0F0F, %rcx");
+    emitLine(compiler, "    and %rcx, %rax");
+    emitLine(compiler, "    movabs $0x0101010101010101, %rcx");
+    emitLine(compiler, "    imul %rcx, %rax");
+    emitLine(compiler, "    shr $56, %rax");
+    emitLine(compiler, "    ret");
+
+    // bsr and bsf leave the destination undefined for 0
+    emitLine(compiler, "._.clz:");
+    emitLine(compiler, "    mov $-1, %rcx");
+    emitLine(compiler, "    bsr %rdi, %rax");
+    emitLine(compiler, "    cmovz %rcx, %rax");
+    emitLine(compiler, "    mov $63, %ecx");
+    emitLine(compiler, "    sub %rax, %rcx");
+    emitLine(compiler, "    mov %rcx, %rax");
+    emitLine(compiler, "    ret");
+
+    emitLine(compiler, "._.ctz:");
+    emitLine(compiler, "    mov $64, %ecx");
+    emitLine(compiler, "    bsf %rdi, %rax");
+    emitLine(compiler, "    cmovz %rcx, %rax");
+    emitLine(compiler, "    ret");
+}
+
+// the entry point and the runtime support every program needs
+void prelude(Compiler* compiler) {
+    debugFile(compiler);
+    emitLine(compiler, "    .data");
+    emitLine(compiler, "format: .byte '%', 'l', 'u', 10, 0");
+    emitLine(compiler, "    .text");
+    emitLine(compiler, "    .global main");
+    emitLine(compiler, "    .extern printf");
+    
+    emitLine(compiler, "main:");
+    emitLine(compiler, "    push %r12");
+    emitLine(compiler, "    push %r13");
+    emitLine(compiler, "    push %r14");
+    emitLine(compiler, "    push %r15");
+    emitLine(compiler, "    push %rbp");
+    emitLine(compiler, "    push %rbx");
+    emitLine(compiler, "    call ._.cpuDetect");
+    emitStackSwitch(compiler);
+    emitLine(compiler, "    call ._.main");
+    emitStackRestore(compiler);
+    if (compiler -> options.profile) {
+        emitLine(compiler, "    push %rax");
+        emitLine(compiler, "    call ._.profDump");
+        emitLine(compiler, "    pop %rax");
+    }
+    emitLine(compiler, "    pop %r12");
+    emitLine(compiler, "    pop %r13");
+    emitLine(compiler, "    pop %r14");
+    emitLine(compiler, "    pop %r15");
+    emitLine(compiler, "    pop %rbp");
+    emitLine(compiler, "    pop %rbx");
+    emitLine(compiler, "    ret");
+
+    emitLine(compiler, "._.print:");
+    emitLine(compiler, "    push %rbp");
+    emitLine(compiler, "    mov %rsp, %rbp");
+    emitLine(compiler, "    and $0xFFFFFFFFFFFFFFF0, %rsp");
+    emitLine(compiler, "    xor %eax, %eax");
+    emitLine(compiler, "    mov 16(%rbp), %rsi");              // maybe change later
+    emitLine(compiler, "    lea format(%rip), %rdi");
+    emitLine(compiler, "    call printf");
+    emitLine(compiler, "    mov %rbp, %rsp");
+    emitLine(compiler, "    xor %eax, %eax");
+    emitLine(compiler, "    pop %rbp");
+    emitLine(compiler, "    ret");
+
+    emitArrayRuntime(compiler);
+    emitIntrinsicRuntime(compiler);
+}
+
 void run(Compiler* compiler) {
+    findReachable(compiler);
+    phaseBegin(compiler -> stats, PHASE_CODEGEN);
+    prelude(compiler);
     statements(compiler, true);
     endOrFail(compiler);
+    emitFunctionsByHeat(compiler);
+    emitProfileDump(compiler);
+    emitStackOverflowHandler(compiler);
+    emitParallelRuntime(compiler);
+    statsBytes(compiler -> stats, (uint64_t)(compiler -> current - compiler -> program));
+    phaseEnd(compiler -> stats);
 }
 
-Compiler* compilerConstructor(char* prog) {
-    Compiler* compiler = (Compiler*) (malloc(sizeof(Compiler)));
+// run for --stream, the program is read from in as it is compiled (see stream.h)
+void runStream(Compiler* compiler, FILE* in) {
+    Source source = sourceCreate(in, compiler -> stats);
+    phaseBegin(compiler -> stats, PHASE_CODEGEN);
+    prelude(compiler);
+    while (readChunk(&source, compiler -> stats)) {
+        uint64_t first = compiler -> countFunctions;
+        beginChunk(compiler, &source);
+        statements(compiler, true);
+        endOrFail(compiler);
+        endChunk(compiler, &source, first);
+        statsBytes(compiler -> stats, source.length);
+    }
+    emitProfileDump(compiler);
+    emitStackOverflowHandler(compiler);
+    emitParallelRuntime(compiler);
+    phaseEnd(compiler -> stats);
+    sourceFree(&source);
+}
+
+// gets the compiler ready for another program, the tables and arrays keep their memory
+// (options, failJump and profileData are left alone)
+void compilerReset(Compiler* compiler, char* prog, FILE* out, Stats* stats) {
     compiler -> program = prog;
     compiler -> current = prog;
+    compiler -> programLine = 1;
+    compiler -> programOffset = 0;
     compiler -> countIf = 0;
     compiler -> countWhile = 0;
-    
+    compiler -> countIntrinsic = 0;
+    compiler -> countParallel = 0;
+    compiler -> parallelBody = false;
+    compiler -> out = out;
+    compiler -> stats = stats;
+    compiler -> countCounters = 0;
+    compiler -> countSlots = 0;
+    compiler -> functionSlot = 0;
+    compiler -> cycleOffset = 0;
+    compiler -> countFunctions = 0;
+    mapClear(compiler -> functionTable, stats);
+    mapClear(compiler -> reachable, stats);
+    mapClear(compiler -> symbolTable, stats);
+    compiler -> retainedBytes = 0;
+    astPoolReset(compiler -> bodies, stats);
+    compiler -> foldFuel = FOLD_TOTAL_FUEL;
+    compiler -> foldExhaustedStart = NULL;
+    compiler -> foldExhaustedEnd = NULL;
+    compiler -> coldCode = NULL;
+    compiler -> coldCodeText = NULL;
+    compiler -> coldCodeLength = 0;
+    compiler -> lineCursor = prog;
+    compiler -> lineNumber = 1;
+    compiler -> countOperators = 0;
+    compiler -> countOperands = 0;
+    compiler -> stackNesting = 0;
+    compiler -> astNesting = 0;
+    forgetScans(compiler);
+}
+
+Compiler* compilerConstructor(char* prog, FILE* out, Stats* stats) {
+    Compiler* compiler = (Compiler*) (malloc(sizeof(Compiler)));
+    statsAlloc(stats, sizeof(Compiler));
+    compiler -> failJump = NULL;
+    compiler -> options = (Options) { 0 };
+    compiler -> counters = NULL;
+    compiler -> capacityCounters = 0;
+    compiler -> functions = NULL;
+    compiler -> capacityFunctions = 0;
+    compiler -> functionTable = mapCreate(stats);
+    compiler -> reachable = mapCreate(stats);
+    compiler -> symbolTable = mapCreate(stats);
+    compiler -> bodies = (AstPool*) (malloc(sizeof(AstPool)));
+    statsAlloc(stats, sizeof(AstPool));
+    *(compiler -> bodies) = astPoolCreate(stats);
+    compiler -> trees = (AstPool*) (malloc(sizeof(AstPool)));
+    statsAlloc(stats, sizeof(AstPool));
+    *(compiler -> trees) = astPoolCreate(stats);
+    compiler -> profileData = NULL;
+    compiler -> operators = NULL;
+    compiler -> capacityOperators = 0;
+    compiler -> operands = NULL;
+    compiler -> capacityOperands = 0;
+    compiler -> foldOpen = NULL;
+    compiler -> capacityFoldOpen = 0;
+    compilerReset(compiler, prog, out, stats);
+
     return compiler;
 }
+
+// after fail() jumped out of run(): closes what the function it was in had open and puts
+// the symbol table of the top level back, so the compiler can be reset or freed
+// (not for -fprofile-use, whose cold regions live on the stack fail() unwound)
+void compilerAbandon(Compiler* compiler, FILE* out, UnorderedMap* topLevelTable) {
+    if (compiler -> out != out) {
+        fclose(compiler -> out);
+        compiler -> out = out;
+    }
+    if (compiler -> symbolTable != topLevelTable) {
+        freeMap(compiler -> symbolTable);
+        compiler -> symbolTable = topLevelTable;
+    }
+}
+
+void compilerFree(Compiler* compiler) {
+    for (uint64_t i = 0; i < compiler -> countFunctions; i++) {
+        free(compiler -> functions[i].code);
+    }
+    free(compiler -> functions);
+    free(compiler -> counters);
+    freeMap(compiler -> functionTable);
+    freeMap(compiler -> reachable);
+    freeMap(compiler -> symbolTable);
+    astPoolFree(compiler -> bodies);
+    free(compiler -> bodies);
+    astPoolFree(compiler -> trees);
+    free(compiler -> trees);
+    free(compiler -> coldCodeText);
+    free(compiler -> operators);
+    free(compiler -> operands);
+    free(compiler -> foldOpen);
+    free(compiler);
+}
@@ -10,9 +10,13 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdarg.h>
+#include <setjmp.h>
 
 // Implementation includes
 #include "mapc.h"
+#include "intrinsics.h"
+#include "scan.h"
 
 // optional -> allows one to check if a slice/int was returned/exists
 #define optional(type) struct { bool exists; type item; }
@@ -20,24 +24,246 @@
 typedef optional(Slice) optionalSlice;
 typedef optional(uint64_t) optionalInt;
 
+// options set on the command line
+typedef struct Options {
+    bool profile;                       // -fprofile: count function calls, loop iterations and if arms
+    bool profileCycles;                 // -fprofile=cycles: also count the cycles spent in functions
+    bool memoize;                       // -fmemoize: cache the results of pure functions
+    bool noFoldCalls;                   // -fno-fold-calls: don't evaluate pure calls at compile time
+    bool noBoundsCheck;                 // -fno-bounds-check: array indexes aren't checked
+    bool noSelect;                      // -fno-select: every expression goes through the stack
+    bool noShareSlots;                  // -fno-share-slots: every local has a stack slot of its own
+    uint64_t unroll;                    // -funroll: copies of the body of counted loops, 0 for the default
+    char const *debugSource;            // -g: the source file the line table names, NULL without -g
+    uint64_t stackSize;                 // -fstack-size: bytes of the stack ._.main runs on, 0 for the process stack
+    bool stream;                        // --stream: read and compile one top level function at a time
+} Options;
+
+typedef enum CounterKind {
+    COUNTER_FUNCTION,                   // calls and cycles
+    COUNTER_LOOP,                       // iterations
+    COUNTER_IF,                         // executions and times the then arm was taken
+    COUNTER_MEMO                        // cache hits and misses of a memoized function
+} CounterKind;
+
+typedef struct ProfileCounter {
+    CounterKind kind;
+    Slice function;                     // the function the counter belongs to
+    uint64_t line;
+    uint64_t slot;                      // index in the counter table
+} ProfileCounter;
+
+// a profile read with -fprofile-use, indexed by source line
+typedef struct ProfileData {
+    UnorderedMap* calls;                // function name -> calls
+    uint64_t lines;                     // size of the tables below
+    uint64_t* thenCounts;
+    uint64_t* elseCounts;
+} ProfileData;
+
+typedef struct FunctionInfo {
+    Slice name;
+    uint64_t line;
+    uint64_t numParams;
+    char* params;                       // just after the "(" of the parameter list
+    char* returnExpression;             // e when the body is just "return e" (and e doesn't recurse), NULL otherwise
+    bool inlining;                      // returnExpression is being compiled in place of a call
+    bool pure;                          // no prints, only calls pure functions
+    bool evaluable;                     // pure and body has a tree (see interpreter.h)
+    char* bodyText;                     // body of a pure function whose tree hasn't been parsed yet
+    struct Ast* body;
+    uint64_t numSlots;                  // parameters and locals in body
+    bool memoized;                      // the code is at ._.<name>.body, ._.<name> looks up the cache
+    char* code;                         // generated code when functions are laid out after compiling them all
+    size_t codeLength;
+} FunctionInfo;
+
+// binary operators, the ones two characters long first so "<=" isn't read as "<"
+typedef enum Operator {
+    OP_SHL,
+    OP_SHR,
+    OP_LE,
+    OP_GE,
+    OP_EQ,
+    OP_NE,
+    OP_AND,
+    OP_OR,
+    OP_MUL,
+    OP_DIV,
+    OP_MOD,
+    OP_ADD,
+    OP_SUB,
+    OP_LT,
+    OP_GT,
+    OP_BIT_AND,
+    OP_BIT_XOR,
+    OP_BIT_OR,
+    OP_BINARY_COUNT,
+
+    // only on the operator stack of parseExpression
+    OP_NOT = OP_BINARY_COUNT,           // ! an odd number of times
+    OP_BOOL,                            // ! an even number of times
+    OP_PAREN                            // a "(" not closed yet
+} Operator;
+
+// a value on the operand stack of parseExpression, what it is depends on who parses
+typedef union Operand {
+    uint64_t value;                     // the constant folder
+    struct Ast* ast;                    // trees (ast.h)
+} Operand;
+
 typedef struct Compiler {
     char* program;
     char* current;
+    uint64_t programLine;               // line of program[0] in the source (1 unless --stream
+    uint64_t programOffset;             // compiles it a chunk at a time, see stream.h)
     uint64_t countIf;
     uint64_t countWhile;
-    UnorderedMap* symbolTable;          // maps variables to offsets
+    uint64_t countIntrinsic;            // labels of the intrinsics that check ._.cpuFeatures
+    uint64_t countParallel;             // pfor loops, each has a .LparallelBody<n>
+    bool parallelBody;                  // compiling the body of a pfor
+    UnorderedMap* symbolTable;          // maps variables to offsets, empty outside functions
+    FILE* out;                          // where the generated assembly goes
+    Stats* stats;
+    jmp_buf* failJump;                  // set when compiling in-process, fail() jumps here instead of exiting
+    Options options;
+
+    // profiling counters (see profile.h)
+    ProfileCounter* counters;
+    uint64_t countCounters;
+    uint64_t capacityCounters;
+    uint64_t countSlots;
+    uint64_t functionSlot;              // call counter of the function being compiled
+    int64_t cycleOffset;                // frame offset holding the cycle count at entry
+
+    // frame of the function being compiled, the body of a pfor runs on copies of it
+    uint64_t frameLocals;               // bytes below %rbp
+    uint64_t frameParams;
+
+    // functions declared so far
+    FunctionInfo* functions;
+    uint64_t countFunctions;
+    uint64_t capacityFunctions;
+    UnorderedMap* functionTable;        // maps function names to their index in functions
+    UnorderedMap* reachable;            // functions that are emitted (see reach.h)
+    uint64_t retainedBytes;             // their text kept by --stream (see stream.h)
+    struct AstPool* bodies;             // trees of the functions that can be evaluated at compile time
+    struct AstPool* trees;              // the expression instructions are being selected for
+    uint64_t foldFuel;                  // what is left of FOLD_TOTAL_FUEL
+    char const *foldExhaustedStart;     // the last expression that ran out of fuel
+    char const *foldExhaustedEnd;
+
+    // profile guided optimization (see profile.h)
+    ProfileData* profileData;           // NULL without -fprofile-use
+    FILE* coldCode;                     // code moved out of the way of the hot paths
+    char* coldCodeText;
+    size_t coldCodeLength;
+
+    // last position whose line number was computed
+    char const *lineCursor;
+    uint64_t lineNumber;
+
+    // what the scans for names ahead found, so an expression inside another one (an argument, a
+    // parenthesis) doesn't scan the rest of the line again: from checkFrom on, the first name that
+    // isn't an intrinsic (or the end of the line) is at checkStop. For foldCandidate, from foldFrom
+    // on foldStop is the first '[', name that isn't called or end of the line, foldLastCall the last
+    // call before it and foldOpen the parentheses still open at foldStop.
+    char const *checkFrom;
+    char const *checkStop;
+    char const *foldFrom;
+    char const *foldStop;
+    char const *foldLastCall;
+    char const **foldOpen;
+    uint64_t countFoldOpen;
+    uint64_t capacityFoldOpen;
+
+    // stacks of parseExpression, an expression inside another one (an argument) goes on top
+    Operator* operators;
+    uint64_t countOperators;
+    uint64_t capacityOperators;
+    Operand* operands;
+    uint64_t countOperands;
+    uint64_t capacityOperands;
+    uint64_t stackNesting;              // parenthesized expressions the stack machine is inside of
+    uint64_t astNesting;                // parseOr calls the tree parser is inside of
 } Compiler;
 
+// line number (starting at 1) of a position in the program
+uint64_t lineOf(Compiler* compiler, char const *position) {
+    // unrolled loops go back over their text, the lines between are counted back
+    while (compiler -> lineCursor > position && compiler -> lineCursor > compiler -> program) {
+        compiler -> lineCursor--;
+        if (*(compiler -> lineCursor) == '\n') {
+            compiler -> lineNumber--;
+        }
+    }
+    while (compiler -> lineCursor < position) {
+        if (*(compiler -> lineCursor) == '\n') {
+            compiler -> lineNumber++;
+        }
+        compiler -> lineCursor++;
+    }
+    return compiler -> lineNumber;
+}
+
+// the text the scans ahead were of is gone (a new program or chunk)
+void forgetScans(Compiler* compiler) {
+    compiler -> checkFrom = NULL;
+    compiler -> checkStop = NULL;
+    compiler -> foldFrom = NULL;
+    compiler -> foldStop = NULL;
+}
+
 void fail(Compiler* compiler) {
-    printf("failed at offset %ld\n", (size_t)(compiler -> current - compiler -> program));
+    if (compiler -> failJump != NULL) {
+        longjmp(*(compiler -> failJump), 1);
+    }
+    printf("failed at line %lu (offset %ld)\n", lineOf(compiler, compiler -> current),
+           (size_t)(compiler -> current - compiler -> program) + compiler -> programOffset);
     printf("%s\n", compiler -> current);
     exit(1);
 }
 
-void endOrFail(Compiler* compiler) {
-    while (isspace(*(compiler -> current))) {
-        compiler -> current++;
+// Calls nest by recursing: the stack machine compiles their arguments from primary, the tree
+// parser parses them from parseOr. A program nesting them deeper than this fails here rather
+// than running out of native stack (a level takes a few hundred bytes of it).
+#define EXPRESSION_MAX_NESTING 4096
+
+void checkNesting(Compiler* compiler) {
+    if (compiler -> stackNesting + compiler -> astNesting > EXPRESSION_MAX_NESTING) {
+        fail(compiler);
     }
+}
+
+// counts lines of generated code that are instructions (not labels or directives)
+void countInstruction(Compiler* compiler, char const *line) {
+    if (line[0] == ' ' && line[1] == ' ' && line[2] == ' ' && line[3] == ' ' && line[4] != '.') {
+        compiler -> stats -> instructions++;
+    }
+}
+
+// writes one line of generated code
+void emitLine(Compiler* compiler, char const *line) {
+    countInstruction(compiler, line);
+    fputs(line, compiler -> out);
+    fputc('\n', compiler -> out);
+}
+
+// writes formatted generated code
+void emitf(Compiler* compiler, char const *format, ...) {
+    countInstruction(compiler, format);
+    va_list args;
+    va_start(args, format);
+    vfprintf(compiler -> out, format, args);
+    va_end(args);
+}
+
+void emitSlice(Compiler* compiler, Slice const slice) {
+    fwrite(slice.start, 1, slice.len, compiler -> out);
+}
+
+void endOrFail(Compiler* compiler) {
+    compiler -> current = (char*) scanSpace(compiler -> current);
     if (*(compiler -> current) != 0) {
         fail(compiler);
     }
@@ -45,9 +271,7 @@ void endOrFail(Compiler* compiler) {
 
 // skips past all white space
 void skip(Compiler* compiler) {
-    while (isspace(*(compiler -> current))) {
-        compiler -> current++;
-    }
+    compiler -> current = (char*) scanSpace(compiler -> current);
 }
 
 // consumes to check if the current line matches str
@@ -61,6 +285,7 @@ bool consume(Compiler* compiler, char const *str) {
       if (expected == 0) {
         // survived to the end of the expected string 
         compiler -> current += i;
+        compiler -> stats -> tokens++;
         return true;
       }
       if (expected != found) {
@@ -71,6 +296,17 @@ bool consume(Compiler* compiler, char const *str) {
     }
 }
 
+// consumes a one character operator unless it is doubled ("&" but not "&&")
+bool consumeSingle(Compiler* compiler, char op) {
+    skip(compiler);
+    if (compiler -> current[0] != op || compiler -> current[1] == op) {
+        return false;
+    }
+    compiler -> current++;
+    compiler -> stats -> tokens++;
+    return true;
+}
+
 void consumeOrFail(Compiler* compiler, char const *str) {
     if (!consume(compiler, str)) {
         fail(compiler);
@@ -81,13 +317,11 @@ void consumeOrFail(Compiler* compiler, char const *str) {
 optionalSlice consumeIdentifier(Compiler* compiler) {
     skip(compiler);
 
-    if (isalpha(*(compiler -> current))) {
+    if (isAlphaByte(*(compiler -> current))) {
         char const *start = compiler -> current;
+        compiler -> current = (char*) scanAlnum(start + 1);
 
-        do {
-            compiler -> current++;
-        } while(isalnum(*(compiler -> current)));
-
+        compiler -> stats -> tokens++;
         optionalSlice slice = { true, sliceConstructorLen(start, (size_t)(compiler -> current - start)) };
         return slice;
     }
@@ -101,14 +335,16 @@ optionalSlice consumeIdentifier(Compiler* compiler) {
 optionalInt consumeLiteral(Compiler* compiler) {
     skip(compiler);
 
-    if (isdigit(*(compiler -> current))) {
+    if (isDigitByte(*(compiler -> current))) {
         uint64_t v = 0;
+        char const *end = scanDigits(compiler -> current);
 
         do {
             v = 10 * v + ((*(compiler -> current)) - '0');
             compiler -> current++;
-        } while (isdigit(*(compiler -> current)));
+        } while (compiler -> current < end);
 
+        compiler -> stats -> tokens++;
         optionalInt opInt = { true, v };
         return opInt;
     }
@@ -137,220 +373,301 @@ void consumePast(Compiler* compiler) {
     }
 }
 
-// The plan is to honor as many C operators as possible with
-// the same precedence and associativity
-// e<n> implements operators with precedence 'n' (smaller is higher)
-
-uint64_t expressionCF(Compiler* compiler, bool effects);
-
-// () [] . -> ...
-uint64_t e1CF(Compiler* compiler, bool effects) {
-    optionalInt val = consumeLiteral(compiler);
-    if (val.exists) {
-        return val.item;
-    }
-
-    if (consume(compiler, "(")) {
-        uint64_t v = expressionCF(compiler, effects);
-        consume(compiler, ")");
-        return v;
-    }
-
-    fail(compiler);
-    return 0;
-}
-
-// ++ -- unary+ unary- ... (Right)
-uint64_t e2CF(Compiler* compiler, bool effects) {
-    bool neg = false;
-    bool encounteredNeg = false;
-
-    // logical not
-    while (true) {
-        if (consume(compiler, "!")) {
-            encounteredNeg = true;
-            neg = !neg;
-        }
-        else {
-            uint64_t v = e1CF(compiler, effects);
-            if (neg) {
-                v = v > 0 ? 0 : 1;
-            }
-            if (encounteredNeg && v > 1) {
-                v = 1;
-            }
-            return v;
+// Expressions are parsed by precedence climbing with explicit stacks (parseExpression):
+// every binary operator is a row of one table, and what an operand is and what an
+// operator does with its operands comes from handlers. The constant folder below computes
+// values, the stack machine of compiler.h emits code and ast.h builds trees.
+//
+// The precedences are those of C (smaller is higher), all operators are left associative.
+
+typedef struct OperatorInfo {
+    char const *text;
+    uint64_t precedence;
+} OperatorInfo;
+
+OperatorInfo const operatorInfo[] = {
+    [OP_SHL] = { "<<", 5 },
+    [OP_SHR] = { ">>", 5 },
+    [OP_LE] = { "<=", 6 },
+    [OP_GE] = { ">=", 6 },
+    [OP_EQ] = { "==", 7 },
+    [OP_NE] = { "!=", 7 },
+    [OP_AND] = { "&&", 11 },
+    [OP_OR] = { "||", 12 },
+    [OP_MUL] = { "*", 3 },
+    [OP_DIV] = { "/", 3 },
+    [OP_MOD] = { "%", 3 },
+    [OP_ADD] = { "+", 4 },
+    [OP_SUB] = { "-", 4 },
+    [OP_LT] = { "<", 6 },
+    [OP_GT] = { ">", 6 },
+    [OP_BIT_AND] = { "&", 8 },
+    [OP_BIT_XOR] = { "^", 9 },
+    [OP_BIT_OR] = { "|", 10 },
+    [OP_NOT] = { "!", 2 },
+    [OP_BOOL] = { "!!", 2 },
+    [OP_PAREN] = { "(", UINT64_MAX },   // no operator takes it off the stack
+};
+
+typedef struct ExpressionHandlers {
+    bool parentheses;                   // "( expression )" is parsed by parseExpression, not by operand
+
+    // parses an operand (with its own prefixes and suffixes) into result, false if there isn't one
+    bool (*operand)(Compiler* compiler, void* context, Operand* result);
+
+    // left = left op right, or left = op left for OP_NOT and OP_BOOL (right is NULL)
+    void (*apply)(Compiler* compiler, void* context, Operator op, Operand* left, Operand const *right);
+} ExpressionHandlers;
+
+// the operators of the table above by their first character, longer ones first
+typedef struct OperatorStart {
+    uint8_t count;
+    uint8_t candidates[3];
+} OperatorStart;
+
+OperatorStart const operatorStarts[256] = {
+    ['<'] = { 3, { OP_SHL, OP_LE, OP_LT } },
+    ['>'] = { 3, { OP_SHR, OP_GE, OP_GT } },
+    ['='] = { 1, { OP_EQ } },
+    ['!'] = { 1, { OP_NE } },
+    ['&'] = { 2, { OP_AND, OP_BIT_AND } },
+    ['|'] = { 2, { OP_OR, OP_BIT_OR } },
+    ['*'] = { 1, { OP_MUL } },
+    ['/'] = { 1, { OP_DIV } },
+    ['%'] = { 1, { OP_MOD } },
+    ['+'] = { 1, { OP_ADD } },
+    ['-'] = { 1, { OP_SUB } },
+    ['^'] = { 1, { OP_BIT_XOR } },
+};
+
+// consumes the binary operator at current, if there is one
+bool consumeOperator(Compiler* compiler, Operator* op) {
+    skip(compiler);
+    char const *current = compiler -> current;
+    OperatorStart const *start = &(operatorStarts[(uint8_t) current[0]]);
+    for (uint64_t i = 0; i < start -> count; i++) {
+        char const *text = operatorInfo[start -> candidates[i]].text;
+        if (text[1] == 0 || current[1] == text[1]) {
+            compiler -> current += text[1] == 0 ? 1 : 2;
+            compiler -> stats -> tokens++;
+            *op = (Operator) start -> candidates[i];
+            return true;
         }
     }
+    return false;
 }
 
-// * / % (Left)
-uint64_t e3CF(Compiler* compiler, bool effects) {
-    uint64_t v = e2CF(compiler, effects);
-
-    while (true) {
-        if (consume(compiler, "*")) {
-            v = v * e2CF(compiler, effects);
-        }
-        else if (consume(compiler, "/")) {
-            uint64_t right = e2CF(compiler, effects);
-            v = (right == 0) ? 0 : v / right;
-        }
-        else if (consume(compiler, "%")) {
-            uint64_t right = e2CF(compiler, effects);
-            v = (right == 0) ? 0 : v % right;
-        }
-        else {
-            return v;
-        }
+void pushOperator(Compiler* compiler, Operator op) {
+    if (compiler -> countOperators == compiler -> capacityOperators) {
+        compiler -> capacityOperators = compiler -> capacityOperators == 0 ? 64 : compiler -> capacityOperators * 2;
+        compiler -> operators = (Operator*) (realloc(compiler -> operators, sizeof(Operator) * compiler -> capacityOperators));
+        statsAlloc(compiler -> stats, sizeof(Operator) * compiler -> capacityOperators);
     }
+    compiler -> operators[compiler -> countOperators++] = op;
 }
 
-// (Left) + -
-uint64_t e4CF(Compiler* compiler, bool effects) {
-    uint64_t v = e3CF(compiler, effects);
-
-    while (true) {
-        if (consume(compiler, "+")) {
-            v = v + e3CF(compiler, effects);
-        }
-        else if (consume(compiler, "-")) {
-            v = v - e3CF(compiler, effects);
-        }
-        else {
-            return v;
-        }
+void pushOperand(Compiler* compiler, Operand operand) {
+    if (compiler -> countOperands == compiler -> capacityOperands) {
+        compiler -> capacityOperands = compiler -> capacityOperands == 0 ? 64 : compiler -> capacityOperands * 2;
+        compiler -> operands = (Operand*) (realloc(compiler -> operands, sizeof(Operand) * compiler -> capacityOperands));
+        statsAlloc(compiler -> stats, sizeof(Operand) * compiler -> capacityOperands);
     }
+    compiler -> operands[compiler -> countOperands++] = operand;
 }
 
-// << >>
-uint64_t e5CF(Compiler* compiler, bool effects) {
-    return e4CF(compiler, effects);
+// applies the operator on top of the stack to the operands on top of theirs
+void reduceOperator(Compiler* compiler, ExpressionHandlers const *handlers, void* context) {
+    Operator op = compiler -> operators[--(compiler -> countOperators)];
+    if (op == OP_NOT || op == OP_BOOL) {
+        handlers -> apply(compiler, context, op, &(compiler -> operands[compiler -> countOperands - 1]), NULL);
+    }
+    else {
+        Operand right = compiler -> operands[--(compiler -> countOperands)];
+        handlers -> apply(compiler, context, op, &(compiler -> operands[compiler -> countOperands - 1]), &right);
+    }
 }
 
-// < <= > >=
-uint64_t e6CF(Compiler* compiler, bool effects) {
-    uint64_t v = e5CF(compiler, effects);
+// Parses an expression at current into result. Parentheses only nest on the stacks, an
+// operator waits on the stack until the next one has a lower or equal precedence, so the
+// operands are applied left to right like the recursive descent over the precedence
+// levels did. An open "(" without its ")" ends with the expression. False if an operand
+// wasn't there (handlers that fail() never get that far).
+bool parseExpression(Compiler* compiler, ExpressionHandlers const *handlers, void* context, Operand* result) {
+    uint64_t operatorBase = compiler -> countOperators;
+    uint64_t operandBase = compiler -> countOperands;
+    uint64_t openParentheses = 0;
+    bool parsed = true;
 
     while (true) {
-        if (consume(compiler, "<=")) {
-            uint64_t u = e5CF(compiler, effects);
-            v = (v <= u) ? 1 : 0;
+        // prefixes
+        while (true) {
+            skip(compiler);
+            char next = compiler -> current[0];
+            if (next != '!' && next != '(') {
+                break;
+            }
+            if (consume(compiler, "!")) {
+                Operator* top = compiler -> countOperators > operatorBase ? &(compiler -> operators[compiler -> countOperators - 1]) : NULL;
+                if (top != NULL && (*top == OP_NOT || *top == OP_BOOL)) {
+                    *top = *top == OP_NOT ? OP_BOOL : OP_NOT;
+                }
+                else {
+                    pushOperator(compiler, OP_NOT);
+                }
+            }
+            else if (handlers -> parentheses && consume(compiler, "(")) {
+                pushOperator(compiler, OP_PAREN);
+                openParentheses++;
+            }
+            else {
+                break;
+            }
         }
-        else if (consume(compiler, ">=")) {
-            uint64_t u = e5CF(compiler, effects);
-            v = (v >= u) ? 1 : 0;
+
+        Operand operand;
+        if (!handlers -> operand(compiler, context, &operand)) {
+            parsed = false;
+            break;
         }
-        else if (consume(compiler, "<")) {
-            uint64_t u = e5CF(compiler, effects);
-            v = (v < u) ? 1 : 0;
+        pushOperand(compiler, operand);
+
+        // closing parentheses, then the next operator or the end
+        while (openParentheses > 0 && consume(compiler, ")")) {
+            while (compiler -> operators[compiler -> countOperators - 1] != OP_PAREN) {
+                reduceOperator(compiler, handlers, context);
+            }
+            compiler -> countOperators--;
+            openParentheses--;
         }
-        else if (consume(compiler, ">")) {
-            uint64_t u = e5CF(compiler, effects);
-            v = (v > u) ? 1 : 0;
+        Operator op;
+        if (!consumeOperator(compiler, &op)) {
+            break;
         }
-        else {
-            return v;
+        while (compiler -> countOperators > operatorBase &&
+                operatorInfo[compiler -> operators[compiler -> countOperators - 1]].precedence <= operatorInfo[op].precedence) {
+            reduceOperator(compiler, handlers, context);
         }
+        pushOperator(compiler, op);
     }
-}
 
-// == !=
-uint64_t e7CF(Compiler* compiler, bool effects) {
-    uint64_t v = e6CF(compiler, effects);
-
-    while (true) {
-        if (consume(compiler, "==")) {
-            uint64_t u = e6CF(compiler, effects);
-            v = (v == u) ? 1 : 0;
-        }
-        else if (consume(compiler, "!=")) {
-            uint64_t u = e6CF(compiler, effects);
-            v = (v != u) ? 1 : 0;
-        }
-        else {
-            return v;
+    if (parsed) {
+        while (compiler -> countOperators > operatorBase) {
+            if (compiler -> operators[compiler -> countOperators - 1] == OP_PAREN) {
+                compiler -> countOperators--;
+            }
+            else {
+                reduceOperator(compiler, handlers, context);
+            }
         }
+        *result = compiler -> operands[operandBase];
     }
+    compiler -> countOperators = operatorBase;
+    compiler -> countOperands = operandBase;
+    return parsed;
 }
 
-// (left) &
-uint64_t e8CF(Compiler* compiler, bool effects) {
-    return e7CF(compiler, effects);
-}
-
-// ^
-uint64_t e9CF(Compiler* compiler, bool effects) {
-    return e8CF(compiler, effects);
-}
-
-// |
-uint64_t e10CF(Compiler* compiler, bool effects) {
-    return e9CF(compiler, effects);
-}
-
-// &&
-uint64_t e11CF(Compiler* compiler, bool effects) {
-    uint64_t v = e10CF(compiler, effects);
+uint64_t expressionCF(Compiler* compiler, bool effects);
 
-    while (true) {
-        if (consume(compiler, "&&")) {
-            v = e10CF(compiler, effects) && v;
-        }
-        else {
-            return v;
-        }
+// a literal or a call to an intrinsic (checkExpression lets nothing else through)
+bool foldOperand(Compiler* compiler, void* context, Operand* result) {
+    optionalInt val = consumeLiteral(compiler);
+    if (val.exists) {
+        result -> value = val.item;
+        return true;
     }
-}
 
-// ||
-uint64_t e12CF(Compiler* compiler, bool effects) {
-    uint64_t v = e11CF(compiler, effects);
-    
-    while (true) {
-        if (consume(compiler, "||")) {
-            v = e11CF(compiler, effects) || v;
+    optionalSlice id = consumeIdentifier(compiler);
+    if (id.exists) {
+        Intrinsic intrinsic = findIntrinsic(id.item);
+        uint64_t arguments[INTRINSIC_MAX_ARGS];
+        if (intrinsic == INTRINSIC_NONE) {
+            fail(compiler);
         }
-        else {
-            return v;
+        consumeOrFail(compiler, "(");
+        for (uint64_t i = 0; i < intrinsicArity[intrinsic]; i++) {
+            if (i > 0) {
+                consumeOrFail(compiler, ",");
+            }
+            arguments[i] = expressionCF(compiler, *(bool*) context);
         }
+        consumeOrFail(compiler, ")");
+        result -> value = intrinsicValue(intrinsic, arguments);
+        return true;
     }
-}
 
-// (right with special treatment for middle expression) ?:
-uint64_t e13CF(Compiler* compiler, bool effects) {
-    return e12CF(compiler, effects);
+    fail(compiler);
+    return false;
 }
 
-// = += -= ...
-uint64_t e14CF(Compiler* compiler, bool effects) {
-    return e13CF(compiler, effects);
+void foldOperator(Compiler* compiler, void* context, Operator op, Operand* left, Operand const *right) {
+    uint64_t v = left -> value;
+    uint64_t u = right == NULL ? 0 : right -> value;
+    switch (op) {
+        case OP_MUL: v = v * u; break;
+        case OP_DIV: v = u == 0 ? 0 : v / u; break;
+        case OP_MOD: v = u == 0 ? 0 : v % u; break;
+        case OP_ADD: v = v + u; break;
+        case OP_SUB: v = v - u; break;
+        // the count is taken modulo 64, like the shift instructions do
+        case OP_SHL: v = v << (u & 63); break;
+        case OP_SHR: v = v >> (u & 63); break;
+        case OP_LT: v = v < u; break;
+        case OP_LE: v = v <= u; break;
+        case OP_GT: v = v > u; break;
+        case OP_GE: v = v >= u; break;
+        case OP_EQ: v = v == u; break;
+        case OP_NE: v = v != u; break;
+        case OP_BIT_AND: v = v & u; break;
+        case OP_BIT_XOR: v = v ^ u; break;
+        case OP_BIT_OR: v = v | u; break;
+        case OP_AND: v = v && u; break;
+        case OP_OR: v = v || u; break;
+        case OP_NOT: v = v == 0; break;
+        case OP_BOOL: v = v != 0; break;
+        default: fail(compiler);
+    }
+    left -> value = v;
 }
 
-// ,
-uint64_t e15CF(Compiler* compiler, bool effects) {
-    return e14CF(compiler, effects);
-}
+ExpressionHandlers const foldHandlers = { true, foldOperand, foldOperator };
 
 uint64_t expressionCF(Compiler* compiler, bool effects) {
-    return e15CF(compiler, effects);
+    Operand result;
+    parseExpression(compiler, &foldHandlers, &effects, &result);
+    return result.value;
 }
 
-// checks if constant folding is possible
+// checks if constant folding is possible: only literals, operators and calls to intrinsics
 optionalInt checkExpression(Compiler* compiler, bool effects) {
+    phaseBegin(compiler -> stats, PHASE_CHECK_EXPRESSION);
     char* beforePointer = compiler -> current;
-    while (compiler -> current[0] != '\n') {
-        if (isalpha(*(compiler -> current))) {
-            optionalInt cur = { false, 0 };
-            compiler -> current = beforePointer;
-            return cur;
+    if (beforePointer < compiler -> checkFrom || beforePointer > compiler -> checkStop) {
+        while (compiler -> current[0] != '\n' && compiler -> current[0] != 0) {
+            if (isalpha(*(compiler -> current))) {
+                uint64_t intrinsic = intrinsicCallLength(compiler -> current);
+                if (intrinsic == 0) {
+                    break;
+                }
+                compiler -> current += intrinsic;
+                continue;
+            }
+            compiler -> current++;
         }
-        compiler -> current++;
+        statsBytes(compiler -> stats, (uint64_t)(compiler -> current - beforePointer));
+        compiler -> checkFrom = beforePointer;
+        compiler -> checkStop = compiler -> current;
+        compiler -> current = beforePointer;
+    }
+    if (isalpha(*(compiler -> checkStop))) {
+        optionalInt cur = { false, 0 };
+        phaseEnd(compiler -> stats);
+        return cur;
     }
 
     // this is a numeric expression, so just do constant folding and return value of expression
-    compiler -> current = beforePointer;
     uint64_t ret = expressionCF(compiler, effects);
+    compiler -> stats -> foldedExpressions++;
     optionalInt cur = { true, ret };
+    phaseEnd(compiler -> stats);
     return cur;
 }
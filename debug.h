@@ -0,0 +1,57 @@
+#pragma once
+
+// libc includes (available in both C and C++)
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Implementation includes
+#include "constant folding.h"
+
+// Debug information (-g[=file])
+//
+// The assembly names the source once (.file 1 "file", <stdin> without a
+// name) and every statement starts with a .loc giving its line; gas turns
+// them into a DWARF line table. Every function's ._.<name> symbol gets a
+// .type and a .size, so perf report and perf annotate put samples in the
+// right function and next to the right line of the .fun file, and gdb and
+// addr2line map addresses back to it. Without -g nothing changes.
+
+// in the prelude
+void debugFile(Compiler* compiler) {
+    if (compiler -> options.debugSource == NULL) {
+        return;
+    }
+    emitf(compiler, "    .file 1 \"%s\"\n", compiler -> options.debugSource);
+}
+
+// the code that follows is for this source line
+void debugLine(Compiler* compiler, uint64_t line) {
+    if (compiler -> options.debugSource == NULL) {
+        return;
+    }
+    emitf(compiler, "    .loc 1 %lu\n", line);
+}
+
+// before the ._.<name> label of a function
+void debugFunctionStart(Compiler* compiler, Slice name) {
+    if (compiler -> options.debugSource == NULL) {
+        return;
+    }
+    emitf(compiler, "    .type ._.");
+    emitSlice(compiler, name);
+    emitf(compiler, ", @function\n");
+}
+
+// after its last instruction
+void debugFunctionEnd(Compiler* compiler, Slice name) {
+    if (compiler -> options.debugSource == NULL) {
+        return;
+    }
+    emitf(compiler, "    .size ._.");
+    emitSlice(compiler, name);
+    emitf(compiler, ", .-._.");
+    emitSlice(compiler, name);
+    emitf(compiler, "\n");
+}
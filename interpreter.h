@@ -0,0 +1,390 @@
+#pragma once
+
+// libc includes (available in both C and C++)
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Implementation includes
+#include "constant folding.h"
+#include "ast.h"
+
+// Compile time evaluation of calls to pure functions
+//
+// The body of a pure function (see memo.h) is parsed into a tree the first
+// time a call to it is evaluated. A call whose arguments are constant is run
+// on those trees and replaced by its result, so print(val(8388608, 0)) prints a constant.
+// The interpreter does what the generated code does: u64 arithmetic, both
+// sides of && and || evaluated, 0 returned when the body ends, and a call to
+// itself in "return f(...)" reuses the frame (the compiler turns it into a
+// jump, so it can't run out of stack).
+//
+// Anything it can't decide gives up and the call is compiled as usual:
+// division by zero, reading a variable that wasn't assigned, running out of
+// fuel (statements and calls executed) or nesting calls too deeply. A call
+// that ran out of fuel isn't tried again as part of the same expression.
+
+#define FOLD_FUEL (1ul << 25)
+#define FOLD_TOTAL_FUEL (1ul << 26)
+#define FOLD_MAX_DEPTH 1000
+
+typedef enum Flow {
+    FLOW_NEXT,
+    FLOW_RETURN,
+    FLOW_TAIL_CALL,                     // the arguments are in the parameter slots, start over
+    FLOW_FAIL
+} Flow;
+
+typedef struct Interpreter {
+    Compiler* compiler;
+    uint64_t fuel;
+    uint64_t depth;
+
+    // slots of all the active calls
+    uint64_t* values;
+    bool* assigned;
+    uint64_t top;
+    uint64_t capacity;
+} Interpreter;
+
+bool evaluateAst(Interpreter* interpreter, Ast* ast, uint64_t frame, uint64_t* result);
+
+// true if the function has a tree, it is parsed the first time this is asked
+bool evaluable(Compiler* compiler, uint64_t index) {
+    FunctionInfo* function = &(compiler -> functions[index]);
+    if (function -> bodyText != NULL) {
+        function -> evaluable = parseFunctionBody(compiler, compiler -> bodies, index, function -> bodyText);
+        function -> bodyText = NULL;
+    }
+    return function -> evaluable;
+}
+
+bool callFunction(Interpreter* interpreter, uint64_t index, Ast* arguments, uint64_t frame, uint64_t* result);
+
+Flow executeBlock(Interpreter* interpreter, Ast* block, uint64_t frame, uint64_t function, uint64_t* result) {
+    for (Ast* statement = block; statement != NULL; statement = statement -> next) {
+        if (interpreter -> fuel == 0) {
+            return FLOW_FAIL;
+        }
+        interpreter -> fuel--;
+
+        uint64_t value = 0;
+        Flow flow = FLOW_NEXT;
+        switch (statement -> kind) {
+            case AST_ASSIGN:
+                if (!evaluateAst(interpreter, statement -> left, frame, &value)) {
+                    return FLOW_FAIL;
+                }
+                interpreter -> values[frame + statement -> value] = value;
+                interpreter -> assigned[frame + statement -> value] = true;
+                break;
+            case AST_IF:
+                if (!evaluateAst(interpreter, statement -> left, frame, &value)) {
+                    return FLOW_FAIL;
+                }
+                flow = executeBlock(interpreter, value != 0 ? statement -> right : statement -> otherwise, frame, function, result);
+                break;
+            case AST_WHILE:
+                while (flow == FLOW_NEXT) {
+                    if (!evaluateAst(interpreter, statement -> left, frame, &value)) {
+                        return FLOW_FAIL;
+                    }
+                    if (value == 0) {
+                        break;
+                    }
+                    if (interpreter -> fuel == 0) {
+                        return FLOW_FAIL;
+                    }
+                    interpreter -> fuel--;
+                    flow = executeBlock(interpreter, statement -> right, frame, function, result);
+                }
+                break;
+            case AST_RETURN: {
+                Ast* call = statement -> left;
+                if (call -> kind != AST_CALL || call -> value != function) {
+                    return evaluateAst(interpreter, call, frame, result) ? FLOW_RETURN : FLOW_FAIL;
+                }
+                // all the arguments are evaluated (above the frame) before any parameter changes
+                uint64_t numParams = interpreter -> compiler -> functions[function].numParams;
+                uint64_t scratch = interpreter -> top;
+                uint64_t count = 0;
+                for (Ast* argument = call -> left; argument != NULL && flow == FLOW_NEXT; argument = argument -> next) {
+                    if (count == numParams || !evaluateAst(interpreter, argument, frame, &value)) {
+                        flow = FLOW_FAIL;
+                        break;
+                    }
+                    interpreter -> values[scratch + count++] = value;
+                    interpreter -> top++;
+                }
+                interpreter -> top = scratch;
+                if (flow == FLOW_FAIL || count != numParams) {
+                    return FLOW_FAIL;
+                }
+                for (uint64_t i = 0; i < numParams; i++) {
+                    interpreter -> values[frame + i] = interpreter -> values[scratch + i];
+                }
+                return FLOW_TAIL_CALL;
+            }
+            case AST_EXPRESSION:
+                if (!evaluateAst(interpreter, statement -> left, frame, &value)) {
+                    return FLOW_FAIL;
+                }
+                break;
+            default:
+                return FLOW_FAIL;
+        }
+        if (flow != FLOW_NEXT) {
+            return flow;
+        }
+    }
+    return FLOW_NEXT;
+}
+
+bool callFunction(Interpreter* interpreter, uint64_t index, Ast* arguments, uint64_t frame, uint64_t* result) {
+    FunctionInfo* function = &(interpreter -> compiler -> functions[index]);
+    if (!evaluable(interpreter -> compiler, index) || interpreter -> depth == FOLD_MAX_DEPTH || interpreter -> fuel == 0) {
+        return false;
+    }
+    interpreter -> fuel--;
+
+    // the new frame goes on top, followed by room for the arguments of tail calls
+    uint64_t calleeFrame = interpreter -> top;
+    uint64_t needed = calleeFrame + function -> numSlots + function -> numParams;
+    if (needed > interpreter -> capacity) {
+        interpreter -> capacity = needed * 2;
+        interpreter -> values = (uint64_t*) (realloc(interpreter -> values, sizeof(uint64_t) * interpreter -> capacity));
+        interpreter -> assigned = (bool*) (realloc(interpreter -> assigned, sizeof(bool) * interpreter -> capacity));
+        statsAlloc(interpreter -> compiler -> stats, (sizeof(uint64_t) + sizeof(bool)) * interpreter -> capacity);
+    }
+
+    // calls in the arguments go above the frame
+    interpreter -> top = calleeFrame + function -> numSlots;
+    uint64_t count = 0;
+    for (Ast* argument = arguments; argument != NULL; argument = argument -> next) {
+        uint64_t value = 0;
+        if (count == function -> numParams || !evaluateAst(interpreter, argument, frame, &value)) {
+            interpreter -> top = calleeFrame;
+            return false;
+        }
+        interpreter -> values[calleeFrame + count] = value;
+        interpreter -> assigned[calleeFrame + count] = true;
+        count++;
+    }
+    if (count != function -> numParams) {
+        interpreter -> top = calleeFrame;
+        return false;
+    }
+    for (uint64_t i = count; i < function -> numSlots; i++) {
+        interpreter -> assigned[calleeFrame + i] = false;
+    }
+
+    interpreter -> depth++;
+    Flow flow = FLOW_TAIL_CALL;
+    *result = 0;
+    while (flow == FLOW_TAIL_CALL) {
+        flow = executeBlock(interpreter, function -> body, calleeFrame, index, result);
+    }
+    interpreter -> depth--;
+    interpreter -> top = calleeFrame;
+
+    if (flow == FLOW_NEXT) {
+        // default return value is 0
+        *result = 0;
+    }
+    return flow != FLOW_FAIL;
+}
+
+bool evaluateAst(Interpreter* interpreter, Ast* ast, uint64_t frame, uint64_t* result) {
+    uint64_t left = 0;
+    uint64_t right = 0;
+    switch (ast -> kind) {
+        case AST_CONST:
+            *result = ast -> value;
+            return true;
+        case AST_LOCAL:
+            *result = interpreter -> values[frame + ast -> value];
+            return interpreter -> assigned[frame + ast -> value];
+        case AST_CALL:
+            return callFunction(interpreter, ast -> value, ast -> left, frame, result);
+        case AST_INTRINSIC: {
+            uint64_t arguments[INTRINSIC_MAX_ARGS];
+            uint64_t count = 0;
+            for (Ast* argument = ast -> left; argument != NULL; argument = argument -> next) {
+                if (!evaluateAst(interpreter, argument, frame, &arguments[count++])) {
+                    return false;
+                }
+            }
+            *result = intrinsicValue((Intrinsic) ast -> value, arguments);
+            return true;
+        }
+        case AST_NOT:
+        case AST_BOOL:
+            if (!evaluateAst(interpreter, ast -> left, frame, &left)) {
+                return false;
+            }
+            *result = (ast -> kind == AST_NOT) == (left == 0);
+            return true;
+        default:
+            break;
+    }
+
+    if (ast -> left == NULL || ast -> right == NULL ||
+            !evaluateAst(interpreter, ast -> left, frame, &left) || !evaluateAst(interpreter, ast -> right, frame, &right)) {
+        return false;
+    }
+    switch (ast -> kind) {
+        case AST_ADD: *result = left + right; return true;
+        case AST_SUB: *result = left - right; return true;
+        case AST_MUL: *result = left * right; return true;
+        case AST_DIV:
+            if (right == 0) {
+                return false;
+            }
+            *result = left / right;
+            return true;
+        case AST_MOD:
+            if (right == 0) {
+                return false;
+            }
+            *result = left % right;
+            return true;
+        case AST_SHL: *result = left << (right & 63); return true;
+        case AST_SHR: *result = left >> (right & 63); return true;
+        case AST_LT: *result = left < right; return true;
+        case AST_LE: *result = left <= right; return true;
+        case AST_GT: *result = left > right; return true;
+        case AST_GE: *result = left >= right; return true;
+        case AST_EQ: *result = left == right; return true;
+        case AST_NE: *result = left != right; return true;
+        case AST_BIT_AND: *result = left & right; return true;
+        case AST_BIT_XOR: *result = left ^ right; return true;
+        case AST_BIT_OR: *result = left | right; return true;
+        case AST_AND: *result = left != 0 && right != 0; return true;
+        case AST_OR: *result = left != 0 || right != 0; return true;
+        default: return false;
+    }
+}
+
+// remembers where the body of a pure function is so calls to it can be evaluated
+void prepareEvaluation(Compiler* compiler, uint64_t function, char* body) {
+    FunctionInfo* info = &(compiler -> functions[function]);
+    if (!info -> pure || compiler -> options.noFoldCalls) {
+        return;
+    }
+    info -> bodyText = body;
+}
+
+// scans from start to the first '[', name that isn't called or end of the line (see foldFrom)
+void foldScan(Compiler* compiler, char const *start) {
+    compiler -> foldFrom = start;
+    compiler -> foldLastCall = NULL;
+    compiler -> countFoldOpen = 0;
+    char const *p = start;
+    for (; *p != '\n' && *p != 0 && *p != '['; p++) {
+        if (*p == '(') {
+            if (compiler -> countFoldOpen == compiler -> capacityFoldOpen) {
+                compiler -> capacityFoldOpen = compiler -> capacityFoldOpen * 2 + 16;
+                compiler -> foldOpen = (char const **) (realloc(compiler -> foldOpen,
+                                                                compiler -> capacityFoldOpen * sizeof(char const *)));
+                statsAlloc(compiler -> stats, compiler -> capacityFoldOpen * sizeof(char const *));
+            }
+            compiler -> foldOpen[compiler -> countFoldOpen++] = p;
+        }
+        else if (*p == ')') {
+            // one opened before start isn't looked for
+            if (compiler -> countFoldOpen > 0) {
+                compiler -> countFoldOpen--;
+            }
+        }
+        else if (isalpha(*p)) {
+            char const *name = p;
+            while (isalnum(p[1])) {
+                p++;
+            }
+            char const *next = p + 1;
+            while (*next == ' ') {
+                next++;
+            }
+            if (*next != '(') {
+                p = name;
+                break;
+            }
+            compiler -> foldLastCall = name;
+        }
+    }
+    compiler -> foldStop = p;
+}
+
+// true if the text from start can be a constant expression with calls: it has calls and every
+// name is a call. With primary only the first call is looked at. The scan is kept for the calls
+// and parentheses further on the line, so a line is scanned about once.
+bool foldCandidate(Compiler* compiler, char const *start, bool primary) {
+    if (start < compiler -> foldFrom || start > compiler -> foldStop) {
+        foldScan(compiler, start);
+    }
+    char const *stop = compiler -> foldStop;
+    if (*stop == '\n' || *stop == 0) {
+        // calls to the end of the line, and with primary start is one
+        return primary || (compiler -> foldLastCall != NULL && compiler -> foldLastCall >= start);
+    }
+    if (!primary || start == stop) {
+        return false;
+    }
+
+    // the call is all there is if its parenthesis closes before stop
+    char const *open = start;
+    while (*open != '(') {
+        open++;
+    }
+    uint64_t low = 0;
+    uint64_t high = compiler -> countFoldOpen;
+    while (low < high) {
+        uint64_t middle = (low + high) / 2;
+        if (compiler -> foldOpen[middle] < open) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+    return low == compiler -> countFoldOpen || compiler -> foldOpen[low] != open;
+}
+
+// Evaluates the expression (or with primary, the call) at start if it only calls pure functions
+// with constant arguments. On success compiler -> current is just after it.
+optionalInt foldCalls(Compiler* compiler, char* start, bool primary) {
+    optionalInt folded = { false, 0 };
+    if (compiler -> options.noFoldCalls || compiler -> foldFuel == 0 || !foldCandidate(compiler, start, primary) ||
+            (start >= compiler -> foldExhaustedStart && start < compiler -> foldExhaustedEnd)) {
+        return folded;
+    }
+
+    char* savedPointer = compiler -> current;
+    compiler -> current = start;
+    AstPool pool = astPoolCreate(compiler -> stats);
+    AstScope scope = { NULL, 0, UINT64_MAX };
+    Ast* ast = primary ? parseFactor(compiler, &pool, &scope) : parseOr(compiler, &pool, &scope);
+
+    if (ast != NULL) {
+        uint64_t fuel = FOLD_FUEL < compiler -> foldFuel ? FOLD_FUEL : compiler -> foldFuel;
+        Interpreter interpreter = { compiler, fuel, 0, NULL, NULL, 0, 0 };
+        folded.exists = evaluateAst(&interpreter, ast, 0, &(folded.item));
+        compiler -> foldFuel -= fuel - interpreter.fuel;
+        if (interpreter.fuel == 0) {
+            compiler -> foldExhaustedStart = start;
+            compiler -> foldExhaustedEnd = compiler -> current;
+        }
+        free(interpreter.values);
+        free(interpreter.assigned);
+    }
+    astPoolFree(&pool);
+
+    if (folded.exists) {
+        compiler -> stats -> foldedCalls++;
+    }
+    else {
+        compiler -> current = savedPointer;
+    }
+    return folded;
+}
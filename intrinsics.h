@@ -0,0 +1,89 @@
+#pragma once
+
+// libc includes (available in both C and C++)
+#include <stdlib.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Implementation includes
+#include "slicec.h"
+
+// Intrinsics
+//
+//     popcount(x)     bits set in x
+//     clz(x)          leading zero bits of x, 64 for 0
+//     ctz(x)          trailing zero bits of x, 64 for 0
+//     min(a, b)       the smaller of a and b (unsigned, like everything else)
+//     max(a, b)       the larger of a and b
+//     mulhi(a, b)     the high 64 bits of the 128 bit product a * b
+//     bswap(x)        x with its bytes in the opposite order
+//
+// The names are reserved, a fun can't be called one of them. A call compiles
+// to one instruction: popcnt, lzcnt, tzcnt, cmp + cmov, mul (the high half is
+// in %rdx) and bswap. popcnt, lzcnt and tzcnt aren't in every x86-64, so main
+// asks cpuid for them once (._.cpuFeatures) and a call without the
+// instruction goes to a routine that does the same with bsr, bsf or shifts
+// and masks. Calls with constant arguments are evaluated at compile time, by
+// checkExpression and by the interpreter, with intrinsicValue.
+
+typedef enum Intrinsic {
+    INTRINSIC_POPCOUNT,
+    INTRINSIC_CLZ,
+    INTRINSIC_CTZ,
+    INTRINSIC_MIN,
+    INTRINSIC_MAX,
+    INTRINSIC_MULHI,
+    INTRINSIC_BSWAP,
+    INTRINSIC_NONE                      // not an intrinsic, also the number of them
+} Intrinsic;
+
+#define INTRINSIC_MAX_ARGS 2
+
+// bits of ._.cpuFeatures
+#define CPU_POPCNT 1
+#define CPU_LZCNT 2
+#define CPU_TZCNT 4
+
+char const *const intrinsicNames[] = { "popcount", "clz", "ctz", "min", "max", "mulhi", "bswap" };
+uint64_t const intrinsicArity[] = { 1, 1, 1, 2, 2, 2, 1 };
+
+Intrinsic findIntrinsic(Slice name) {
+    for (uint64_t i = 0; i < INTRINSIC_NONE; i++) {
+        if (sliceEqualString(name, intrinsicNames[i])) {
+            return (Intrinsic) i;
+        }
+    }
+    return INTRINSIC_NONE;
+}
+
+// the length of the name if text starts with a call to an intrinsic, 0 otherwise
+uint64_t intrinsicCallLength(char const *text) {
+    char const *end = text;
+    while (isalnum(*end)) {
+        end++;
+    }
+    char const *next = end;
+    while (*next == ' ') {
+        next++;
+    }
+    if (*next != '(' || findIntrinsic(sliceConstructorEnd(text, end)) == INTRINSIC_NONE) {
+        return 0;
+    }
+    return (uint64_t)(end - text);
+}
+
+uint64_t intrinsicValue(Intrinsic intrinsic, uint64_t const *arguments) {
+    uint64_t a = arguments[0];
+    uint64_t b = intrinsicArity[intrinsic] > 1 ? arguments[1] : 0;
+    switch (intrinsic) {
+        case INTRINSIC_POPCOUNT: return (uint64_t) __builtin_popcountll(a);
+        case INTRINSIC_CLZ: return a == 0 ? 64 : (uint64_t) __builtin_clzll(a);
+        case INTRINSIC_CTZ: return a == 0 ? 64 : (uint64_t) __builtin_ctzll(a);
+        case INTRINSIC_MIN: return a < b ? a : b;
+        case INTRINSIC_MAX: return a > b ? a : b;
+        case INTRINSIC_MULHI: return (uint64_t)(((unsigned __int128) a * b) >> 64);
+        case INTRINSIC_BSWAP: return __builtin_bswap64(a);
+        default: return 0;
+    }
+}
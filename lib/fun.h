@@ -0,0 +1,79 @@
+#pragma once
+
+// libc includes (available in both C and C++)
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// The fun compiler as a library (libfun.a, libfun.so)
+//
+//     FunContext* context = funContextCreate();
+//     if (funCompile(context, source, length, NULL) == FUN_OK) {
+//         size_t length;
+//         char const *assembly = funOutput(context, &length);
+//         ...
+//     }
+//     else {
+//         FunDiagnostic const *error = funDiagnostic(context, 0);
+//         ...
+//     }
+//     funContextFree(context);
+//
+// A context holds everything a compile needs and everything it produces: the
+// compiler with its tables, the assembly and the diagnostics. Contexts share
+// nothing, so threads can compile at the same time as long as each uses its
+// own. A context compiles any number of programs one after the other, the
+// output and diagnostics of a compile stay valid until the next one. Nothing
+// is printed and a program that doesn't compile doesn't end the process.
+// funContextFree releases all the memory.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FUN_API __attribute__((visibility("default")))
+
+typedef enum FunStatus {
+    FUN_OK,
+    FUN_FAILED                          // the program doesn't compile, see the diagnostics
+} FunStatus;
+
+// the command line options of p3 that make sense in-process, all off when zero
+typedef struct FunOptions {
+    bool profile;                       // -fprofile
+    bool profileCycles;                 // -fprofile=cycles
+    bool memoize;                       // -fmemoize
+    bool noFoldCalls;                   // -fno-fold-calls
+    bool noBoundsCheck;                 // -fno-bounds-check
+    bool noSelect;                      // -fno-select
+    bool noShareSlots;                  // -fno-share-slots
+    uint64_t unroll;                    // -funroll, 0 for the default
+    uint64_t stackSize;                 // -fstack-size in bytes, 0 for the process stack
+    char const *debugSource;            // -g=<file>, NULL without -g
+} FunOptions;
+
+typedef struct FunDiagnostic {
+    uint64_t line;                      // starting at 1
+    uint64_t column;                    // starting at 1
+    uint64_t offset;                    // in the source without comments, what p3 reports
+    char const *message;
+    char const *text;                   // the source from where it happened to the end of the line
+} FunDiagnostic;
+
+typedef struct FunContext FunContext;
+
+FUN_API FunContext* funContextCreate(void);
+FUN_API void funContextFree(FunContext* context);
+
+// compiles length bytes of source (no NUL needed) with options (NULL for the defaults)
+FUN_API FunStatus funCompile(FunContext* context, char const *source, size_t length, FunOptions const *options);
+
+// the assembly of the last compile that succeeded
+FUN_API char const *funOutput(FunContext* context, size_t* length);
+
+FUN_API size_t funDiagnosticCount(FunContext* context);
+FUN_API FunDiagnostic const *funDiagnostic(FunContext* context, size_t index);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,148 @@
+// The library of fun.h: the whole compiler in one translation unit, built with
+// -fvisibility=hidden so only the FUN_API functions are seen from outside.
+//
+// funCompile is compileRequest of server.h with a context instead of a
+// session: fail() jumps back to it instead of exiting, and what the compiler
+// had open when it failed is closed again (compilerAbandon) so the context
+// can compile the next program.
+
+#include <setjmp.h>
+#include <string.h>
+
+#include "fun.h"
+#include "../compiler.h"
+
+struct FunContext {
+    Stats stats;
+    Compiler* compiler;
+    UnorderedMap* topLevelTable;
+    char* program;                      // the source without comments, the compiler points into it
+
+    // the output stream is rewound for every compile, its buffer is kept
+    FILE* out;
+    char* output;
+    size_t outputLength;
+    size_t length;                      // of the assembly, 0 after a failed compile
+
+    FunDiagnostic diagnostic;
+    size_t countDiagnostics;
+    char* message;
+    char* text;
+};
+
+FunContext* funContextCreate(void) {
+    FunContext* context = (FunContext*) (calloc(1, sizeof(FunContext)));
+    context -> out = open_memstream(&(context -> output), &(context -> outputLength));
+    context -> compiler = compilerConstructor(NULL, context -> out, &(context -> stats));
+    context -> topLevelTable = context -> compiler -> symbolTable;
+    return context;
+}
+
+void funContextFree(FunContext* context) {
+    compilerFree(context -> compiler);
+    fclose(context -> out);
+    free(context -> output);
+    free(context -> program);
+    free(context -> message);
+    free(context -> text);
+    free(context);
+}
+
+Options funOptions(FunOptions const *options) {
+    Options converted = { 0 };
+    if (options != NULL) {
+        converted.profile = options -> profile || options -> profileCycles;
+        converted.profileCycles = options -> profileCycles;
+        converted.memoize = options -> memoize;
+        converted.noFoldCalls = options -> noFoldCalls;
+        converted.noBoundsCheck = options -> noBoundsCheck;
+        converted.noSelect = options -> noSelect;
+        converted.noShareSlots = options -> noShareSlots;
+        converted.unroll = options -> unroll > UNROLL_MAX_FACTOR ? UNROLL_MAX_FACTOR : options -> unroll;
+        converted.stackSize = options -> stackSize;
+        converted.debugSource = options -> debugSource;
+    }
+    return converted;
+}
+
+// the diagnostic of a compile that failed where the compiler is now
+void funFailed(FunContext* context) {
+    Compiler* compiler = context -> compiler;
+    char const *position = compiler -> current;
+    char const *lineStart = position;
+    while (lineStart > compiler -> program && lineStart[-1] != '\n') {
+        lineStart--;
+    }
+    char const *lineEnd = position;
+    while (*lineEnd != '\n' && *lineEnd != 0) {
+        lineEnd++;
+    }
+
+    // what is there, the word or the character the compiler stopped at
+    char const *token = (char const *) scanSpace(position);
+    char const *tokenEnd = isAlnumByte(*token) ? scanAlnum(token) : token + (*token != 0);
+    context -> message = NULL;
+    size_t messageLength = 0;
+    FILE* message = open_memstream(&(context -> message), &messageLength);
+    if (*token == 0) {
+        fprintf(message, "unexpected end of program");
+    }
+    else {
+        fprintf(message, "unexpected \"%.*s\"", (int)(tokenEnd - token), token);
+    }
+    fclose(message);
+    context -> text = strndup(position, (size_t)(lineEnd - position));
+
+    context -> diagnostic.line = lineOf(compiler, position);
+    context -> diagnostic.column = (uint64_t)(position - lineStart) + 1;
+    context -> diagnostic.offset = (uint64_t)(position - compiler -> program);
+    context -> diagnostic.message = context -> message;
+    context -> diagnostic.text = context -> text;
+    context -> countDiagnostics = 1;
+}
+
+FunStatus funCompile(FunContext* context, char const *source, size_t length, FunOptions const *options) {
+    context -> stats = (Stats) { 0 };
+    context -> countDiagnostics = 0;
+    free(context -> message);
+    free(context -> text);
+    context -> message = NULL;
+    context -> text = NULL;
+    fseek(context -> out, 0, SEEK_SET);
+
+    free(context -> program);
+    context -> program = stripComments(source, length, &(context -> stats));
+    Compiler* compiler = context -> compiler;
+    compilerReset(compiler, context -> program, context -> out, &(context -> stats));
+    compiler -> options = funOptions(options);
+    jmp_buf failJump;
+    compiler -> failJump = &failJump;
+
+    FunStatus status = FUN_OK;
+    if (setjmp(failJump) == 0) {
+        run(compiler);
+        fflush(context -> out);
+        context -> length = (size_t) ftell(context -> out);
+    }
+    else {
+        compilerAbandon(compiler, context -> out, context -> topLevelTable);
+        funFailed(context);
+        context -> length = 0;
+        status = FUN_FAILED;
+    }
+    compiler -> failJump = NULL;
+    return status;
+}
+
+char const *funOutput(FunContext* context, size_t* length) {
+    *length = context -> length;
+    return context -> countDiagnostics == 0 ? context -> output : NULL;
+}
+
+size_t funDiagnosticCount(FunContext* context) {
+    return context -> countDiagnostics;
+}
+
+FunDiagnostic const *funDiagnostic(FunContext* context, size_t index) {
+    return index < context -> countDiagnostics ? &(context -> diagnostic) : NULL;
+}
@@ -10,79 +10,219 @@
 #include <stdbool.h>
 
 #include "compiler.h"
+#include "server.h"
 
-int main() {
+void usage(char const *name) {
+    fprintf(stderr, "usage: %s [--time-report[=json]] [--stats] [--stream] [-fprofile[=cycles]] [-fprofile-use=file] [-fmemoize] [-fno-fold-calls] [-fstack-size=bytes[k|M|G]] [-fno-bounds-check] [-fno-select] [-fno-share-slots] [-funroll=n] [-g[=file]] < prog.fun > prog.s\n", name);
+    fprintf(stderr, "       %s [options] --serve socket [-j threads]\n", name);
+    fprintf(stderr, "       %s --client socket < prog.fun > prog.s\n", name);
+    exit(1);
+}
 
+// reads the whole program from stdin and compiles it
+void compileProgram(Options options, char const *profilePath, FILE* out, Stats* stats) {
     // reads the fun program from stdin
-    uint64_t inputLen = 10000;
-    char* progOrig = (char*)(malloc(sizeof(char) * inputLen));
-    char c;
-    uint64_t index = 0;
+    phaseBegin(stats, PHASE_READ);
+    uint64_t capacity = 10000;
+    char* progOrig = (char*)(malloc(sizeof(char) * capacity));
+    statsAlloc(stats, capacity);
+    int c;
+    uint64_t inputLen = 0;
     while ((c = getchar()) != EOF) {
-        progOrig[index++] = c;
+        if (inputLen == capacity) {
+            capacity *= 2;
+            progOrig = (char*)(realloc(progOrig, sizeof(char) * capacity));
+            statsAlloc(stats, capacity);
+        }
+        progOrig[inputLen++] = (char)c;
     }
+    statsBytes(stats, inputLen);
+    phaseEnd(stats);
 
     // preprocess to get rid of comments
-    index = 0;
-    char* prog = (char*)(malloc(sizeof(char) * inputLen));
-
-    for (size_t i = 0; i < inputLen; i++) {
-        if (progOrig[i] == '#') {
-            // this line is a comment, skip it
-            while (progOrig[i] != '\n' && i < inputLen) {
-                i++;
-            }
-            i--;
+    char* prog = stripComments(progOrig, inputLen, stats);
+    free(progOrig);
+
+    Compiler* compiler = compilerConstructor(prog, out, stats);
+    compiler -> options = options;
+
+    if (profilePath != NULL) {
+        // the profile text is kept, the compiler refers to function names in it
+        FILE* profile = fopen(profilePath, "r");
+        if (profile == NULL) {
+            fprintf(stderr, "can't read profile %s\n", profilePath);
+            exit(1);
         }
-        else {
-            prog[index++] = progOrig[i];
+        char* profileText = NULL;
+        size_t profileLength = 0;
+        FILE* text = open_memstream(&profileText, &profileLength);
+        while ((c = fgetc(profile)) != EOF) {
+            fputc(c, text);
+        }
+        fclose(text);
+        fclose(profile);
+        if (!loadProfile(compiler, profileText)) {
+            fprintf(stderr, "can't load profile %s\n", profilePath);
+            exit(1);
         }
     }
-
-    // printf("%s\n", prog);
-
-    puts("    .data");
-    puts("format: .byte '%', 'l', 'u', 10, 0");
-    puts("    .text");
-    puts("    .global main");
-    puts("    .extern printf");
-    
-    puts("main:");
-    puts("    push %r12");
-    puts("    push %r13");
-    puts("    push %r14");
-    puts("    push %r15");
-    puts("    push %rbp");
-    puts("    push %rbx");
-    puts("    call ._.main");
-    puts("    pop %r12");
-    puts("    pop %r13");
-    puts("    pop %r14");
-    puts("    pop %r15");
-    puts("    pop %rbp");
-    puts("    pop %rbx");
-    puts("    ret");
-
-    puts("._.print:");
-    puts("    push %rbp");
-    puts("    mov %rsp, %rbp");
-    puts("    and $0xFFFFFFFFFFFFFFF0, %rsp");
-    puts("    xor %eax, %eax");
-    puts("    mov 16(%rbp), %rsi");              // maybe change later
-    puts("    lea format(%rip), %rdi");
-    puts("    call printf");
-    puts("    mov %rbp, %rsp");
-    puts("    xor %eax, %eax");
-    puts("    pop %rbp");
-    puts("    ret");
-
-    Compiler* compiler = compilerConstructor(prog);
     
     run(compiler);
 
     // deallocate space to reduce memory leaks
     // free(compiler);
     // free(prog);
+}
+
+int main(int argc, char* argv[]) {
+
+    Stats stats = { 0 };
+    Options options = { 0 };
+    bool jsonReport = false;
+    bool printOptimizationStats = false;
+    char const *profilePath = NULL;
+    char const *servePath = NULL;
+    char const *clientPath = NULL;
+    uint64_t threads = (uint64_t) sysconf(_SC_NPROCESSORS_ONLN);
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--time-report") == 0) {
+            stats.enabled = true;
+        }
+        else if (strcmp(argv[i], "--time-report=json") == 0) {
+            stats.enabled = true;
+            jsonReport = true;
+        }
+        else if (strcmp(argv[i], "--stats") == 0) {
+            printOptimizationStats = true;
+        }
+        else if (strcmp(argv[i], "--stream") == 0) {
+            options.stream = true;
+        }
+        else if (strcmp(argv[i], "-fprofile") == 0) {
+            options.profile = true;
+        }
+        else if (strcmp(argv[i], "-fprofile=cycles") == 0) {
+            options.profile = true;
+            options.profileCycles = true;
+        }
+        else if (strcmp(argv[i], "-fmemoize") == 0) {
+            options.memoize = true;
+        }
+        else if (strcmp(argv[i], "-fno-fold-calls") == 0) {
+            options.noFoldCalls = true;
+        }
+        else if (strcmp(argv[i], "-fno-bounds-check") == 0) {
+            options.noBoundsCheck = true;
+        }
+        else if (strcmp(argv[i], "-fno-select") == 0) {
+            options.noSelect = true;
+        }
+        else if (strcmp(argv[i], "-fno-share-slots") == 0) {
+            options.noShareSlots = true;
+        }
+        else if (strncmp(argv[i], "-funroll=", 9) == 0) {
+            char* end;
+            options.unroll = strtoul(argv[i] + 9, &end, 10);
+            if (end == argv[i] + 9 || *end != 0 || options.unroll == 0 || options.unroll > UNROLL_MAX_FACTOR) {
+                usage(argv[0]);
+            }
+        }
+        else if (strcmp(argv[i], "-g") == 0) {
+            options.debugSource = "<stdin>";
+        }
+        else if (strncmp(argv[i], "-g=", 3) == 0 && argv[i][3] != 0) {
+            options.debugSource = argv[i] + 3;
+        }
+        else if (strncmp(argv[i], "-fstack-size=", 13) == 0) {
+            char* end;
+            options.stackSize = strtoul(argv[i] + 13, &end, 10);
+            if (*end == 'k' || *end == 'K') {
+                options.stackSize <<= 10;
+                end++;
+            }
+            else if (*end == 'm' || *end == 'M') {
+                options.stackSize <<= 20;
+                end++;
+            }
+            else if (*end == 'g' || *end == 'G') {
+                options.stackSize <<= 30;
+                end++;
+            }
+            if (*end != 0 || options.stackSize == 0) {
+                usage(argv[0]);
+            }
+        }
+        else if (strncmp(argv[i], "-fprofile-use=", 14) == 0) {
+            profilePath = argv[i] + 14;
+        }
+        else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            servePath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--client") == 0 && i + 1 < argc) {
+            clientPath = argv[++i];
+        }
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            threads = (uint64_t) atoi(argv[++i]);
+        }
+        else {
+            usage(argv[0]);
+        }
+    }
+
+    if (clientPath != NULL) {
+        return client(clientPath);
+    }
+    if (servePath != NULL) {
+        // a profile belongs to one program
+        if (profilePath != NULL || stats.enabled || options.stream) {
+            usage(argv[0]);
+        }
+        return serve(servePath, options, threads);
+    }
+
+    // functions are laid out by heat once they have all been compiled
+    if (options.stream && profilePath != NULL) {
+        usage(argv[0]);
+    }
+
+    // with a report the output is collected in memory so writing it can be timed on its own
+    // (not when streaming, the output grows with the program)
+    char* output = NULL;
+    size_t outputLen = 0;
+    bool collectOutput = stats.enabled && !options.stream;
+    FILE* out = collectOutput ? open_memstream(&output, &outputLen) : stdout;
+
+    if (options.stream) {
+        Compiler* compiler = compilerConstructor(NULL, out, &stats);
+        compiler -> options = options;
+        runStream(compiler, stdin);
+    }
+    else {
+        compileProgram(options, profilePath, out, &stats);
+    }
+
+    if (collectOutput) {
+        fclose(out);
+        phaseBegin(&stats, PHASE_OUTPUT);
+        fwrite(output, 1, outputLen, stdout);
+        fflush(stdout);
+        statsBytes(&stats, outputLen);
+        phaseEnd(&stats);
+        free(output);
+    }
+    if (stats.enabled) {
+        if (jsonReport) {
+            printTimeReportJson(&stats, stderr);
+        }
+        else {
+            printTimeReport(&stats, stderr);
+        }
+    }
+
+    if (printOptimizationStats) {
+        printStats(&stats, stderr);
+    }
 
     return 0;
 }
@@ -12,6 +12,7 @@
 #include <stdbool.h>
 
 #include "slicec.h"
+#include "stats.h"
 
 typedef struct Node {
     Slice key;
@@ -26,22 +27,27 @@ typedef struct UnorderedMap {
     double loadFactor;
     // map contains an array of linkedlists (nodes)
     Node** bins;
+    Stats* stats;           // where probes and allocations are reported (may be NULL)
 } UnorderedMap;
 
-UnorderedMap* mapCreate() {
+UnorderedMap* mapCreate(Stats* stats) {
     // creates the map using malloc and calloc
     UnorderedMap* map = (UnorderedMap*) (malloc(sizeof(UnorderedMap)));
     map -> size = 0;
     map -> capacity = 16;
     map -> loadFactor = 0.75;
     map -> bins = (Node**) (calloc(16, sizeof(Node)));
+    map -> stats = stats;
+    statsAlloc(stats, sizeof(UnorderedMap));
+    statsAlloc(stats, 16 * sizeof(Node));
     return map;
 }
 
 // helper method that inserts into the map
-void mapInsertWithBin(Node** bins, uint64_t binIndex, Slice key, int64_t value) {
+void mapInsertWithBin(UnorderedMap* map, Node** bins, uint64_t binIndex, Slice key, int64_t value) {
     // add the new [key, value] pair to the beginning of this current bin
     Node* addNode = (Node*) (malloc(sizeof(Node)));
+    statsAlloc(map -> stats, sizeof(Node));
     addNode -> key = key;
     addNode -> value = value;
     addNode -> next = bins[binIndex];
@@ -52,6 +58,7 @@ void mapExpand(UnorderedMap* map) {
     // expands the map's capacity by 2 when the size exceeds the load capacity
     uint64_t updatedCapacity = map -> capacity * 2;
     Node** updatedBins = (Node**) (calloc(updatedCapacity, sizeof(Node)));
+    statsAlloc(map -> stats, updatedCapacity * sizeof(Node));
 
     // copy over everything from the old bin into the new bin
     for (size_t i = 0; i < map -> capacity; i++) {
@@ -59,7 +66,7 @@ void mapExpand(UnorderedMap* map) {
         while (current != NULL) {
             uint64_t hash = hashSlice(current -> key);
             uint64_t binIndex = hash % updatedCapacity;
-            mapInsertWithBin(updatedBins, binIndex, current -> key, current -> value);
+            mapInsertWithBin(map, updatedBins, binIndex, current -> key, current -> value);
             Node* next = current -> next;
             free(current);
             current = next;
@@ -70,59 +77,117 @@ void mapExpand(UnorderedMap* map) {
     map -> capacity = updatedCapacity;
 }
 
+// counts one key comparison
+void mapProbe(UnorderedMap* map) {
+    if (map -> stats != NULL) {
+        map -> stats -> mapProbes++;
+    }
+}
+
 // insert a key, value pair into the map
 void mapInsert(UnorderedMap* map, Slice key, int64_t value) {
+    phaseBegin(map -> stats, PHASE_MAP);
+    statsBytes(map -> stats, key.len);
     uint64_t hash = hashSlice(key);
     uint64_t binIndex = hash % map -> capacity;
     Node* current = map -> bins[binIndex];
     while (current != NULL) {
+        mapProbe(map);
         if (sliceEqualSlice(current -> key, key)) {
             // update the current [key, value] pair that is already in the bin
             current -> value = value;
+            phaseEnd(map -> stats);
             return;
         }
         current = current -> next;
     }
 
-    mapInsertWithBin(map -> bins, binIndex, key, value);
+    mapInsertWithBin(map, map -> bins, binIndex, key, value);
     map -> size++;
 
     // check if we need to resize the map
     if (map -> size > map -> capacity * map -> loadFactor) {
         mapExpand(map);
     }
+    phaseEnd(map -> stats);
 }
 
 // returns the value associated with the key in the map
 int64_t mapGet(UnorderedMap* map, Slice key) {
+    phaseBegin(map -> stats, PHASE_MAP);
+    statsBytes(map -> stats, key.len);
     uint64_t hash = hashSlice(key);
     uint64_t binIndex = hash % map -> capacity;
     // printf("%s, %ld, %ld\n", key.start, hash, binIndex);
     Node* current = map -> bins[binIndex];
     while (current != NULL) {
+        mapProbe(map);
         if (sliceEqualSlice(current -> key, key)) {
+            phaseEnd(map -> stats);
             return current -> value;
         }
         current = current -> next;
     }
+    phaseEnd(map -> stats);
     return 0;
 }
 
 // returns if the map contains the given key
 bool mapContains(UnorderedMap* map, Slice key) {
+    phaseBegin(map -> stats, PHASE_MAP);
+    statsBytes(map -> stats, key.len);
     uint64_t hash = hashSlice(key);
     uint64_t binIndex = hash % map -> capacity;
     // printf("%s, %ld, %ld\n", key.start, hash, binIndex);
     Node* current = map -> bins[binIndex];
     while (current != NULL) {
+        mapProbe(map);
         if (sliceEqualSlice(current -> key, key)) {
+            phaseEnd(map -> stats);
             return true;
         }
         current = current -> next;
     }
+    phaseEnd(map -> stats);
     return false;
 }
 
+// removes the key if the map contains it
+void mapRemove(UnorderedMap* map, Slice key) {
+    phaseBegin(map -> stats, PHASE_MAP);
+    statsBytes(map -> stats, key.len);
+    uint64_t hash = hashSlice(key);
+    uint64_t binIndex = hash % map -> capacity;
+    Node** link = &(map -> bins[binIndex]);
+    while (*link != NULL) {
+        mapProbe(map);
+        if (sliceEqualSlice((*link) -> key, key)) {
+            Node* removed = *link;
+            *link = removed -> next;
+            free(removed);
+            map -> size--;
+            break;
+        }
+        link = &((*link) -> next);
+    }
+    phaseEnd(map -> stats);
+}
+
+// removes every key, the bins are kept
+void mapClear(UnorderedMap* map, Stats* stats) {
+    for (size_t i = 0; i < map -> capacity; i++) {
+        Node* current = map -> bins[i];
+        while (current != NULL) {
+            Node* next = current -> next;
+            free(current);
+            current = next;
+        }
+        map -> bins[i] = NULL;
+    }
+    map -> size = 0;
+    map -> stats = stats;
+}
+
 // free's the map's allocated memory in order to eliminate memory leaks
 void freeMap(UnorderedMap* map) {
     for (size_t i = 0; i < map -> capacity; i++) {
@@ -0,0 +1,194 @@
+#pragma once
+
+// libc includes (available in both C and C++)
+#include <stdlib.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Implementation includes
+#include "constant folding.h"
+
+// Memoization of pure functions (-fmemoize)
+//
+// A function is pure when it doesn't print or use arrays and only calls
+// itself, intrinsics and pure functions declared before it; Fun has no
+// globals, so its result then only depends on its arguments. Pure functions
+// with 1 to MEMO_MAX_PARAMS parameters get a cache in .bss (._.<name>.memo):
+// MEMO_ENTRIES entries of
+//
+//     used, argument 1 ... argument n, result
+//
+// indexed by a multiplicative hash of the arguments. A lookup probes
+// MEMO_PROBES entries from there; a miss fills the first free one, or evicts
+// the first if they are all taken, so the table never grows.
+//
+// ._.<name> becomes the lookup and the original code moves to
+// ._.<name>.body, which is also where tail calls to itself jump, so a tail
+// recursive loop only caches the result of the call that started it.
+// With -fprofile the hits and misses are written to the profile as
+//
+//     memo <name> <line> <hits> <misses>
+
+#define MEMO_MAX_PARAMS 4
+#define MEMO_BITS 12
+#define MEMO_ENTRIES (1ul << MEMO_BITS)
+#define MEMO_PROBES 4
+#define MEMO_HASH 0x9E3779B97F4A7C15ul
+
+// true if the function body starting at body (just after "{") is pure
+bool isPureBody(Compiler* compiler, char const *body, Slice name) {
+    uint64_t depth = 1;
+    for (char const *p = body; *p != 0 && depth > 0; p++) {
+        if (*p == '{') {
+            depth++;
+        }
+        else if (*p == '}') {
+            depth--;
+        }
+        else if (*p == '[') {
+            // reads or writes memory
+            return false;
+        }
+        if (!isalpha(*p)) {
+            continue;
+        }
+
+        char const *start = p;
+        while (isalnum(p[1])) {
+            p++;
+        }
+        char const *next = p + 1;
+        while (*next == ' ') {
+            next++;
+        }
+        if (*next != '(') {
+            continue;
+        }
+
+        Slice callee = sliceConstructorEnd(start, p + 1);
+        if (sliceEqualString(callee, "if") || sliceEqualString(callee, "while") || sliceEqualSlice(callee, name) ||
+                findIntrinsic(callee) != INTRINSIC_NONE) {
+            continue;
+        }
+        if (!mapContains(compiler -> functionTable, callee)) {
+            // print, or a function we don't know yet
+            return false;
+        }
+        if (!compiler -> functions[mapGet(compiler -> functionTable, callee)].pure) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool shouldMemoize(Compiler* compiler, FunctionInfo* function) {
+    return compiler -> options.memoize && function -> pure &&
+           function -> numParams > 0 && function -> numParams <= MEMO_MAX_PARAMS;
+}
+
+// ._.<name>: looks the arguments up and calls ._.<name>.body on a miss. The arguments are
+// where the caller pushed them, 16(%rbp) is the last one.
+void emitMemoWrapper(Compiler* compiler, FunctionInfo* function) {
+    uint64_t numParams = function -> numParams;
+    uint64_t entrySize = (numParams + 2) * 8;
+    uint64_t hitSlot = 0;
+    if (compiler -> options.profile) {
+        hitSlot = addProfileCounter(compiler, COUNTER_MEMO, function -> name, function -> line);
+    }
+
+    emitf(compiler, "    .local ._.");
+    emitSlice(compiler, function -> name);
+    emitf(compiler, ".memo\n");
+    emitf(compiler, "    .comm ._.");
+    emitSlice(compiler, function -> name);
+    emitf(compiler, ".memo, %lu, 8\n", MEMO_ENTRIES * entrySize);
+
+    emitf(compiler, "._.");
+    emitSlice(compiler, function -> name);
+    emitf(compiler, ":\n");
+
+    // the cache isn't shared by the threads of a pfor (see parallel.h)
+    emitLine(compiler, "    cmpl $0, ._.pforBusy(%rip)");
+    emitf(compiler, "    jne ._.");
+    emitSlice(compiler, function -> name);
+    emitf(compiler, ".body\n");
+    emitLine(compiler, "    push %rbp");
+    emitLine(compiler, "    mov %rsp, %rbp");
+
+    // hash of the arguments, its top bits are the index
+    emitLine(compiler, "    xor %eax, %eax");
+    emitf(compiler, "    mov $%lu, %%rdx\n", MEMO_HASH);
+    for (uint64_t i = 0; i < numParams; i++) {
+        emitf(compiler, "    xor %lu(%%rbp), %%rax\n", 8 * (numParams - i) + 8);
+        emitLine(compiler, "    imul %rdx, %rax");
+    }
+    emitf(compiler, "    shr $%d, %%rax\n", 64 - MEMO_BITS);
+    emitf(compiler, "    lea ._.");
+    emitSlice(compiler, function -> name);
+    emitf(compiler, ".memo(%%rip), %%rsi\n");
+
+    for (uint64_t probe = 0; probe <= MEMO_PROBES; probe++) {
+        // %rdx = entry (index + probe) % MEMO_ENTRIES, the one after the last probe is the evicted one
+        emitf(compiler, "    lea %lu(%%rax), %%rdx\n", probe % MEMO_PROBES);
+        emitf(compiler, "    and $%lu, %%rdx\n", MEMO_ENTRIES - 1);
+        emitf(compiler, "    imul $%lu, %%rdx, %%rdx\n", entrySize);
+        emitLine(compiler, "    add %rsi, %rdx");
+        if (probe == MEMO_PROBES) {
+            break;
+        }
+
+        emitLine(compiler, "    cmpq $0, (%rdx)");
+        emitf(compiler, "    je ._.");
+        emitSlice(compiler, function -> name);
+        emitf(compiler, ".memoMiss\n");
+        for (uint64_t i = 0; i < numParams; i++) {
+            emitf(compiler, "    mov %lu(%%rbp), %%rdi\n", 8 * (numParams - i) + 8);
+            emitf(compiler, "    cmp %%rdi, %lu(%%rdx)\n", 8 * i + 8);
+            emitf(compiler, "    jne ._.");
+            emitSlice(compiler, function -> name);
+            emitf(compiler, ".memoProbe%lu\n", probe + 1);
+        }
+        if (compiler -> options.profile) {
+            emitf(compiler, "    incq ._.profCounters+%lu(%%rip)\n", hitSlot * 8);
+        }
+        emitf(compiler, "    mov %lu(%%rdx), %%rax\n", entrySize - 8);
+        emitLine(compiler, "    pop %rbp");
+        emitLine(compiler, "    ret");
+        emitf(compiler, "._.");
+        emitSlice(compiler, function -> name);
+        emitf(compiler, ".memoProbe%lu:\n", probe + 1);
+    }
+
+    emitf(compiler, "._.");
+    emitSlice(compiler, function -> name);
+    emitf(compiler, ".memoMiss:\n");
+    if (compiler -> options.profile) {
+        emitf(compiler, "    incq ._.profCounters+%lu(%%rip)\n", (hitSlot + 1) * 8);
+    }
+    emitLine(compiler, "    push %rdx");
+    for (uint64_t i = 0; i < numParams; i++) {
+        emitf(compiler, "    push %lu(%%rbp)\n", 8 * (numParams - i) + 8);
+    }
+    emitf(compiler, "    call ._.");
+    emitSlice(compiler, function -> name);
+    emitf(compiler, ".body\n");
+    emitf(compiler, "    add $%lu, %%rsp\n", numParams * 8);
+    emitLine(compiler, "    pop %rdx");
+
+    // the body may have used the entry in the meantime, it is rewritten as a whole
+    emitLine(compiler, "    movq $1, (%rdx)");
+    for (uint64_t i = 0; i < numParams; i++) {
+        emitf(compiler, "    mov %lu(%%rbp), %%rdi\n", 8 * (numParams - i) + 8);
+        emitf(compiler, "    mov %%rdi, %lu(%%rdx)\n", 8 * i + 8);
+    }
+    emitf(compiler, "    mov %%rax, %lu(%%rdx)\n", entrySize - 8);
+    emitLine(compiler, "    pop %rbp");
+    emitLine(compiler, "    ret");
+
+    emitf(compiler, "._.");
+    emitSlice(compiler, function -> name);
+    emitf(compiler, ".body:\n");
+    compiler -> stats -> functionsMemoized++;
+}
@@ -0,0 +1,442 @@
+#pragma once
+
+// libc includes (available in both C and C++)
+#include <stdlib.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+// Implementation includes
+#include "constant folding.h"
+
+// Parallel loops
+//
+//     pfor (i, lo, hi) { ... }
+//     pfor (i, lo, hi, sum) { ... }
+//
+// runs the body for every i in [lo, hi), in no particular order and on as
+// many threads as there are cpus (FUN_THREADS=<n> to choose). The body is
+// compiled into .LparallelBody<n>, which runs a range of iterations on the
+// frame of the function it is in. Every thread gets its own copy of that
+// frame, so the variables assigned in the body, i included, are private to
+// the thread and the function's variables keep the values they had before
+// the loop. Arrays are shared, which is how iterations hand results back.
+//
+// With a fourth name the loop is a reduction: every thread's copy of that
+// variable starts at 0, and after the loop what they add up to is added to
+// the function's. Adding to it is the only thing the body should do with it.
+//
+// The runtime (._.pfor) starts its threads the first time a loop runs in
+// parallel; they sleep on a futex between loops. The iterations are split
+// evenly between the threads. Each thread's share is its deque: it takes
+// chunks of ._.pforChunk iterations from the front, and when it runs out it
+// steals the back half of another thread's share. A loop is over when every
+// iteration has run (._.pforPending). One loop runs in parallel at a time;
+// a pfor reached while another is running (in its body, or in a function
+// it calls) runs on the thread that reaches it, as does every pfor when
+// there is one thread.
+//
+// A loop running in parallel doesn't use the caches of memoized functions
+// (see memo.h), and -fprofile counts in it are approximate. The threads have
+// the usual 8MB stack whatever -fstack-size says.
+
+#define PFOR_MAX_THREADS 64
+#define PFOR_SPLIT 8                    // chunks per thread when the loop starts
+#define PFOR_DEQUE 64                   // bytes of a deque: lock, first, end, on its own cache line
+
+// Linux system calls
+#define SYS_SCHED_YIELD 24
+#define SYS_FUTEX 202
+#define FUTEX_WAIT_PRIVATE 128
+#define FUTEX_WAKE_PRIVATE 129
+
+// the loop variable if text (a line of a function) starts a pfor
+optionalSlice parallelVariable(char const *text) {
+    optionalSlice variable = { false, sliceConstructorLen(0, 0) };
+    while (isspace(*text)) {
+        text++;
+    }
+    if (strncmp(text, "pfor", 4) != 0 || isalnum(text[4])) {
+        return variable;
+    }
+    text += 4;
+    while (*text == ' ') {
+        text++;
+    }
+    if (*text != '(') {
+        return variable;
+    }
+    text++;
+    while (*text == ' ') {
+        text++;
+    }
+    char const *start = text;
+    while (isalnum(*text)) {
+        text++;
+    }
+    if (text > start && isalpha(*start)) {
+        variable.exists = true;
+        variable.item = sliceConstructorEnd(start, text);
+    }
+    return variable;
+}
+
+// waits until the lock at (reg) is ours, spinning on a plain read
+void emitParallelLock(Compiler* compiler, char const *reg, char const *label) {
+    emitf(compiler, "%s:\n", label);
+    emitLine(compiler, "    mov $1, %eax");
+    emitf(compiler, "    xchg %%eax, (%s)\n", reg);
+    emitLine(compiler, "    test %eax, %eax");
+    emitf(compiler, "    jz %sHeld\n", label);
+    emitf(compiler, "%sWait:\n", label);
+    emitLine(compiler, "    pause");
+    emitf(compiler, "    cmpl $0, (%s)\n", reg);
+    emitf(compiler, "    jne %sWait\n", label);
+    emitf(compiler, "    jmp %s\n", label);
+    emitf(compiler, "%sHeld:\n", label);
+}
+
+void emitFutex(Compiler* compiler, char const *word, uint64_t operation) {
+    emitf(compiler, "    lea %s(%%rip), %%rdi\n", word);
+    emitf(compiler, "    mov $%lu, %%esi\n", operation);
+    emitLine(compiler, "    xor %r10d, %r10d");
+    emitf(compiler, "    mov $%d, %%eax\n", SYS_FUTEX);
+    emitLine(compiler, "    syscall");
+}
+
+// ._.pfor, ._.pforWork (a thread's part of a loop) and ._.pforThread (what the threads run)
+void emitParallelRuntime(Compiler* compiler) {
+    emitLine(compiler, "    .bss");
+    emitLine(compiler, "    .align 8");
+    emitLine(compiler, "._.pforBusy: .zero 8");               // memoized functions check it
+    if (compiler -> countParallel == 0) {
+        emitLine(compiler, "    .text");
+        return;
+    }
+    emitLine(compiler, "._.pforThreads: .zero 8");
+    emitf(compiler, "._.pforThreadIds: .zero %d\n", 8 * PFOR_MAX_THREADS);
+    emitLine(compiler, "._.pforGeneration: .zero 4");         // futex, one more for every loop
+    emitLine(compiler, "._.pforRunning: .zero 4");            // futex, threads still in the loop
+    emitLine(compiler, "._.pforBody: .zero 8");
+    emitLine(compiler, "._.pforFrame: .zero 8");
+    emitLine(compiler, "._.pforBelow: .zero 8");
+    emitLine(compiler, "._.pforAbove: .zero 8");
+    emitLine(compiler, "._.pforAccumulator: .zero 8");
+    emitLine(compiler, "._.pforChunk: .zero 8");
+    emitLine(compiler, "    .align 64");
+    emitLine(compiler, "._.pforPending: .zero 8");
+    emitLine(compiler, "._.pforTotal: .zero 8");
+    emitLine(compiler, "    .align 64");
+    emitf(compiler, "._.pforDeques: .zero %d\n", PFOR_DEQUE * PFOR_MAX_THREADS);
+    emitLine(compiler, "    .data");
+    emitLine(compiler, "._.pforThreadsVariable: .string \"FUN_THREADS\"");
+    emitLine(compiler, "    .text");
+
+    // %rdi = body, %rsi = first iteration, %rdx = end, %rcx = bytes below %rbp, %r8 = bytes
+    // above it, %r9 = offset of the accumulator or 0; %rbp is the caller's frame.
+    // Returns what the accumulators add up to.
+    emitLine(compiler, "._.pfor:");
+    emitLine(compiler, "    push %rbx");
+    emitLine(compiler, "    push %r14");
+    emitLine(compiler, "    push %rbp");
+    emitLine(compiler, "    xor %eax, %eax");
+    emitLine(compiler, "    cmp %rdx, %rsi");
+    emitLine(compiler, "    jae ._.pforReturn");
+    emitLine(compiler, "    cmpq $0, ._.pforThreads(%rip)");
+    emitLine(compiler, "    jne ._.pforReady");
+    emitLine(compiler, "    push %rdi");
+    emitLine(compiler, "    push %rsi");
+    emitLine(compiler, "    push %rdx");
+    emitLine(compiler, "    push %rcx");
+    emitLine(compiler, "    push %r8");
+    emitLine(compiler, "    push %r9");
+    emitLine(compiler, "    call ._.pforStart");
+    emitLine(compiler, "    pop %r9");
+    emitLine(compiler, "    pop %r8");
+    emitLine(compiler, "    pop %rcx");
+    emitLine(compiler, "    pop %rdx");
+    emitLine(compiler, "    pop %rsi");
+    emitLine(compiler, "    pop %rdi");
+    emitLine(compiler, "._.pforReady:");
+    emitLine(compiler, "    cmpq $1, ._.pforThreads(%rip)");
+    emitLine(compiler, "    je ._.pforSerial");
+    emitLine(compiler, "    mov $1, %eax");
+    emitLine(compiler, "    xchg %eax, ._.pforBusy(%rip)");
+    emitLine(compiler, "    test %eax, %eax");
+    emitLine(compiler, "    jnz ._.pforSerial");
+
+    emitLine(compiler, "    mov %rdi, ._.pforBody(%rip)");
+    emitLine(compiler, "    mov %rbp, ._.pforFrame(%rip)");
+    emitLine(compiler, "    mov %rcx, ._.pforBelow(%rip)");
+    emitLine(compiler, "    mov %r8, ._.pforAbove(%rip)");
+    emitLine(compiler, "    mov %r9, ._.pforAccumulator(%rip)");
+    emitLine(compiler, "    movq $0, ._.pforTotal(%rip)");
+    emitLine(compiler, "    mov %rdx, %rax");
+    emitLine(compiler, "    sub %rsi, %rax");
+    emitLine(compiler, "    mov %rax, ._.pforPending(%rip)");
+    emitLine(compiler, "    mov %rsi, %r8");
+
+    // chunk = max(1, iterations / (threads * PFOR_SPLIT))
+    emitLine(compiler, "    mov ._.pforThreads(%rip), %rcx");
+    emitf(compiler, "    imul $%d, %%rcx, %%rcx\n", PFOR_SPLIT);
+    emitLine(compiler, "    xor %edx, %edx");
+    emitLine(compiler, "    div %rcx");
+    emitLine(compiler, "    cmp $1, %rax");
+    emitLine(compiler, "    adc $0, %rax");
+    emitLine(compiler, "    mov %rax, ._.pforChunk(%rip)");
+
+    // thread k gets iterations / threads, and one more if k < iterations % threads
+    emitLine(compiler, "    mov ._.pforPending(%rip), %rax");
+    emitLine(compiler, "    xor %edx, %edx");
+    emitLine(compiler, "    divq ._.pforThreads(%rip)");
+    emitLine(compiler, "    lea ._.pforDeques(%rip), %rdi");
+    emitLine(compiler, "    xor %ecx, %ecx");
+    emitLine(compiler, "._.pforSplit:");
+    emitLine(compiler, "    mov %r8, 8(%rdi)");
+    emitLine(compiler, "    add %rax, %r8");
+    emitLine(compiler, "    cmp %rdx, %rcx");
+    emitLine(compiler, "    adc $0, %r8");
+    emitLine(compiler, "    mov %r8, 16(%rdi)");
+    emitf(compiler, "    add $%d, %%rdi\n", PFOR_DEQUE);
+    emitLine(compiler, "    inc %rcx");
+    emitLine(compiler, "    cmp ._.pforThreads(%rip), %rcx");
+    emitLine(compiler, "    jb ._.pforSplit");
+
+    // wake the threads, do our part and wait for them to be done
+    emitLine(compiler, "    mov ._.pforThreads(%rip), %eax");
+    emitLine(compiler, "    dec %eax");
+    emitLine(compiler, "    mov %eax, ._.pforRunning(%rip)");
+    emitLine(compiler, "    lock incl ._.pforGeneration(%rip)");
+    emitLine(compiler, "    mov $0x7FFFFFFF, %edx");
+    emitFutex(compiler, "._.pforGeneration", FUTEX_WAKE_PRIVATE);
+    emitLine(compiler, "    xor %edi, %edi");
+    emitLine(compiler, "    call ._.pforWork");
+    emitLine(compiler, "._.pforJoin:");
+    emitLine(compiler, "    mov ._.pforRunning(%rip), %edx");
+    emitLine(compiler, "    test %edx, %edx");
+    emitLine(compiler, "    jz ._.pforJoined");
+    emitFutex(compiler, "._.pforRunning", FUTEX_WAIT_PRIVATE);
+    emitLine(compiler, "    jmp ._.pforJoin");
+    emitLine(compiler, "._.pforJoined:");
+    emitLine(compiler, "    mov ._.pforTotal(%rip), %rax");
+    emitLine(compiler, "    movl $0, ._.pforBusy(%rip)");
+    emitLine(compiler, "    jmp ._.pforReturn");
+
+    // all the iterations at once on a copy of the frame on this stack
+    emitLine(compiler, "._.pforSerial:");
+    emitLine(compiler, "    mov %rsp, %r14");
+    emitLine(compiler, "    mov %r9, %rbx");
+    emitLine(compiler, "    mov %rdi, %r10");
+    emitLine(compiler, "    mov %rsi, %r11");
+    emitLine(compiler, "    mov %rdx, %r9");
+    emitLine(compiler, "    mov %rcx, %rdx");
+    emitLine(compiler, "    lea (%rcx,%r8), %rcx");
+    emitLine(compiler, "    sub %rcx, %rsp");
+    emitLine(compiler, "    and $0xFFFFFFFFFFFFFFF0, %rsp");
+    emitLine(compiler, "    mov %rbp, %rsi");
+    emitLine(compiler, "    sub %rdx, %rsi");
+    emitLine(compiler, "    mov %rsp, %rdi");
+    emitLine(compiler, "    shr $3, %rcx");
+    emitLine(compiler, "    rep movsq");
+    emitLine(compiler, "    lea (%rsp,%rdx), %rbp");
+    emitLine(compiler, "    test %rbx, %rbx");
+    emitLine(compiler, "    jz ._.pforSerialRun");
+    emitLine(compiler, "    movq $0, (%rbp,%rbx)");
+    emitLine(compiler, "._.pforSerialRun:");
+    emitLine(compiler, "    mov %r11, %rdi");
+    emitLine(compiler, "    mov %r9, %rsi");
+    emitLine(compiler, "    call *%r10");
+    emitLine(compiler, "    xor %eax, %eax");
+    emitLine(compiler, "    test %rbx, %rbx");
+    emitLine(compiler, "    jz ._.pforSerialDone");
+    emitLine(compiler, "    mov (%rbp,%rbx), %rax");
+    emitLine(compiler, "._.pforSerialDone:");
+    emitLine(compiler, "    mov %r14, %rsp");
+    emitLine(compiler, "._.pforReturn:");
+    emitLine(compiler, "    pop %rbp");
+    emitLine(compiler, "    pop %r14");
+    emitLine(compiler, "    pop %rbx");
+    emitLine(compiler, "    ret");
+
+    // %edi = thread. The bodies leave %rbx and %r14 alone: %rbx is our deque, %r14 our stack.
+    emitLine(compiler, "._.pforWork:");
+    emitLine(compiler, "    push %rbp");
+    emitLine(compiler, "    push %rbx");
+    emitLine(compiler, "    push %r14");
+    emitLine(compiler, "    mov %rsp, %r14");
+    emitLine(compiler, "    mov %edi, %edi");
+    emitLine(compiler, "    shl $6, %rdi");                   // PFOR_DEQUE
+    emitLine(compiler, "    lea ._.pforDeques(%rip), %rbx");
+    emitLine(compiler, "    add %rdi, %rbx");
+    emitLine(compiler, "    mov ._.pforBelow(%rip), %rdx");
+    emitLine(compiler, "    mov ._.pforAbove(%rip), %rcx");
+    emitLine(compiler, "    add %rdx, %rcx");
+    emitLine(compiler, "    sub %rcx, %rsp");
+    emitLine(compiler, "    and $0xFFFFFFFFFFFFFFF0, %rsp");
+    emitLine(compiler, "    mov ._.pforFrame(%rip), %rsi");
+    emitLine(compiler, "    sub %rdx, %rsi");
+    emitLine(compiler, "    mov %rsp, %rdi");
+    emitLine(compiler, "    shr $3, %rcx");
+    emitLine(compiler, "    rep movsq");
+    emitLine(compiler, "    lea (%rsp,%rdx), %rbp");
+    emitLine(compiler, "    mov ._.pforAccumulator(%rip), %rax");
+    emitLine(compiler, "    test %rax, %rax");
+    emitLine(compiler, "    jz ._.pforNext");
+    emitLine(compiler, "    movq $0, (%rbp,%rax)");
+
+    // a chunk from the front of our deque
+    emitParallelLock(compiler, "%rbx", "._.pforNext");
+    emitLine(compiler, "    mov 8(%rbx), %rdi");
+    emitLine(compiler, "    mov 16(%rbx), %rsi");
+    emitLine(compiler, "    mov %rsi, %rax");
+    emitLine(compiler, "    sub %rdi, %rax");
+    emitLine(compiler, "    cmp ._.pforChunk(%rip), %rax");
+    emitLine(compiler, "    jbe ._.pforLast");
+    emitLine(compiler, "    mov ._.pforChunk(%rip), %rax");
+    emitLine(compiler, "    lea (%rdi,%rax), %rsi");
+    emitLine(compiler, "._.pforLast:");
+    emitLine(compiler, "    mov %rsi, 8(%rbx)");
+    emitLine(compiler, "    movl $0, (%rbx)");
+    emitLine(compiler, "    test %rax, %rax");
+    emitLine(compiler, "    jz ._.pforSteal");
+    emitLine(compiler, "    push %rax");
+    emitLine(compiler, "    call *._.pforBody(%rip)");
+    emitLine(compiler, "    pop %rax");
+    emitLine(compiler, "    lock sub %rax, ._.pforPending(%rip)");
+    emitLine(compiler, "    jmp ._.pforNext");
+
+    // ours is empty, take the back half of the next one that isn't
+    emitLine(compiler, "._.pforSteal:");
+    emitLine(compiler, "    cmpq $0, ._.pforPending(%rip)");
+    emitLine(compiler, "    je ._.pforDone");
+    emitLine(compiler, "    mov ._.pforThreads(%rip), %rcx");
+    emitLine(compiler, "    dec %rcx");
+    emitLine(compiler, "    mov %rbx, %rdx");
+    emitLine(compiler, "._.pforVictim:");
+    emitLine(compiler, "    test %rcx, %rcx");
+    emitLine(compiler, "    jz ._.pforIdle");
+    emitLine(compiler, "    dec %rcx");
+    emitf(compiler, "    add $%d, %%rdx\n", PFOR_DEQUE);
+    emitLine(compiler, "    mov ._.pforThreads(%rip), %rdi");
+    emitLine(compiler, "    shl $6, %rdi");
+    emitLine(compiler, "    lea ._.pforDeques(%rip), %rax");
+    emitLine(compiler, "    add %rax, %rdi");
+    emitLine(compiler, "    cmp %rdi, %rdx");
+    emitLine(compiler, "    cmovae %rax, %rdx");
+    emitLine(compiler, "    mov 8(%rdx), %rdi");
+    emitLine(compiler, "    cmp 16(%rdx), %rdi");
+    emitLine(compiler, "    jae ._.pforVictim");
+    emitParallelLock(compiler, "%rdx", "._.pforVictimLock");
+    emitLine(compiler, "    mov 8(%rdx), %rdi");
+    emitLine(compiler, "    mov 16(%rdx), %rsi");
+    emitLine(compiler, "    mov %rsi, %rax");
+    emitLine(compiler, "    sub %rdi, %rax");
+    emitLine(compiler, "    jnz ._.pforStolen");
+    emitLine(compiler, "    movl $0, (%rdx)");
+    emitLine(compiler, "    jmp ._.pforVictim");
+    emitLine(compiler, "._.pforStolen:");
+    emitLine(compiler, "    mov %rax, %r8");
+    emitLine(compiler, "    shr %r8");
+    emitLine(compiler, "    sub %r8, %rax");
+    emitLine(compiler, "    mov %rsi, %r8");
+    emitLine(compiler, "    sub %rax, %r8");
+    emitLine(compiler, "    mov %r8, 16(%rdx)");
+    emitLine(compiler, "    movl $0, (%rdx)");
+    emitParallelLock(compiler, "%rbx", "._.pforOwnLock");
+    emitLine(compiler, "    mov %r8, 8(%rbx)");
+    emitLine(compiler, "    mov %rsi, 16(%rbx)");
+    emitLine(compiler, "    movl $0, (%rbx)");
+    emitLine(compiler, "    jmp ._.pforNext");
+
+    // nothing to steal but iterations are still running, let their threads have the cpu
+    emitLine(compiler, "._.pforIdle:");
+    emitLine(compiler, "    pause");
+    emitf(compiler, "    mov $%d, %%eax\n", SYS_SCHED_YIELD);
+    emitLine(compiler, "    syscall");
+    emitLine(compiler, "    jmp ._.pforSteal");
+
+    emitLine(compiler, "._.pforDone:");
+    emitLine(compiler, "    mov ._.pforAccumulator(%rip), %rax");
+    emitLine(compiler, "    test %rax, %rax");
+    emitLine(compiler, "    jz ._.pforLeave");
+    emitLine(compiler, "    mov (%rbp,%rax), %rax");
+    emitLine(compiler, "    lock add %rax, ._.pforTotal(%rip)");
+    emitLine(compiler, "._.pforLeave:");
+    emitLine(compiler, "    mov %r14, %rsp");
+    emitLine(compiler, "    pop %r14");
+    emitLine(compiler, "    pop %rbx");
+    emitLine(compiler, "    pop %rbp");
+    emitLine(compiler, "    ret");
+
+    // the threads: %rdi = thread, the last generation seen is at (%rsp)
+    emitLine(compiler, "._.pforThread:");
+    emitLine(compiler, "    push %rbx");
+    emitLine(compiler, "    mov %rdi, %rbx");
+    emitLine(compiler, "    push $0");
+    emitLine(compiler, "._.pforSleep:");
+    emitLine(compiler, "    mov ._.pforGeneration(%rip), %edx");
+    emitLine(compiler, "    cmp %edx, (%rsp)");
+    emitLine(compiler, "    jne ._.pforWake");
+    emitFutex(compiler, "._.pforGeneration", FUTEX_WAIT_PRIVATE);
+    emitLine(compiler, "    jmp ._.pforSleep");
+    emitLine(compiler, "._.pforWake:");
+    emitLine(compiler, "    mov %edx, (%rsp)");
+    emitLine(compiler, "    mov %ebx, %edi");
+    emitLine(compiler, "    call ._.pforWork");
+    emitLine(compiler, "    lock decl ._.pforRunning(%rip)");
+    emitLine(compiler, "    jnz ._.pforSleep");
+    emitLine(compiler, "    mov $1, %edx");
+    emitFutex(compiler, "._.pforRunning", FUTEX_WAKE_PRIVATE);
+    emitLine(compiler, "    jmp ._.pforSleep");
+
+    // the first loop: FUN_THREADS or the number of cpus, clamped to 1..PFOR_MAX_THREADS
+    emitLine(compiler, "._.pforStart:");
+    emitLine(compiler, "    push %rbp");
+    emitLine(compiler, "    mov %rsp, %rbp");
+    emitLine(compiler, "    push %rbx");
+    emitLine(compiler, "    and $0xFFFFFFFFFFFFFFF0, %rsp");
+    emitLine(compiler, "    lea ._.pforThreadsVariable(%rip), %rdi");
+    emitLine(compiler, "    call getenv");
+    emitLine(compiler, "    test %rax, %rax");
+    emitLine(compiler, "    jz ._.pforCpus");
+    emitLine(compiler, "    mov %rax, %rdi");
+    emitLine(compiler, "    xor %esi, %esi");
+    emitLine(compiler, "    mov $10, %edx");
+    emitLine(compiler, "    call strtoul");
+    emitLine(compiler, "    jmp ._.pforClamp");
+    emitLine(compiler, "._.pforCpus:");
+    emitLine(compiler, "    mov $84, %edi");                   // _SC_NPROCESSORS_ONLN
+    emitLine(compiler, "    call sysconf");
+    emitLine(compiler, "._.pforClamp:");
+    emitLine(compiler, "    mov $1, %ecx");
+    emitLine(compiler, "    cmp %rcx, %rax");
+    emitLine(compiler, "    cmovl %rcx, %rax");
+    emitf(compiler, "    mov $%d, %%ecx\n", PFOR_MAX_THREADS);
+    emitLine(compiler, "    cmp %rcx, %rax");
+    emitLine(compiler, "    cmova %rcx, %rax");
+    emitLine(compiler, "    mov %rax, ._.pforThreads(%rip)");
+    emitLine(compiler, "    mov $1, %ebx");
+    emitLine(compiler, "._.pforSpawn:");
+    emitLine(compiler, "    cmp ._.pforThreads(%rip), %rbx");
+    emitLine(compiler, "    jae ._.pforStarted");
+    emitLine(compiler, "    lea ._.pforThreadIds(%rip), %rdi");
+    emitLine(compiler, "    lea (%rdi,%rbx,8), %rdi");
+    emitLine(compiler, "    xor %esi, %esi");
+    emitLine(compiler, "    lea ._.pforThread(%rip), %rdx");
+    emitLine(compiler, "    mov %rbx, %rcx");
+    emitLine(compiler, "    call pthread_create");
+    emitLine(compiler, "    test %eax, %eax");
+    emitLine(compiler, "    jnz ._.pforShort");
+    emitLine(compiler, "    inc %rbx");
+    emitLine(compiler, "    jmp ._.pforSpawn");
+    emitLine(compiler, "._.pforShort:");
+    // do with the threads there are
+    emitLine(compiler, "    mov %rbx, ._.pforThreads(%rip)");
+    emitLine(compiler, "._.pforStarted:");
+    emitLine(compiler, "    lea -8(%rbp), %rsp");
+    emitLine(compiler, "    pop %rbx");
+    emitLine(compiler, "    pop %rbp");
+    emitLine(compiler, "    ret");
+}
@@ -0,0 +1,341 @@
+#pragma once
+
+// libc includes (available in both C and C++)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Implementation includes
+#include "constant folding.h"
+
+// Execution profiling (-fprofile)
+//
+// Every function gets a call counter, every while loop an iteration counter
+// and every if statement counts how often it ran and took its then arm
+// (memoized functions add their cache hits and misses, see memo.h). They
+// are kept in a table in .bss (._.profCounters). With -fprofile=cycles each
+// function also accumulates the rdtsc cycles spent between its entry and its
+// returns; this is inclusive of callees, and recursive calls are counted once
+// per level.
+//
+// After ._.main returns the table is written to the file named by the
+// FUN_PROFILE environment variable (fun.prof by default), one line per
+// counter:
+//
+//     function <name> <line> <calls> <cycles>
+//     loop <function> <line> <iterations>
+//     if <function> <line> <then> <else>
+//     memo <function> <line> <hits> <misses>
+//
+// Lines are lines of the .fun source. tools/funprof.sh maps them back to the
+// source, and -fprofile-use=<file> feeds them back into the compiler.
+
+// registers a counter, returns its slot in ._.profCounters
+uint64_t addProfileCounter(Compiler* compiler, CounterKind kind, Slice function, uint64_t line) {
+    if (compiler -> countCounters == compiler -> capacityCounters) {
+        compiler -> capacityCounters = compiler -> capacityCounters == 0 ? 16 : compiler -> capacityCounters * 2;
+        compiler -> counters = (ProfileCounter*) (realloc(compiler -> counters, sizeof(ProfileCounter) * compiler -> capacityCounters));
+        statsAlloc(compiler -> stats, sizeof(ProfileCounter) * compiler -> capacityCounters);
+    }
+    ProfileCounter* counter = &(compiler -> counters[compiler -> countCounters++]);
+    counter -> kind = kind;
+    counter -> function = function;
+    counter -> line = line;
+    counter -> slot = compiler -> countSlots;
+
+    // functions and ifs have two counters
+    compiler -> countSlots += (kind == COUNTER_LOOP) ? 1 : 2;
+    return counter -> slot;
+}
+
+// rdtsc into %rax
+void emitReadCycles(Compiler* compiler) {
+    emitLine(compiler, "    rdtsc");
+    emitLine(compiler, "    shl $32, %rdx");
+    emitLine(compiler, "    or %rdx, %rax");
+}
+
+// called after the frame of a function has been set up
+void profileFunctionEntry(Compiler* compiler, Slice function, uint64_t line) {
+    if (!compiler -> options.profile) {
+        return;
+    }
+    compiler -> functionSlot = addProfileCounter(compiler, COUNTER_FUNCTION, function, line);
+    emitf(compiler, "    incq ._.profCounters+%lu(%%rip)\n", compiler -> functionSlot * 8);
+
+    if (compiler -> options.profileCycles) {
+        emitReadCycles(compiler);
+        emitf(compiler, "    mov %%rax, %ld(%%rbp)\n", compiler -> cycleOffset);
+    }
+}
+
+// called before every way out of the function (its frame is still there)
+void profileFunctionExit(Compiler* compiler) {
+    if (!compiler -> options.profile || !compiler -> options.profileCycles) {
+        return;
+    }
+    emitReadCycles(compiler);
+    emitf(compiler, "    sub %ld(%%rbp), %%rax\n", compiler -> cycleOffset);
+    emitf(compiler, "    add %%rax, ._.profCounters+%lu(%%rip)\n", (compiler -> functionSlot + 1) * 8);
+}
+
+// called at the start of every iteration of a loop
+void profileLoopIteration(Compiler* compiler, Slice function, uint64_t line) {
+    if (!compiler -> options.profile) {
+        return;
+    }
+    uint64_t slot = addProfileCounter(compiler, COUNTER_LOOP, function, line);
+    emitf(compiler, "    incq ._.profCounters+%lu(%%rip)\n", slot * 8);
+}
+
+// called when an if statement runs, returns the slot profileThenArm needs
+uint64_t profileIf(Compiler* compiler, Slice function, uint64_t line) {
+    if (!compiler -> options.profile) {
+        return 0;
+    }
+    uint64_t slot = addProfileCounter(compiler, COUNTER_IF, function, line);
+    emitf(compiler, "    incq ._.profCounters+%lu(%%rip)\n", slot * 8);
+    return slot;
+}
+
+// called at the start of the then arm of an if statement
+void profileThenArm(Compiler* compiler, uint64_t slot) {
+    if (!compiler -> options.profile) {
+        return;
+    }
+    emitf(compiler, "    incq ._.profCounters+%lu(%%rip)\n", (slot + 1) * 8);
+}
+
+// the counter table and ._.profDump, which writes it out
+void emitProfileDump(Compiler* compiler) {
+    if (!compiler -> options.profile) {
+        return;
+    }
+
+    emitLine(compiler, "    .bss");
+    emitLine(compiler, "    .align 8");
+    emitLine(compiler, "._.profCounters:");
+    emitf(compiler, "    .zero %lu\n", compiler -> countSlots * 8 + 8);
+
+    emitLine(compiler, "    .data");
+    emitLine(compiler, "._.profEnv: .string \"FUN_PROFILE\"");
+    emitLine(compiler, "._.profPath: .string \"fun.prof\"");
+    emitLine(compiler, "._.profMode: .string \"w\"");
+    for (size_t i = 0; i < compiler -> countCounters; i++) {
+        ProfileCounter* counter = &(compiler -> counters[i]);
+        char const *kinds[] = { "function", "loop", "if", "memo" };
+        emitf(compiler, "._.profFormat%lu: .string \"%s ", i, kinds[counter -> kind]);
+        emitSlice(compiler, counter -> function);
+        emitf(compiler, " %lu %s\\n\"\n", counter -> line, counter -> kind == COUNTER_LOOP ? "%lu" : "%lu %lu");
+    }
+
+    emitLine(compiler, "    .text");
+    emitLine(compiler, "._.profDump:");
+    emitLine(compiler, "    push %rbp");
+    emitLine(compiler, "    mov %rsp, %rbp");
+    emitLine(compiler, "    and $0xFFFFFFFFFFFFFFF0, %rsp");
+    emitLine(compiler, "    push %rbx");
+    emitLine(compiler, "    push %rbx");
+    emitLine(compiler, "    lea ._.profEnv(%rip), %rdi");
+    emitLine(compiler, "    call getenv");
+    emitLine(compiler, "    lea ._.profPath(%rip), %rdi");
+    emitLine(compiler, "    test %rax, %rax");
+    emitLine(compiler, "    cmovnz %rax, %rdi");
+    emitLine(compiler, "    lea ._.profMode(%rip), %rsi");
+    emitLine(compiler, "    call fopen");
+    emitLine(compiler, "    test %rax, %rax");
+    emitLine(compiler, "    jz ._.profDumpDone");
+    emitLine(compiler, "    mov %rax, %rbx");
+    for (size_t i = 0; i < compiler -> countCounters; i++) {
+        ProfileCounter* counter = &(compiler -> counters[i]);
+        emitLine(compiler, "    mov %rbx, %rdi");
+        emitf(compiler, "    lea ._.profFormat%lu(%%rip), %%rsi\n", i);
+        if (counter -> kind == COUNTER_IF) {
+            // then arm, else = executions - then arm
+            emitf(compiler, "    mov ._.profCounters+%lu(%%rip), %%rdx\n", (counter -> slot + 1) * 8);
+            emitf(compiler, "    mov ._.profCounters+%lu(%%rip), %%rcx\n", counter -> slot * 8);
+            emitLine(compiler, "    sub %rdx, %rcx");
+        }
+        else {
+            emitf(compiler, "    mov ._.profCounters+%lu(%%rip), %%rdx\n", counter -> slot * 8);
+        }
+        if (counter -> kind == COUNTER_FUNCTION || counter -> kind == COUNTER_MEMO) {
+            emitf(compiler, "    mov ._.profCounters+%lu(%%rip), %%rcx\n", (counter -> slot + 1) * 8);
+        }
+        emitLine(compiler, "    xor %eax, %eax");
+        emitLine(compiler, "    call fprintf");
+    }
+    emitLine(compiler, "    mov %rbx, %rdi");
+    emitLine(compiler, "    call fclose");
+    emitLine(compiler, "._.profDumpDone:");
+    emitLine(compiler, "    pop %rbx");
+    emitLine(compiler, "    pop %rbx");
+    emitLine(compiler, "    mov %rbp, %rsp");
+    emitLine(compiler, "    pop %rbp");
+    emitLine(compiler, "    ret");
+}
+
+// Profile guided optimization (-fprofile-use=<file>)
+//
+// With a profile the compiler
+//     * inlines calls to hot functions whose body is a single return
+//     * makes the more frequent arm of an if the fall-through path and moves
+//       the other one out of line, after all the functions
+//     * lays functions out by decreasing call count, so hot code is contiguous
+//
+// Source lines that changed since the profile was taken just get worse
+// decisions, never wrong code.
+
+#define INLINE_MIN_CALLS 1000
+#define UNROLL_MAX_BYTES 512            // longest loop unroll.h unrolls, condition and body
+
+// skips to the next space separated word of a profile, returns it
+Slice profileWord(char** cursor) {
+    while (**cursor == ' ' || **cursor == '\t') {
+        (*cursor)++;
+    }
+    char* start = *cursor;
+    while (**cursor != 0 && !isspace(**cursor)) {
+        (*cursor)++;
+    }
+    return sliceConstructorEnd(start, *cursor);
+}
+
+uint64_t profileNumber(char** cursor) {
+    return strtoull(profileWord(cursor).start, NULL, 10);
+}
+
+// reads a profile written by a -fprofile program, the text has to outlive the compiler.
+// Entries for lines past the end of the program (a stale profile) are ignored. False if
+// there is no memory for the counts.
+bool loadProfile(Compiler* compiler, char* text) {
+    ProfileData* data = (ProfileData*) (malloc(sizeof(ProfileData)));
+    statsAlloc(compiler -> stats, sizeof(ProfileData));
+    data -> calls = mapCreate(compiler -> stats);
+
+    // ifs are counted by line, lines start at 1
+    data -> lines = 2;
+    for (char const *c = compiler -> program; *c != 0; c++) {
+        data -> lines += *c == '\n';
+    }
+    data -> thenCounts = (uint64_t*) (calloc(data -> lines, sizeof(uint64_t)));
+    data -> elseCounts = (uint64_t*) (calloc(data -> lines, sizeof(uint64_t)));
+    statsAlloc(compiler -> stats, 2 * data -> lines * sizeof(uint64_t));
+    if (data -> thenCounts == NULL || data -> elseCounts == NULL) {
+        return false;
+    }
+
+    for (char* cursor = text; *cursor != 0; ) {
+        Slice kind = profileWord(&cursor);
+        Slice function = profileWord(&cursor);
+        uint64_t line = profileNumber(&cursor);
+        uint64_t first = profileNumber(&cursor);
+        uint64_t second = profileNumber(&cursor);
+
+        if (sliceEqualString(kind, "function")) {
+            mapInsert(data -> calls, function, mapGet(data -> calls, function) + (int64_t)first);
+        }
+        else if (sliceEqualString(kind, "if") && line < data -> lines) {
+            data -> thenCounts[line] += first;
+            data -> elseCounts[line] += second;
+        }
+
+        cursor = strchr(cursor, '\n');
+        if (cursor == NULL) {
+            break;
+        }
+        cursor++;
+    }
+
+    compiler -> profileData = data;
+    compiler -> coldCode = open_memstream(&(compiler -> coldCodeText), &(compiler -> coldCodeLength));
+    return true;
+}
+
+uint64_t profiledCalls(Compiler* compiler, Slice function) {
+    if (compiler -> profileData == NULL) {
+        return 0;
+    }
+    return (uint64_t) mapGet(compiler -> profileData -> calls, function);
+}
+
+// how often the arms of the if statement at line ran, false without a profile for it
+bool profiledIf(Compiler* compiler, uint64_t line, uint64_t* thenCount, uint64_t* elseCount) {
+    ProfileData* data = compiler -> profileData;
+    if (data == NULL || line >= data -> lines || data -> thenCounts[line] + data -> elseCounts[line] == 0) {
+        return false;
+    }
+    *thenCount = data -> thenCounts[line];
+    *elseCount = data -> elseCounts[line];
+    return true;
+}
+
+// not while it is being inlined already: functions calling each other would be inlined forever
+bool shouldInline(Compiler* compiler, FunctionInfo* function) {
+    return function -> returnExpression != NULL && !function -> inlining &&
+           profiledCalls(compiler, function -> name) >= INLINE_MIN_CALLS;
+}
+
+// code generated between beginColdCode and endColdCode goes out of line
+typedef struct ColdRegion {
+    FILE* hot;
+    char* code;
+    size_t codeLength;
+} ColdRegion;
+
+void beginColdCode(Compiler* compiler, ColdRegion* region) {
+    region -> hot = compiler -> out;
+    region -> code = NULL;
+    compiler -> out = open_memstream(&(region -> code), &(region -> codeLength));
+}
+
+void endColdCode(Compiler* compiler, ColdRegion* region) {
+    fclose(compiler -> out);
+    fwrite(region -> code, 1, region -> codeLength, compiler -> coldCode);
+    free(region -> code);
+    compiler -> out = region -> hot;
+}
+
+// writes the functions hottest first, followed by the cold code
+void emitFunctionsByHeat(Compiler* compiler) {
+    if (compiler -> profileData == NULL) {
+        return;
+    }
+
+    uint64_t count = compiler -> countFunctions;
+    uint64_t* order = (uint64_t*) (malloc(sizeof(uint64_t) * (count + 1)));
+    uint64_t* calls = (uint64_t*) (malloc(sizeof(uint64_t) * (count + 1)));
+    statsAlloc(compiler -> stats, 2 * sizeof(uint64_t) * (count + 1));
+    for (size_t i = 0; i < count; i++) {
+        calls[i] = profiledCalls(compiler, compiler -> functions[i].name);
+
+        // insertion sort keeps the source order between functions with the same count
+        size_t j = i;
+        while (j > 0 && calls[order[j - 1]] < calls[i]) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        FunctionInfo* function = &(compiler -> functions[order[i]]);
+        fwrite(function -> code, 1, function -> codeLength, compiler -> out);
+        free(function -> code);
+        function -> code = NULL;
+    }
+    free(order);
+    free(calls);
+
+    fclose(compiler -> coldCode);
+    compiler -> coldCode = NULL;
+    fwrite(compiler -> coldCodeText, 1, compiler -> coldCodeLength, compiler -> out);
+    free(compiler -> coldCodeText);
+    compiler -> coldCodeText = NULL;
+}
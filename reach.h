@@ -0,0 +1,184 @@
+#pragma once
+
+// libc includes (available in both C and C++)
+#include <stdlib.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Implementation includes
+#include "constant folding.h"
+
+// Dead function elimination
+//
+// Before any code is generated the program is scanned once for its fun
+// declarations and the calls (a name followed by "(") in their bodies. The
+// functions reachable from main, or from a call outside any fun, go into
+// compiler -> reachable. The others are still compiled, so their errors are
+// reported, but the code is thrown away and --stats counts them and the bytes
+// of assembly saved. The scan is textual: a function whose calls are all
+// folded or inlined is kept. --stream compiles the program before it has
+// all been read, so every function is kept.
+
+typedef struct Declaration {
+    Slice name;
+    char const *body;                   // after the {
+    char const *end;                    // at the matching }
+} Declaration;
+
+// the name at text if it's called there, length 0 otherwise
+Slice calledName(char const *text) {
+    char const *end = text;
+    while (isalnum(*end)) {
+        end++;
+    }
+    char const *next = end;
+    while (*next == ' ') {
+        next++;
+    }
+    return sliceConstructorEnd(text, *next == '(' ? end : text);
+}
+
+// the } matching the { at text (or the end of the program)
+char const *matchingBrace(char const *text) {
+    uint64_t depth = 0;
+    for (; *text != 0; text++) {
+        if (*text == '{') {
+            depth++;
+        }
+        else if (*text == '}' && --depth == 0) {
+            break;
+        }
+    }
+    return text;
+}
+
+// a called name that is declared and not reached yet joins the work list
+void reachCall(UnorderedMap* declared, UnorderedMap* reachable, Slice name, Slice* work, uint64_t* countWork) {
+    if (name.len == 0 || !mapContains(declared, name) || mapContains(reachable, name)) {
+        return;
+    }
+    mapInsert(reachable, name, 1);
+    work[(*countWork)++] = name;
+}
+
+void findReachable(Compiler* compiler) {
+    phaseBegin(compiler -> stats, PHASE_CALL_GRAPH);
+    mapClear(compiler -> reachable, compiler -> stats);
+
+    // a declaration or a call needs at least 2 bytes of the program
+    uint64_t length = strlen(compiler -> program);
+    uint64_t capacity = length / 2 + 1;
+    Declaration* declarations = (Declaration*) (malloc(sizeof(Declaration) * capacity));
+    Slice* roots = (Slice*) (malloc(sizeof(Slice) * capacity));
+    Slice* work = (Slice*) (malloc(sizeof(Slice) * capacity));
+    statsAlloc(compiler -> stats, (sizeof(Declaration) + 2 * sizeof(Slice)) * capacity);
+    uint64_t countDeclarations = 0;
+    uint64_t countRoots = 0;
+    uint64_t countWork = 0;
+    UnorderedMap* declared = mapCreate(compiler -> stats);
+
+    // the declarations, and the calls outside them which are roots like main
+    char const *text = compiler -> program;
+    while (*text != 0) {
+        if (!isalpha(*text) || (text > compiler -> program && isalnum(text[-1]))) {
+            text++;
+            continue;
+        }
+        char const *end = text;
+        while (isalnum(*end)) {
+            end++;
+        }
+        if (sliceEqualString(sliceConstructorEnd(text, end), "fun")) {
+            while (*end == ' ') {
+                end++;
+            }
+            char const *name = end;
+            while (isalnum(*end)) {
+                end++;
+            }
+            char const *body = strchr(end, '{');
+            if (name == end || body == NULL) {
+                break;                  // statement() reports it
+            }
+            Declaration* declaration = &(declarations[countDeclarations++]);
+            declaration -> name = sliceConstructorEnd(name, end);
+            declaration -> body = body + 1;
+            declaration -> end = matchingBrace(body);
+            mapInsert(declared, declaration -> name, (int64_t)(declaration - declarations));
+            text = declaration -> end;
+            continue;
+        }
+        Slice called = calledName(text);
+        if (called.len != 0) {
+            roots[countRoots++] = called;
+        }
+        text = end;
+    }
+
+    for (uint64_t i = 0; i < countRoots; i++) {
+        reachCall(declared, compiler -> reachable, roots[i], work, &countWork);
+    }
+    reachCall(declared, compiler -> reachable, sliceConstructorLen("main", 4), work, &countWork);
+
+    while (countWork > 0) {
+        Declaration* declaration = &(declarations[mapGet(declared, work[--countWork])]);
+        for (char const *call = declaration -> body; call < declaration -> end; call++) {
+            if (isalpha(*call) && !isalnum(call[-1])) {
+                reachCall(declared, compiler -> reachable, calledName(call), work, &countWork);
+            }
+        }
+    }
+
+    freeMap(declared);
+    free(declarations);
+    free(roots);
+    free(work);
+    statsBytes(compiler -> stats, length);
+    phaseEnd(compiler -> stats);
+}
+
+// code generated between beginDeadFunction and endDeadFunction is dropped
+typedef struct DeadFunction {
+    FILE* out;
+    FILE* coldCode;
+    uint64_t instructions;
+} DeadFunction;
+
+bool isReachable(Compiler* compiler, Slice name) {
+    return compiler -> options.stream || mapContains(compiler -> reachable, name);
+}
+
+// dropped code is only counted, nothing is kept that a failed compile could leave behind
+ssize_t countRemoved(void* cookie, char const *data, size_t size) {
+    ((Stats*) cookie) -> bytesRemoved += size;
+    return (ssize_t) size;
+}
+
+FILE* removedCode(Compiler* compiler) {
+    cookie_io_functions_t functions = { NULL, countRemoved, NULL, NULL };
+    return fopencookie(compiler -> stats, "w", functions);
+}
+
+void beginDeadFunction(Compiler* compiler, DeadFunction* dead) {
+    dead -> out = compiler -> out;
+    dead -> coldCode = compiler -> coldCode;
+    dead -> instructions = compiler -> stats -> instructions;
+    compiler -> out = removedCode(compiler);
+    if (compiler -> coldCode != NULL) {
+        compiler -> coldCode = removedCode(compiler);
+    }
+}
+
+void endDeadFunction(Compiler* compiler, DeadFunction* dead) {
+    fclose(compiler -> out);
+    compiler -> stats -> functionsRemoved++;
+    if (dead -> coldCode != NULL) {
+        fclose(compiler -> coldCode);
+    }
+    compiler -> stats -> instructions = dead -> instructions;
+    compiler -> out = dead -> out;
+    compiler -> coldCode = dead -> coldCode;
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+// libc includes (available in both C and C++)
+#include <stdint.h>
+#include <stdbool.h>
+
+// Scanning
+//
+// The lexer mostly looks for the end of a run of white space, of an identifier
+// or of a number. scanSpace, scanAlnum and scanDigits find it with one table
+// lookup per byte. The classes are those of isspace, isalnum and isdigit in
+// the C locale, without the calls, and NUL is in none of them so it ends
+// every scan. Most runs are a byte or two, 16 and 32 byte vector loads were
+// measured no faster than this loop on programs (make bench_scan).
+
+// bits of scanClasses
+typedef enum ScanClass {
+    SCAN_SPACE = 1,
+    SCAN_DIGIT = 2,
+    SCAN_ALPHA = 4,
+    SCAN_ALNUM = SCAN_DIGIT | SCAN_ALPHA
+} ScanClass;
+
+// the classes of every byte: white space is \t to \r and ' ', then digits and letters
+static uint8_t const scanClasses[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 0, 0, 0, 0, 0, 0,
+    0, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 0, 0, 0, 0, 0,
+    0, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+// the loops are optimized even when the rest isn't
+#define SCAN_LOOP __attribute__((optimize("O2")))
+
+bool isSpaceByte(char c) {
+    return scanClasses[(uint8_t) c] & SCAN_SPACE;
+}
+
+bool isDigitByte(char c) {
+    return scanClasses[(uint8_t) c] & SCAN_DIGIT;
+}
+
+bool isAlphaByte(char c) {
+    return scanClasses[(uint8_t) c] & SCAN_ALPHA;
+}
+
+bool isAlnumByte(char c) {
+    return scanClasses[(uint8_t) c] & SCAN_ALNUM;
+}
+
+// the first byte from p on that isn't in the class
+SCAN_LOOP
+char const *scanRun(char const *p, ScanClass scanClass) {
+    while (scanClasses[(uint8_t) *p] & scanClass) {
+        p++;
+    }
+    return p;
+}
+
+char const *scanSpace(char const *p) {
+    return scanRun(p, SCAN_SPACE);
+}
+
+char const *scanAlnum(char const *p) {
+    return scanRun(p, SCAN_ALNUM);
+}
+
+char const *scanDigits(char const *p) {
+    return scanRun(p, SCAN_DIGIT);
+}
@@ -0,0 +1,563 @@
+#pragma once
+
+// libc includes (available in both C and C++)
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Implementation includes
+#include "constant folding.h"
+#include "ast.h"
+#include "select.h"
+
+// Scalar evolution: closed forms for counted while loops
+//
+// A loop qualifies when its condition compares expressions of + - * and its
+// body only has assignments "v = v + e" (each variable assigned once, e not
+// using v) and calls to functions that just return a call free expression
+// without / or %, which can be dropped. Every variable then evolves as a
+// polynomial in the iteration number j, kept in the binomial basis
+//
+//     value(j) = t0 + t1 * C(j, 1) + t2 * C(j, 2)
+//
+// where the t's are trees over the values on entry to the loop. Summing a
+// polynomial over j just shifts its terms up, so an induction variable is
+// degree 1 and a sum of induction variables degree 2. From the condition we
+// get the trip count k at run time and store value(k) for every variable.
+// Everything is modulo 2^64 like the loop itself; where the loop could wrap
+// around instead of terminating, a runtime guard falls back to running it.
+
+#define SCEV_MAX_VARIABLES 16
+#define POLY_TERMS 3
+
+typedef struct Poly {
+    Ast* terms[POLY_TERMS];
+} Poly;
+
+typedef struct LoopVariable {
+    Slice name;
+    Ast* increment;                     // the body does name = name + increment
+    uint64_t statement;                 // position of that assignment, the condition is 0
+    bool solving;
+    bool solved;
+    Poly value;                         // value at the start of iteration j
+} LoopVariable;
+
+typedef struct LoopAnalysis {
+    Compiler* compiler;
+    AstPool pool;
+    LoopVariable variables[SCEV_MAX_VARIABLES];
+    uint64_t countVariables;
+} LoopAnalysis;
+
+Poly polyConstant(AstPool* pool, Ast* ast) {
+    Poly poly;
+    poly.terms[0] = ast;
+    for (uint64_t m = 1; m < POLY_TERMS; m++) {
+        poly.terms[m] = astConst(pool, 0);
+    }
+    return poly;
+}
+
+// -1 for the zero polynomial
+int64_t polyDegree(Poly poly) {
+    for (int64_t m = POLY_TERMS - 1; m >= 0; m--) {
+        if (!astIsConst(poly.terms[m], 0)) {
+            return m;
+        }
+    }
+    return -1;
+}
+
+Poly polyAdd(AstPool* pool, Poly a, Poly b) {
+    for (uint64_t m = 0; m < POLY_TERMS; m++) {
+        a.terms[m] = astAdd(pool, a.terms[m], b.terms[m]);
+    }
+    return a;
+}
+
+Poly polySub(AstPool* pool, Poly a, Poly b) {
+    for (uint64_t m = 0; m < POLY_TERMS; m++) {
+        a.terms[m] = astSub(pool, a.terms[m], b.terms[m]);
+    }
+    return a;
+}
+
+// one of the two has to be constant in j
+bool polyMul(AstPool* pool, Poly a, Poly b, Poly* result) {
+    if (polyDegree(a) > 0) {
+        Poly swap = a;
+        a = b;
+        b = swap;
+    }
+    if (polyDegree(a) > 0) {
+        return false;
+    }
+    for (uint64_t m = 0; m < POLY_TERMS; m++) {
+        result -> terms[m] = astMul(pool, a.terms[0], b.terms[m]);
+    }
+    return true;
+}
+
+// value(j + 1), from C(j + 1, m) = C(j, m) + C(j, m - 1)
+Poly polyShift(AstPool* pool, Poly a) {
+    for (uint64_t m = 0; m + 1 < POLY_TERMS; m++) {
+        a.terms[m] = astAdd(pool, a.terms[m], a.terms[m + 1]);
+    }
+    return a;
+}
+
+// the sum of value(t) for t < j, from the sum of C(t, m) for t < j being C(j, m + 1)
+bool polySum(AstPool* pool, Poly a, Poly* result) {
+    if (!astIsConst(a.terms[POLY_TERMS - 1], 0)) {
+        return false;
+    }
+    result -> terms[0] = astConst(pool, 0);
+    for (uint64_t m = 1; m < POLY_TERMS; m++) {
+        result -> terms[m] = a.terms[m - 1];
+    }
+    return true;
+}
+
+LoopVariable* findLoopVariable(LoopAnalysis* analysis, Slice name) {
+    for (uint64_t i = 0; i < analysis -> countVariables; i++) {
+        if (sliceEqualSlice(analysis -> variables[i].name, name)) {
+            return &(analysis -> variables[i]);
+        }
+    }
+    return NULL;
+}
+
+// the constant c for which ast is c * name + (something without name)
+bool linearCoefficient(Ast* ast, Slice name, uint64_t* coefficient) {
+    uint64_t left;
+    uint64_t right;
+    switch (ast -> kind) {
+        case AST_VAR:
+            *coefficient = sliceEqualSlice(ast -> name, name) ? 1 : 0;
+            return true;
+        case AST_ADD:
+        case AST_SUB:
+            if (!linearCoefficient(ast -> left, name, &left) || !linearCoefficient(ast -> right, name, &right)) {
+                return false;
+            }
+            *coefficient = ast -> kind == AST_ADD ? left + right : left - right;
+            return true;
+        case AST_MUL:
+            if (!linearCoefficient(ast -> left, name, &left) || !linearCoefficient(ast -> right, name, &right)) {
+                return false;
+            }
+            if (left == 0 && right == 0) {
+                *coefficient = 0;
+            }
+            else if (left == 0 && ast -> left -> kind == AST_CONST) {
+                *coefficient = ast -> left -> value * right;
+            }
+            else if (right == 0 && ast -> right -> kind == AST_CONST) {
+                *coefficient = left * ast -> right -> value;
+            }
+            else {
+                return false;
+            }
+            return true;
+        default:
+            *coefficient = 0;
+            return true;
+    }
+}
+
+// ast with name replaced by 0
+Ast* substituteZero(AstPool* pool, Ast* ast, Slice name) {
+    switch (ast -> kind) {
+        case AST_VAR:
+            return sliceEqualSlice(ast -> name, name) ? astConst(pool, 0) : ast;
+        case AST_ADD:
+            return astAdd(pool, substituteZero(pool, ast -> left, name), substituteZero(pool, ast -> right, name));
+        case AST_SUB:
+            return astSub(pool, substituteZero(pool, ast -> left, name), substituteZero(pool, ast -> right, name));
+        case AST_MUL:
+            return astMul(pool, substituteZero(pool, ast -> left, name), substituteZero(pool, ast -> right, name));
+        default:
+            return ast;
+    }
+}
+
+bool solveVariable(LoopAnalysis* analysis, LoopVariable* variable);
+
+// the value of ast as seen by the statement at position statement, in iteration j
+bool toPoly(LoopAnalysis* analysis, Ast* ast, uint64_t statement, Poly* result) {
+    AstPool* pool = &(analysis -> pool);
+    Poly left;
+    Poly right;
+    switch (ast -> kind) {
+        case AST_VAR: {
+            LoopVariable* variable = findLoopVariable(analysis, ast -> name);
+            if (variable == NULL) {
+                // not changed by the loop
+                *result = polyConstant(pool, ast);
+                return true;
+            }
+            if (!solveVariable(analysis, variable)) {
+                return false;
+            }
+            // assignments earlier in the body have already been done in this iteration
+            *result = variable -> statement < statement ? polyShift(pool, variable -> value) : variable -> value;
+            return true;
+        }
+        case AST_ADD:
+        case AST_SUB:
+        case AST_MUL:
+            if (!toPoly(analysis, ast -> left, statement, &left) || !toPoly(analysis, ast -> right, statement, &right)) {
+                return false;
+            }
+            if (ast -> kind == AST_MUL) {
+                return polyMul(pool, left, right, result);
+            }
+            *result = ast -> kind == AST_ADD ? polyAdd(pool, left, right) : polySub(pool, left, right);
+            return true;
+        default:
+            *result = polyConstant(pool, ast);
+            return true;
+    }
+}
+
+bool solveVariable(LoopAnalysis* analysis, LoopVariable* variable) {
+    if (variable -> solved) {
+        return true;
+    }
+    if (variable -> solving) {
+        // the increments depend on each other (a = a + b, b = b + a), not a polynomial
+        return false;
+    }
+    variable -> solving = true;
+
+    AstPool* pool = &(analysis -> pool);
+    Poly increment;
+    Poly sum;
+    if (!toPoly(analysis, variable -> increment, variable -> statement, &increment) || !polySum(pool, increment, &sum)) {
+        return false;
+    }
+    variable -> value = polyAdd(pool, polyConstant(pool, astVar(pool, variable -> name)), sum);
+    variable -> solved = true;
+    return true;
+}
+
+// true if the text up to the end of the line has no calls and can't trap
+bool pureLine(char const *text) {
+    bool letters = false;
+    for (char const *p = text; *p != '\n' && *p != 0; p++) {
+        letters = letters || isalpha(*p);
+    }
+    if (!letters) {
+        // folded at compile time, and the folding never traps
+        return true;
+    }
+    for (char const *p = text; *p != '\n' && *p != 0; p++) {
+        if (*p == '/' || *p == '%' || *p == '[') {
+            return false;
+        }
+        if (isalnum(*p) && !isalnum(p[1])) {
+            // the end of a name or literal, a "(" after it is a call
+            char const *next = p + 1;
+            while (*next == ' ') {
+                next++;
+            }
+            if (*next == '(') {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// a call statement that can be dropped: the callee is known, just returns a pure expression and
+// the arguments are pure too
+bool pureCallStatement(LoopAnalysis* analysis, Slice name) {
+    Compiler* compiler = analysis -> compiler;
+    uint64_t numParams = 0;
+    while (!consume(compiler, ")")) {
+        Ast* argument = parseSum(compiler, &(analysis -> pool));
+        if (argument == NULL || !astVariablesKnown(compiler, argument)) {
+            return false;
+        }
+        consume(compiler, ",");
+        numParams++;
+    }
+    if (!atLineEnd(compiler) || !mapContains(compiler -> functionTable, name)) {
+        return false;
+    }
+    FunctionInfo* function = &(compiler -> functions[mapGet(compiler -> functionTable, name)]);
+    return function -> numParams == numParams && function -> returnExpression != NULL && pureLine(function -> returnExpression);
+}
+
+// reads the body of the loop ("{" is next) into analysis -> variables
+bool analyzeLoopBody(LoopAnalysis* analysis) {
+    Compiler* compiler = analysis -> compiler;
+    if (!consume(compiler, "{")) {
+        return false;
+    }
+    uint64_t statement = 0;
+    while (!consume(compiler, "}")) {
+        statement++;
+        optionalSlice id = consumeIdentifier(compiler);
+        if (!id.exists || atLineEnd(compiler)) {
+            return false;
+        }
+        if (consume(compiler, "(")) {
+            if (!pureCallStatement(analysis, id.item)) {
+                return false;
+            }
+            continue;
+        }
+        if (!consume(compiler, "=")) {
+            return false;
+        }
+        Ast* value = parseSum(compiler, &(analysis -> pool));
+        uint64_t coefficient = 0;
+        if (value == NULL || !atLineEnd(compiler) || !astVariablesKnown(compiler, value) ||
+                !mapContains(compiler -> symbolTable, id.item) || findLoopVariable(analysis, id.item) != NULL ||
+                analysis -> countVariables == SCEV_MAX_VARIABLES ||
+                !linearCoefficient(value, id.item, &coefficient) || coefficient != 1) {
+            return false;
+        }
+        LoopVariable* variable = &(analysis -> variables[analysis -> countVariables++]);
+        variable -> name = id.item;
+        variable -> increment = substituteZero(&(analysis -> pool), value, id.item);
+        variable -> statement = statement;
+        variable -> solving = false;
+        variable -> solved = false;
+    }
+    return analysis -> countVariables > 0;
+}
+
+// the inverse of an odd number modulo 2^64 (Newton's iteration, each step doubles the good bits)
+uint64_t inverseOdd(uint64_t x) {
+    uint64_t inverse = x;
+    for (int i = 0; i < 5; i++) {
+        inverse *= 2 - x * inverse;
+    }
+    return inverse;
+}
+
+typedef enum Comparison {
+    COMPARE_EQ,
+    COMPARE_NE,
+    COMPARE_LT,
+    COMPARE_LE,
+    COMPARE_GT,
+    COMPARE_GE
+} Comparison;
+
+// the trip count of a loop whose condition is "left comparison right" into %r12, jumps to
+// .LstartWhile<loop> (the loop itself) when a guard fails
+bool emitTripCount(LoopAnalysis* analysis, uint64_t loop, Poly left, Poly right, Comparison comparison) {
+    Compiler* compiler = analysis -> compiler;
+    AstPool* pool = &(analysis -> pool);
+    if (polyDegree(left) > 1 || polyDegree(right) > 1 ||
+            left.terms[1] -> kind != AST_CONST || right.terms[1] -> kind != AST_CONST) {
+        return false;
+    }
+
+    if (comparison == COMPARE_EQ || comparison == COMPARE_NE) {
+        // left - right = d + slope * j, it is 0 for j = -d / slope
+        uint64_t slope = left.terms[1] -> value - right.terms[1] -> value;
+        if (slope == 0) {
+            return false;
+        }
+        selectPush(compiler, astSub(pool, left.terms[0], right.terms[0]));
+        emitLine(compiler, "    pop %rax");
+        if (comparison == COMPARE_EQ) {
+            // runs once if equal on entry
+            emitLine(compiler, "    test %rax, %rax");
+            emitLine(compiler, "    mov $0, %eax");
+            emitLine(compiler, "    sete %al");
+            emitLine(compiler, "    mov %rax, %r12");
+            return true;
+        }
+
+        // slope = odd * 2^shift, there is a solution only if 2^shift divides d
+        uint64_t shift = (uint64_t)__builtin_ctzll(slope);
+        emitLine(compiler, "    neg %rax");
+        if (shift > 0) {
+            emitf(compiler, "    mov $%lu, %%rsi\n", (1ul << shift) - 1);
+            emitLine(compiler, "    test %rsi, %rax");
+            emitf(compiler, "    jnz .LstartWhile%lu\n", loop);
+            emitf(compiler, "    shr $%lu, %%rax\n", shift);
+        }
+        emitf(compiler, "    mov $%lu, %%rsi\n", inverseOdd(slope >> shift));
+        emitLine(compiler, "    imul %rsi, %rax");
+        if (shift > 0) {
+            // the smallest solution, modulo 2^(64 - shift)
+            emitf(compiler, "    shl $%lu, %%rax\n", shift);
+            emitf(compiler, "    shr $%lu, %%rax\n", shift);
+        }
+        emitLine(compiler, "    mov %rax, %r12");
+        return true;
+    }
+
+    // the side that changes goes on the left
+    if (astIsConst(left.terms[1], 0)) {
+        Poly swap = left;
+        left = right;
+        right = swap;
+        comparison = comparison == COMPARE_LT ? COMPARE_GT :
+                     comparison == COMPARE_LE ? COMPARE_GE :
+                     comparison == COMPARE_GT ? COMPARE_LT : COMPARE_LE;
+    }
+    if (!astIsConst(right.terms[1], 0) || astIsConst(left.terms[1], 0)) {
+        return false;
+    }
+
+    // counting towards the bound, a loop moving away from it only ends by wrapping around
+    int64_t slope = (int64_t)(left.terms[1] -> value);
+    bool up = slope > 0;
+    if (up != (comparison == COMPARE_LT || comparison == COMPARE_LE)) {
+        return false;
+    }
+    uint64_t step = up ? (uint64_t)slope : -(uint64_t)slope;
+    bool inclusive = comparison == COMPARE_LE || comparison == COMPARE_GE;
+
+    selectPush(compiler, left.terms[0]);
+    selectPush(compiler, right.terms[0]);
+    emitLine(compiler, "    pop %rsi");                     // bound
+    emitLine(compiler, "    pop %rdi");                     // start
+    emitLine(compiler, "    xor %r12d, %r12d");
+    emitLine(compiler, "    cmp %rsi, %rdi");
+    emitf(compiler, "    %s .LtripWhile%lu\n", up ? (inclusive ? "ja" : "jae") : (inclusive ? "jb" : "jbe"), loop);
+
+    // k = distance / step, rounded up for < and >, plus one for <= and >=
+    emitLine(compiler, up ? "    mov %rsi, %rax" : "    mov %rdi, %rax");
+    emitLine(compiler, up ? "    sub %rdi, %rax" : "    sub %rsi, %rax");
+    emitLine(compiler, "    xor %edx, %edx");
+    emitf(compiler, "    mov $%lu, %%rcx\n", step);
+    emitLine(compiler, "    div %rcx");
+    if (inclusive) {
+        emitLine(compiler, "    add $1, %rax");
+        emitf(compiler, "    jc .LstartWhile%lu\n", loop);
+    }
+    else {
+        emitLine(compiler, "    test %rdx, %rdx");
+        emitLine(compiler, "    setnz %dl");
+        emitLine(compiler, "    movzbl %dl, %edx");
+        emitLine(compiler, "    add %rdx, %rax");
+    }
+    emitLine(compiler, "    mov %rax, %r12");
+
+    // start + k * slope must not wrap around, otherwise the loop keeps going
+    emitLine(compiler, "    mul %rcx");
+    emitLine(compiler, "    test %rdx, %rdx");
+    emitf(compiler, "    jnz .LstartWhile%lu\n", loop);
+    if (up) {
+        emitLine(compiler, "    add %rdi, %rax");
+        emitf(compiler, "    jc .LstartWhile%lu\n", loop);
+    }
+    else {
+        emitLine(compiler, "    cmp %rax, %rdi");
+        emitf(compiler, "    jb .LstartWhile%lu\n", loop);
+    }
+    emitf(compiler, ".LtripWhile%lu:\n", loop);
+    return true;
+}
+
+// reads the condition ("(" is next) into left comparison right
+bool analyzeCondition(LoopAnalysis* analysis, Ast** left, Ast** right, Comparison* comparison) {
+    static char const *const operators[] = { "==", "!=", "<=", ">=", "<", ">" };
+    static Comparison const comparisons[] = { COMPARE_EQ, COMPARE_NE, COMPARE_LE, COMPARE_GE, COMPARE_LT, COMPARE_GT };
+
+    Compiler* compiler = analysis -> compiler;
+    if (!consume(compiler, "(")) {
+        return false;
+    }
+    *left = parseSum(compiler, &(analysis -> pool));
+    if (*left == NULL) {
+        return false;
+    }
+    bool found = false;
+    for (uint64_t i = 0; i < sizeof(operators) / sizeof(operators[0]) && !found; i++) {
+        if (consume(compiler, operators[i])) {
+            *comparison = comparisons[i];
+            found = true;
+        }
+    }
+    if (!found) {
+        return false;
+    }
+    *right = parseSum(compiler, &(analysis -> pool));
+    return *right != NULL && consume(compiler, ")") &&
+           astVariablesKnown(compiler, *left) && astVariablesKnown(compiler, *right);
+}
+
+// C(%r12, 2) into %r13
+void emitChoose2(Compiler* compiler, uint64_t loop) {
+    // k * (k - 1) / 2 without losing the top bit: halve whichever factor is even
+    emitLine(compiler, "    mov %r12, %rax");
+    emitLine(compiler, "    lea -1(%r12), %rcx");
+    emitLine(compiler, "    test $1, %al");
+    emitf(compiler, "    jnz .LoddWhile%lu\n", loop);
+    emitLine(compiler, "    shr %rax");
+    emitf(compiler, "    jmp ._.choose2While%lu\n", loop);
+    emitf(compiler, ".LoddWhile%lu:\n", loop);
+    emitLine(compiler, "    shr %rcx");
+    emitf(compiler, "._.choose2While%lu:\n", loop);
+    emitLine(compiler, "    imul %rcx, %rax");
+    emitLine(compiler, "    mov %rax, %r13");
+}
+
+// Tries to compute the effect of the while loop whose condition starts at condition in
+// closed form. Emits code that stores the final values and jumps to .LskipWhile<loop>;
+// the loop itself still follows (from .LstartWhile<loop>) for when a runtime guard fails.
+// Returns false, without emitting anything, if the loop doesn't qualify.
+bool closedFormLoop(Compiler* compiler, uint64_t loop, char* condition) {
+    char* savedPointer = compiler -> current;
+    LoopAnalysis* analysis = (LoopAnalysis*) (malloc(sizeof(LoopAnalysis)));
+    statsAlloc(compiler -> stats, sizeof(LoopAnalysis));
+    analysis -> compiler = compiler;
+    analysis -> pool = astPoolCreate(compiler -> stats);
+    analysis -> countVariables = 0;
+
+    compiler -> current = condition;
+    Ast* left = NULL;
+    Ast* right = NULL;
+    Comparison comparison = COMPARE_NE;
+    Poly leftPoly;
+    Poly rightPoly;
+    bool closed = analyzeCondition(analysis, &left, &right, &comparison) && analyzeLoopBody(analysis) &&
+                  toPoly(analysis, left, 0, &leftPoly) && toPoly(analysis, right, 0, &rightPoly);
+    for (uint64_t i = 0; closed && i < analysis -> countVariables; i++) {
+        closed = solveVariable(analysis, &(analysis -> variables[i]));
+    }
+
+    // emitTripCount can still turn the loop down, before it emits anything
+    closed = closed && emitTripCount(analysis, loop, leftPoly, rightPoly, comparison);
+
+    if (closed) {
+        AstPool* pool = &(analysis -> pool);
+        bool needsChoose2 = false;
+        for (uint64_t i = 0; i < analysis -> countVariables; i++) {
+            needsChoose2 = needsChoose2 || polyDegree(analysis -> variables[i].value) == 2;
+        }
+        if (needsChoose2) {
+            emitChoose2(compiler, loop);
+        }
+
+        // all the final values are computed from the values on entry before any of them is stored
+        for (uint64_t i = 0; i < analysis -> countVariables; i++) {
+            Ast** terms = analysis -> variables[i].value.terms;
+            Ast* value = astAdd(pool, terms[0], astMul(pool, terms[1], astRegister(pool, "%r12")));
+            value = astAdd(pool, value, astMul(pool, terms[2], astRegister(pool, "%r13")));
+            selectPush(compiler, value);
+        }
+        for (uint64_t i = analysis -> countVariables; i > 0; i--) {
+            emitLine(compiler, "    pop %rdi");
+            emitf(compiler, "    mov %%rdi, %ld(%%rbp)\n", mapGet(compiler -> symbolTable, analysis -> variables[i - 1].name));
+        }
+        emitf(compiler, "    jmp .LskipWhile%lu\n", loop);
+        compiler -> stats -> loopsEliminated++;
+    }
+
+    astPoolFree(&(analysis -> pool));
+    free(analysis);
+    compiler -> current = savedPointer;
+    return closed;
+}
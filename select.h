@@ -0,0 +1,547 @@
+#pragma once
+
+// libc includes (available in both C and C++)
+#include <stdlib.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Implementation includes
+#include "ast.h"
+
+// Instruction selection
+//
+// The e<n> functions generate code for an expression while it is parsed, so
+// every operand goes through the stack. An expression with nothing but
+// variables, literals and operators in it is parsed into a tree first
+// (selectExpression) and the tree is covered with tiles that compute it in
+// registers, using what x86 can do in one instruction:
+//
+//     x + 5             add $5, %rdi                 immediates that fit in 32 bits
+//     x + y             add -16(%rbp), %rdi          variables as memory operands
+//     a + b * 8 + 3     lea 3(%rdi,%rsi,8), %rdi
+//     x * 9             lea (%rdi,%rdi,8), %rdi      shl for powers of two
+//     x * 100           imul $100, -8(%rbp), %rdi
+//     x - 1             dec %rdi
+//     x / 8, x % 8      shr $3, %rdi / and $7, %rdi
+//     x == 0            test %rdi, %rdi, or cmpq $0, -8(%rbp) for a variable
+//
+// A condition of an if or a while ends with the comparison its jump uses,
+// and x = x + k is addq $k, -8(%rbp). Values live in %rdi, %rsi and %r8 to
+// %r11 (division also uses %rax and %rdx, shifts %rcx). A tree that needs
+// more registers than that, and anything with a call or an array in it, is
+// left to the stack. -fno-select leaves everything to the stack.
+
+#define SELECT_REGISTERS 6
+
+// the 64, 32 and 8 bit names of the registers values are computed in
+char const *const selectRegisters[SELECT_REGISTERS][3] = {
+    { "%rdi", "%edi", "%dil" },
+    { "%rsi", "%esi", "%sil" },
+    { "%r8", "%r8d", "%r8b" },
+    { "%r9", "%r9d", "%r9b" },
+    { "%r10", "%r10d", "%r10b" },
+    { "%r11", "%r11d", "%r11b" }
+};
+
+// conditions of jumps and sets, a code xor 1 is its opposite
+typedef enum ConditionCode {
+    CC_E,
+    CC_NE,
+    CC_B,
+    CC_AE,
+    CC_BE,
+    CC_A
+} ConditionCode;
+
+char const *const conditionNames[] = { "e", "ne", "b", "ae", "be", "a" };
+
+// instructions sign extend 32 bit immediates to 64 bits
+bool fitsImmediate(uint64_t value) {
+    return (int64_t) value >= INT32_MIN && (int64_t) value <= INT32_MAX;
+}
+
+// a literal that fits in an immediate, a variable or a register, the source operand of most instructions
+bool isOperand(Ast* ast) {
+    return (ast -> kind == AST_CONST && fitsImmediate(ast -> value)) || ast -> kind == AST_VAR || ast -> kind == AST_REGISTER;
+}
+
+bool isBinary(Ast* ast) {
+    return ast -> kind >= AST_ADD && ast -> kind <= AST_OR;
+}
+
+bool isComparison(Ast* ast) {
+    return ast -> kind >= AST_LT && ast -> kind <= AST_NE;
+}
+
+bool isCommutative(Ast* ast) {
+    return ast -> kind == AST_ADD || ast -> kind == AST_MUL || ast -> kind == AST_EQ || ast -> kind == AST_NE ||
+           ast -> kind == AST_BIT_AND || ast -> kind == AST_BIT_XOR || ast -> kind == AST_BIT_OR ||
+           ast -> kind == AST_AND || ast -> kind == AST_OR;
+}
+
+int64_t variableOffset(Compiler* compiler, Ast* ast) {
+    return mapGet(compiler -> symbolTable, ast -> name);
+}
+
+// "instruction operand, reg"
+void emitOperand(Compiler* compiler, char const *instruction, Ast* operand, char const *reg) {
+    if (operand -> kind == AST_CONST) {
+        emitf(compiler, "    %s $%ld, %s\n", instruction, (int64_t) operand -> value, reg);
+    }
+    else if (operand -> kind == AST_REGISTER) {
+        emitf(compiler, "    %s %s, %s\n", instruction, operand -> reg, reg);
+    }
+    else {
+        emitf(compiler, "    %s %ld(%%rbp), %s\n", instruction, variableOffset(compiler, operand), reg);
+    }
+}
+
+// registers needed to compute the tree, more than SELECT_REGISTERS if it can't be
+uint64_t selectNeeds(Ast* ast) {
+    if (ast -> kind == AST_CONST || ast -> kind == AST_VAR || ast -> kind == AST_REGISTER) {
+        return 1;
+    }
+    if (ast -> kind == AST_NOT || ast -> kind == AST_BOOL) {
+        return selectNeeds(ast -> left);
+    }
+    if (!isBinary(ast)) {
+        // calls and intrinsics
+        return SELECT_REGISTERS + 1;
+    }
+    uint64_t left = selectNeeds(ast -> left);
+    uint64_t right = selectNeeds(ast -> right) + 1;
+    return left > right ? left : right;
+}
+
+// true if the expression just parsed is all there is: the line ends or something closes it
+bool expressionEnds(Compiler* compiler) {
+    char const *p = compiler -> current;
+    while (*p == ' ' || *p == '\t' || *p == '\r') {
+        p++;
+    }
+    return *p == '\n' || *p == 0 || *p == ')' || *p == ']' || *p == ',' || *p == '}';
+}
+
+// the tree of the expression at compiler -> current if selectValue can compute it, NULL (and
+// compiler -> current where it was) if it can't
+Ast* selectExpression(Compiler* compiler) {
+    if (compiler -> options.noSelect) {
+        return NULL;
+    }
+    char* start = compiler -> current;
+    uint64_t tokens = compiler -> stats -> tokens;
+    astPoolReset(compiler -> trees, compiler -> stats);
+    AstScope scope = { NULL, 0, UINT64_MAX, true };
+    Ast* tree = parseOr(compiler, compiler -> trees, &scope);
+
+    // looking for another operator skips to the next line
+    while (compiler -> current > start && isspace(compiler -> current[-1])) {
+        compiler -> current--;
+    }
+    if (tree == NULL || !expressionEnds(compiler) || selectNeeds(tree) > SELECT_REGISTERS) {
+        // the stack machine parses it again
+        compiler -> current = start;
+        compiler -> stats -> tokens = tokens;
+        return NULL;
+    }
+    return tree;
+}
+
+
+void selectValue(Compiler* compiler, Ast* ast, uint64_t reg);
+ConditionCode selectCondition(Compiler* compiler, Ast* ast, uint64_t reg);
+
+// pushes the value of a tree the compiler built itself (scev.h), emitAst without -fno-select
+void selectPush(Compiler* compiler, Ast* ast) {
+    if (compiler -> options.noSelect || selectNeeds(ast) > SELECT_REGISTERS ||
+            ast -> kind == AST_CONST || ast -> kind == AST_VAR || ast -> kind == AST_REGISTER) {
+        emitAst(compiler, ast);
+        return;
+    }
+    selectValue(compiler, ast, 0);
+    emitLine(compiler, "    push %rdi");
+}
+
+// base + index * scale + displacement, the operands of lea
+typedef struct Address {
+    Ast* base;                          // NULL if there is none
+    Ast* index;
+    uint64_t scale;
+    uint64_t displacement;
+} Address;
+
+// true if ast is index * 2, 4 or 8 (or index << 1, 2 or 3)
+bool scaledTerm(Ast* ast, Ast** index, uint64_t* scale) {
+    if (ast -> kind == AST_MUL) {
+        Ast* factor = ast -> right -> kind == AST_CONST ? ast -> right : ast -> left;
+        uint64_t value = factor -> value;
+        if (factor -> kind == AST_CONST && (value == 2 || value == 4 || value == 8)) {
+            *index = factor == ast -> right ? ast -> left : ast -> right;
+            *scale = value;
+            return true;
+        }
+    }
+    if (ast -> kind == AST_SHL && ast -> right -> kind == AST_CONST && ast -> right -> value >= 1 && ast -> right -> value <= 3) {
+        *index = ast -> left;
+        *scale = 1ul << ast -> right -> value;
+        return true;
+    }
+    return false;
+}
+
+// adds the terms of a sum to address, false if there are more than lea has room for
+bool addressTerms(Ast* ast, Address* address) {
+    if (ast -> kind == AST_ADD) {
+        return addressTerms(ast -> left, address) && addressTerms(ast -> right, address);
+    }
+    if (ast -> kind == AST_SUB && ast -> right -> kind == AST_CONST) {
+        address -> displacement -= ast -> right -> value;
+        return addressTerms(ast -> left, address);
+    }
+    if (ast -> kind == AST_CONST) {
+        address -> displacement += ast -> value;
+        return true;
+    }
+
+    Ast* index;
+    uint64_t scale;
+    if (scaledTerm(ast, &index, &scale)) {
+        // an unscaled index comes with a base, so the index has to be free
+        if (address -> index != NULL) {
+            return false;
+        }
+        address -> index = index;
+        address -> scale = scale;
+        return true;
+    }
+    if (address -> base == NULL) {
+        address -> base = ast;
+        return true;
+    }
+    if (address -> index == NULL) {
+        address -> index = ast;
+        address -> scale = 1;
+        return true;
+    }
+    return false;
+}
+
+// the sum as an address, if lea computes it with fewer instructions than adding
+bool matchAddress(Ast* ast, Address* address) {
+    *address = (Address) { NULL, NULL, 1, 0 };
+    if (!addressTerms(ast, address) || address -> index == NULL || !fitsImmediate(address -> displacement)) {
+        return false;
+    }
+    return address -> scale > 1 || (address -> base != NULL && address -> displacement != 0);
+}
+
+void selectAddress(Compiler* compiler, Address* address, uint64_t reg) {
+    char const *target = selectRegisters[reg][0];
+    char displacement[24] = "";
+    if (address -> displacement != 0) {
+        snprintf(displacement, sizeof(displacement), "%ld", (int64_t) address -> displacement);
+    }
+
+    if (address -> base == NULL) {
+        selectValue(compiler, address -> index, reg);
+        emitf(compiler, "    lea %s(,%s,%lu), %s\n", displacement, target, address -> scale, target);
+        return;
+    }
+
+    // the side that needs more registers goes first
+    bool indexFirst = selectNeeds(address -> index) > selectNeeds(address -> base);
+    selectValue(compiler, indexFirst ? address -> index : address -> base, reg);
+    selectValue(compiler, indexFirst ? address -> base : address -> index, reg + 1);
+    char const *other = selectRegisters[reg + 1][0];
+    emitf(compiler, "    lea %s(%s,%s,%lu), %s\n", displacement, indexFirst ? other : target,
+          indexFirst ? target : other, address -> scale, target);
+}
+
+// left op right, right as an immediate, a memory operand or in the next register
+void selectBinary(Compiler* compiler, char const *instruction, Ast* left, Ast* right, uint64_t reg) {
+    selectValue(compiler, left, reg);
+    if (isOperand(right)) {
+        emitOperand(compiler, instruction, right, selectRegisters[reg][0]);
+        return;
+    }
+    selectValue(compiler, right, reg + 1);
+    emitf(compiler, "    %s %s, %s\n", instruction, selectRegisters[reg + 1][0], selectRegisters[reg][0]);
+}
+
+void selectMultiply(Compiler* compiler, Ast* left, Ast* right, uint64_t reg) {
+    char const *target = selectRegisters[reg][0];
+    uint64_t value = right -> value;
+    if (right -> kind == AST_CONST && value != 0 && (value & (value - 1)) == 0) {
+        selectValue(compiler, left, reg);
+        if (value > 1) {
+            emitf(compiler, "    shl $%d, %s\n", __builtin_ctzll(value), target);
+        }
+    }
+    else if (right -> kind == AST_CONST && value == UINT64_MAX) {
+        selectValue(compiler, left, reg);
+        emitf(compiler, "    neg %s\n", target);
+    }
+    else if (right -> kind == AST_CONST && (value == 3 || value == 5 || value == 9)) {
+        selectValue(compiler, left, reg);
+        emitf(compiler, "    lea (%s,%s,%lu), %s\n", target, target, value - 1, target);
+    }
+    else if (right -> kind == AST_CONST && fitsImmediate(value) && left -> kind == AST_VAR) {
+        emitf(compiler, "    imul $%ld, %ld(%%rbp), %s\n", (int64_t) value, variableOffset(compiler, left), target);
+    }
+    else {
+        selectBinary(compiler, "imul", left, right, reg);
+    }
+}
+
+// unsigned / and %, the quotient is in %rax and the remainder in %rdx
+void selectDivide(Compiler* compiler, Ast* ast, uint64_t reg) {
+    char const *target = selectRegisters[reg][0];
+    Ast* right = ast -> right;
+    uint64_t value = right -> value;
+    if (right -> kind == AST_CONST && value != 0 && (value & (value - 1)) == 0 && (ast -> kind == AST_DIV || fitsImmediate(value - 1))) {
+        selectValue(compiler, ast -> left, reg);
+        if (ast -> kind == AST_MOD) {
+            emitf(compiler, "    and $%lu, %s\n", value - 1, target);
+        }
+        else if (value > 1) {
+            emitf(compiler, "    shr $%d, %s\n", __builtin_ctzll(value), target);
+        }
+        return;
+    }
+
+    if (right -> kind == AST_VAR && isOperand(ast -> left)) {
+        emitOperand(compiler, "mov", ast -> left, "%rax");
+    }
+    else {
+        selectValue(compiler, ast -> left, reg);
+        if (right -> kind != AST_VAR) {
+            // the divisor may use %rax and %rdx itself
+            selectValue(compiler, right, reg + 1);
+        }
+        emitf(compiler, "    mov %s, %%rax\n", target);
+    }
+    emitLine(compiler, "    xor %edx, %edx");
+    if (right -> kind == AST_VAR) {
+        emitf(compiler, "    divq %ld(%%rbp)\n", variableOffset(compiler, right));
+    }
+    else {
+        emitf(compiler, "    div %s\n", selectRegisters[reg + 1][0]);
+    }
+    emitf(compiler, "    mov %s, %s\n", ast -> kind == AST_DIV ? "%rax" : "%rdx", target);
+}
+
+void selectShift(Compiler* compiler, Ast* ast, uint64_t reg) {
+    char const *instruction = ast -> kind == AST_SHL ? "shl" : "shr";
+    char const *target = selectRegisters[reg][0];
+    selectValue(compiler, ast -> left, reg);
+    if (ast -> right -> kind == AST_CONST) {
+        // the count is taken mod 64, like %cl
+        if ((ast -> right -> value & 63) != 0) {
+            emitf(compiler, "    %s $%lu, %s\n", instruction, ast -> right -> value & 63, target);
+        }
+        return;
+    }
+    if (ast -> right -> kind == AST_VAR) {
+        emitOperand(compiler, "mov", ast -> right, "%rcx");
+    }
+    else {
+        selectValue(compiler, ast -> right, reg + 1);
+        emitf(compiler, "    mov %s, %%rcx\n", selectRegisters[reg + 1][0]);
+    }
+    emitf(compiler, "    %s %%cl, %s\n", instruction, target);
+}
+
+// sets the low byte of the register to the condition and clears the rest
+void emitSet(Compiler* compiler, ConditionCode code, uint64_t reg) {
+    emitf(compiler, "    set%s %s\n", conditionNames[code], selectRegisters[reg][2]);
+    emitf(compiler, "    movzbl %s, %s\n", selectRegisters[reg][2], selectRegisters[reg][1]);
+}
+
+// && and ||, both sides are evaluated
+void selectLogical(Compiler* compiler, Ast* ast, uint64_t reg) {
+    ConditionCode left = selectCondition(compiler, ast -> left, reg);
+    emitf(compiler, "    set%s %s\n", conditionNames[left], selectRegisters[reg][2]);
+    ConditionCode right = selectCondition(compiler, ast -> right, reg + 1);
+    emitf(compiler, "    set%s %s\n", conditionNames[right], selectRegisters[reg + 1][2]);
+    emitf(compiler, "    %s %s, %s\n", ast -> kind == AST_AND ? "and" : "or", selectRegisters[reg + 1][2], selectRegisters[reg][2]);
+    emitf(compiler, "    movzbl %s, %s\n", selectRegisters[reg][2], selectRegisters[reg][1]);
+}
+
+// computes the tree into selectRegisters[reg], using only the ones after it
+void selectValue(Compiler* compiler, Ast* ast, uint64_t reg) {
+    char const *target = selectRegisters[reg][0];
+
+    if (ast -> kind == AST_CONST) {
+        if (ast -> value == 0) {
+            emitf(compiler, "    xor %s, %s\n", selectRegisters[reg][1], selectRegisters[reg][1]);
+        }
+        else if (ast -> value <= UINT32_MAX) {
+            // writing the low half clears the high half
+            emitf(compiler, "    mov $%lu, %s\n", ast -> value, selectRegisters[reg][1]);
+        }
+        else {
+            emitf(compiler, "    mov $%lu, %s\n", ast -> value, target);
+        }
+        return;
+    }
+    if (ast -> kind == AST_VAR || ast -> kind == AST_REGISTER) {
+        emitOperand(compiler, "mov", ast, target);
+        return;
+    }
+    if (ast -> kind == AST_NOT || ast -> kind == AST_BOOL || isComparison(ast)) {
+        emitSet(compiler, selectCondition(compiler, ast, reg), reg);
+        return;
+    }
+    if (ast -> kind == AST_AND || ast -> kind == AST_OR) {
+        selectLogical(compiler, ast, reg);
+        return;
+    }
+
+    Ast* left = ast -> left;
+    Ast* right = ast -> right;
+    if (isCommutative(ast) && ((isOperand(left) && !isOperand(right)) || (left -> kind == AST_CONST && right -> kind != AST_CONST))) {
+        // the operand that can be an immediate or in memory goes on the right
+        left = ast -> right;
+        right = ast -> left;
+    }
+
+    Address address;
+    switch (ast -> kind) {
+        case AST_ADD:
+        case AST_SUB:
+            if (matchAddress(ast, &address)) {
+                selectAddress(compiler, &address, reg);
+            }
+            else if (right -> kind == AST_CONST && (right -> value == 1 || right -> value == UINT64_MAX)) {
+                selectValue(compiler, left, reg);
+                bool up = (right -> value == 1) == (ast -> kind == AST_ADD);
+                emitf(compiler, "    %s %s\n", up ? "inc" : "dec", target);
+            }
+            else {
+                selectBinary(compiler, ast -> kind == AST_ADD ? "add" : "sub", left, right, reg);
+            }
+            return;
+        case AST_MUL:
+            selectMultiply(compiler, left, right, reg);
+            return;
+        case AST_DIV:
+        case AST_MOD:
+            selectDivide(compiler, ast, reg);
+            return;
+        case AST_SHL:
+        case AST_SHR:
+            selectShift(compiler, ast, reg);
+            return;
+        case AST_BIT_AND:
+            selectBinary(compiler, "and", left, right, reg);
+            return;
+        case AST_BIT_XOR:
+            selectBinary(compiler, "xor", left, right, reg);
+            return;
+        case AST_BIT_OR:
+            selectBinary(compiler, "or", left, right, reg);
+            return;
+        default:
+            // selectExpression only lets trees of the kinds above through
+            fail(compiler);
+    }
+}
+
+// left <op> right into the flags, the code is true when the comparison is
+ConditionCode selectCompare(Compiler* compiler, Ast* ast, uint64_t reg) {
+    // for LT LE GT GE EQ NE, and with the sides swapped
+    static ConditionCode const codes[] = { CC_B, CC_BE, CC_A, CC_AE, CC_E, CC_NE };
+    static ConditionCode const swapped[] = { CC_A, CC_AE, CC_B, CC_BE, CC_E, CC_NE };
+
+    Ast* left = ast -> left;
+    Ast* right = ast -> right;
+    ConditionCode code = codes[ast -> kind - AST_LT];
+    if ((isOperand(left) && !isOperand(right)) || (left -> kind == AST_CONST && right -> kind == AST_VAR)) {
+        left = ast -> right;
+        right = ast -> left;
+        code = swapped[ast -> kind - AST_LT];
+    }
+
+    if (left -> kind == AST_VAR && right -> kind == AST_CONST && fitsImmediate(right -> value)) {
+        emitf(compiler, "    cmpq $%ld, %ld(%%rbp)\n", (int64_t) right -> value, variableOffset(compiler, left));
+        return code;
+    }
+    selectValue(compiler, left, reg);
+    char const *target = selectRegisters[reg][0];
+    if (astIsConst(right, 0)) {
+        // clears the carry like cmp $0 does
+        emitf(compiler, "    test %s, %s\n", target, target);
+    }
+    else if (isOperand(right)) {
+        emitOperand(compiler, "cmp", right, target);
+    }
+    else {
+        selectValue(compiler, right, reg + 1);
+        emitf(compiler, "    cmp %s, %s\n", selectRegisters[reg + 1][0], target);
+    }
+    return code;
+}
+
+// sets the flags for the tree as a condition, returns the code that is true when the tree is
+// not 0 (what a jump or a set after it needs)
+ConditionCode selectCondition(Compiler* compiler, Ast* ast, uint64_t reg) {
+    if (isComparison(ast)) {
+        return selectCompare(compiler, ast, reg);
+    }
+    if (ast -> kind == AST_NOT) {
+        return (ConditionCode) (selectCondition(compiler, ast -> left, reg) ^ 1);
+    }
+    if (ast -> kind == AST_BOOL) {
+        return selectCondition(compiler, ast -> left, reg);
+    }
+    if (ast -> kind == AST_VAR) {
+        emitf(compiler, "    cmpq $0, %ld(%%rbp)\n", variableOffset(compiler, ast));
+        return CC_NE;
+    }
+    selectValue(compiler, ast, reg);
+    emitf(compiler, "    test %s, %s\n", selectRegisters[reg][0], selectRegisters[reg][0]);
+    return CC_NE;
+}
+
+// variable = tree, the variable at offset; updates of the variable (x = x + y) work on it in
+// memory
+void selectAssignment(Compiler* compiler, Ast* ast, int64_t offset) {
+    static AstKind const kinds[] = { AST_ADD, AST_SUB, AST_BIT_AND, AST_BIT_XOR, AST_BIT_OR };
+    static char const *const instructions[] = { "add", "sub", "and", "xor", "or" };
+
+    if (ast -> kind == AST_VAR && variableOffset(compiler, ast) == offset) {
+        return;
+    }
+
+    uint64_t i = 0;
+    while (i < 5 && ast -> kind != kinds[i]) {
+        i++;
+    }
+    if (i < 5) {
+        Ast* left = ast -> left;
+        Ast* right = ast -> right;
+        if (isCommutative(ast) && right -> kind == AST_VAR && variableOffset(compiler, right) == offset) {
+            left = ast -> right;
+            right = ast -> left;
+        }
+        if (left -> kind == AST_VAR && variableOffset(compiler, left) == offset) {
+            if (right -> kind == AST_CONST && (right -> value == 1 || right -> value == UINT64_MAX) && i < 2) {
+                bool up = (right -> value == 1) == (ast -> kind == AST_ADD);
+                emitf(compiler, "    %s %ld(%%rbp)\n", up ? "incq" : "decq", offset);
+            }
+            else if (right -> kind == AST_CONST && fitsImmediate(right -> value)) {
+                emitf(compiler, "    %sq $%ld, %ld(%%rbp)\n", instructions[i], (int64_t) right -> value, offset);
+            }
+            else {
+                selectValue(compiler, right, 0);
+                emitf(compiler, "    %s %%rdi, %ld(%%rbp)\n", instructions[i], offset);
+            }
+            return;
+        }
+    }
+
+    selectValue(compiler, ast, 0);
+    emitf(compiler, "    mov %%rdi, %ld(%%rbp)\n", offset);
+}
@@ -0,0 +1,322 @@
+#pragma once
+
+// libc includes (available in both C and C++)
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Implementation includes
+#include "compiler.h"
+
+// Compile server (--serve) and its client (--client)
+//
+//     p3 [options] --serve /path/sock [-j threads]
+//     p3 --client /path/sock < prog.fun > prog.s
+//
+// The server listens on a Unix domain socket and compiles the programs sent
+// to it with the options it was started with. The listening socket and the
+// connections are in one epoll set shared by the worker threads; a socket
+// is armed for one event at a time, so a connection with a request waiting
+// goes to one idle worker, which answers that request and re-arms it. Idle
+// clients don't hold on to a worker. A request's length has to arrive within
+// SERVE_TIMEOUT seconds of the worker taking it, its source within that time
+// of the length and the response has to be read within that time; a client
+// that is slower than that, however little it sends at a time, is dropped.
+// Sources over SERVE_MAX_SOURCE bytes are refused. Every worker keeps a Session
+// between requests: the compiler with its tables, the source buffer and the
+// output stream are reset instead of being allocated again.
+//
+// A connection carries any number of requests, one after the other:
+//
+//     request:  u64 length, the source
+//     response: u8 status (SERVE_OK or SERVE_FAILED), u64 length, the
+//               assembly or the message p3 prints when it fails
+//
+// Lengths are in the byte order of the machine, both ends are on it.
+
+#define SERVE_OK 0
+#define SERVE_FAILED 1
+#define SERVE_BACKLOG 128
+#define SERVE_TIMEOUT 5
+#define SERVE_MAX_SOURCE ((uint64_t) 1 << 30)
+
+typedef struct Session {
+    int listener;
+    int poller;                         // epoll set of the listener and the connections
+    Options options;
+    Stats stats;
+    Compiler* compiler;
+    UnorderedMap* topLevelTable;
+
+    // source of the request being compiled
+    char* source;
+    uint64_t sourceCapacity;
+
+    // the output stream is rewound for every request, its buffer is kept
+    FILE* out;
+    char* output;
+    size_t outputLength;
+} Session;
+
+// reads or writes exactly length bytes, false if the connection ends first or deadline (a
+// statsNow() time, 0 for none) passes before all of them are through
+bool transferBefore(int fd, void* data, uint64_t length, bool writing, uint64_t deadline) {
+    char* p = (char*) data;
+    while (length > 0) {
+        if (deadline != 0) {
+            // waits for the socket at most until the deadline, then doesn't block on it
+            uint64_t now = statsNow();
+            if (now >= deadline) {
+                return false;
+            }
+            struct pollfd waiting = { fd, writing ? POLLOUT : POLLIN, 0 };
+            int ready = poll(&waiting, 1, (int) ((deadline - now + 999999) / 1000000));
+            if (ready < 0 && errno == EINTR) {
+                continue;
+            }
+            if (ready <= 0) {
+                return false;
+            }
+        }
+        int flags = deadline != 0 ? MSG_DONTWAIT : 0;
+        ssize_t n = writing ? send(fd, p, length, flags) : recv(fd, p, length, flags);
+        if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        length -= (uint64_t) n;
+    }
+    return true;
+}
+
+bool transfer(int fd, void* data, uint64_t length, bool writing) {
+    return transferBefore(fd, data, length, writing, 0);
+}
+
+// the time SERVE_TIMEOUT seconds from now
+uint64_t serveDeadline(void) {
+    return statsNow() + (uint64_t) SERVE_TIMEOUT * 1000000000;
+}
+
+bool sendResponse(int fd, uint8_t status, char const *data, uint64_t length) {
+    uint64_t deadline = serveDeadline();
+    return transferBefore(fd, &status, 1, true, deadline) &&
+           transferBefore(fd, &length, sizeof(length), true, deadline) &&
+           transferBefore(fd, (void*) data, length, true, deadline);
+}
+
+// compiles the source in the session and sends the result
+bool compileRequest(Session* session, int fd, uint64_t length) {
+    session -> stats = (Stats) { 0 };
+    fseek(session -> out, 0, SEEK_SET);
+
+    char* prog = stripComments(session -> source, length, &(session -> stats));
+    Compiler* compiler = session -> compiler;
+    compilerReset(compiler, prog, session -> out, &(session -> stats));
+    jmp_buf failJump;
+    compiler -> failJump = &failJump;
+
+    bool sent;
+    if (setjmp(failJump) == 0) {
+        run(compiler);
+        fflush(session -> out);
+        sent = sendResponse(fd, SERVE_OK, session -> output, (uint64_t) ftell(session -> out));
+    }
+    else {
+        compilerAbandon(compiler, session -> out, session -> topLevelTable);
+
+        // the same message p3 prints
+        char* message = NULL;
+        size_t messageLength = 0;
+        FILE* text = open_memstream(&message, &messageLength);
+        fprintf(text, "failed at line %lu (offset %ld)\n", lineOf(compiler, compiler -> current),
+                (size_t)(compiler -> current - compiler -> program));
+        fprintf(text, "%s\n", compiler -> current);
+        fclose(text);
+        sent = sendResponse(fd, SERVE_FAILED, message, messageLength);
+        free(message);
+    }
+    free(prog);
+    return sent;
+}
+
+// (re)arms fd for its next event
+void serveWatch(Session* session, int fd, int operation) {
+    struct epoll_event event = { 0 };
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.fd = fd;
+    epoll_ctl(session -> poller, operation, fd, &event);
+}
+
+// answers a request that can't be compiled, the connection is closed after it
+bool refuseRequest(int fd, char const *why, uint64_t length) {
+    char message[128];
+    int messageLength = snprintf(message, sizeof(message), "%s: request of %lu bytes\n", why, length);
+    sendResponse(fd, SERVE_FAILED, message, (uint64_t) messageLength);
+    return false;
+}
+
+// answers the request waiting on a connection, false when the connection is done
+bool serveRequest(Session* session, int fd) {
+    uint64_t length;
+    if (!transferBefore(fd, &length, sizeof(length), false, serveDeadline())) {
+        return false;
+    }
+    if (length > SERVE_MAX_SOURCE) {
+        return refuseRequest(fd, "source too long", length);
+    }
+    if (length + 1 > session -> sourceCapacity) {
+        uint64_t capacity = (length + 1) * 2;
+        char* source = (char*) (realloc(session -> source, capacity));
+        if (source == NULL) {
+            return refuseRequest(fd, "out of memory", length);
+        }
+        session -> source = source;
+        session -> sourceCapacity = capacity;
+    }
+    return transferBefore(fd, session -> source, length, false, serveDeadline()) && compileRequest(session, fd, length);
+}
+
+void* serveWorker(void* arg) {
+    Session* session = (Session*) arg;
+    session -> out = open_memstream(&(session -> output), &(session -> outputLength));
+    session -> compiler = compilerConstructor(NULL, session -> out, &(session -> stats));
+    session -> compiler -> options = session -> options;
+    session -> topLevelTable = session -> compiler -> symbolTable;
+
+    while (true) {
+        struct epoll_event event;
+        int n = epoll_wait(session -> poller, &event, 1, -1);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            return NULL;
+        }
+        if (n <= 0) {
+            continue;
+        }
+
+        int fd = event.data.fd;
+        if (fd == session -> listener) {
+            int connection = accept(fd, NULL, NULL);
+            serveWatch(session, fd, EPOLL_CTL_MOD);
+            if (connection >= 0) {
+                serveWatch(session, connection, EPOLL_CTL_ADD);
+            }
+        }
+        else if (serveRequest(session, fd)) {
+            serveWatch(session, fd, EPOLL_CTL_MOD);
+        }
+        else {
+            close(fd);
+        }
+    }
+}
+
+// opens a Unix domain socket at path, -1 (after printing why) if it can't
+int unixSocket(char const *path, bool listening) {
+    struct sockaddr_un address = { 0 };
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (listening) {
+        // a socket left behind by a server that is gone
+        unlink(path);
+        if (bind(fd, (struct sockaddr*) &address, sizeof(address)) < 0 || listen(fd, SERVE_BACKLOG) < 0) {
+            perror(path);
+            close(fd);
+            return -1;
+        }
+    }
+    else if (connect(fd, (struct sockaddr*) &address, sizeof(address)) < 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// runs the server until it is killed, returns the exit status if it can't start
+int serve(char const *path, Options options, uint64_t threads) {
+    // a client going away mid-response must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    int listener = unixSocket(path, true);
+    if (listener < 0) {
+        return 1;
+    }
+
+    Session* sessions = (Session*) (calloc(threads, sizeof(Session)));
+    pthread_t* workers = (pthread_t*) (malloc(sizeof(pthread_t) * threads));
+    int poller = epoll_create1(0);
+    for (uint64_t i = 0; i < threads; i++) {
+        sessions[i].listener = listener;
+        sessions[i].poller = poller;
+        sessions[i].options = options;
+        pthread_create(&workers[i], NULL, serveWorker, &sessions[i]);
+    }
+    serveWatch(&sessions[0], listener, EPOLL_CTL_ADD);
+    fprintf(stderr, "serving on %s with %lu threads\n", path, threads);
+    for (uint64_t i = 0; i < threads; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    close(listener);
+    unlink(path);
+    return 1;
+}
+
+// sends stdin to the server, writes the assembly to stdout (or the failure message, exiting with 1 like p3)
+int client(char const *path) {
+    char* source = NULL;
+    size_t length = 0;
+    FILE* text = open_memstream(&source, &length);
+    int c;
+    while ((c = getchar()) != EOF) {
+        fputc(c, text);
+    }
+    fclose(text);
+
+    int fd = unixSocket(path, false);
+    if (fd < 0) {
+        return 2;
+    }
+    uint64_t requestLength = length;
+    uint8_t status;
+    uint64_t responseLength;
+    if (!transfer(fd, &requestLength, sizeof(requestLength), true) || !transfer(fd, source, length, true) ||
+            !transfer(fd, &status, 1, false) || !transfer(fd, &responseLength, sizeof(responseLength), false)) {
+        fprintf(stderr, "%s: no response\n", path);
+        return 2;
+    }
+    char* response = (char*) (malloc(responseLength + 1));
+    if (!transfer(fd, response, responseLength, false)) {
+        fprintf(stderr, "%s: response cut short\n", path);
+        return 2;
+    }
+    fwrite(response, 1, responseLength, stdout);
+    close(fd);
+    free(response);
+    free(source);
+    return status == SERVE_OK ? 0 : 1;
+}
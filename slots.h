@@ -0,0 +1,133 @@
+#pragma once
+
+// libc includes (available in both C and C++)
+#include <stdlib.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Implementation includes
+#include "constant folding.h"
+#include "reach.h"
+
+// Stack slot sharing
+//
+// The first pass over a function gives every local a slot of its own. Then
+// shareSlots works out where each local is live: from its first to its last
+// use in the body, widened to the whole of a while or pfor loop it is used in
+// (the next trip can read what this one wrote). Taken in the order they start,
+// locals get the first slot whose last local is dead by then, so locals whose
+// ranges don't overlap share a slot and the frame shrinks, which adds up in
+// deep recursion. --stats reports the bytes of all frames with and without
+// sharing, -fno-share-slots turns it off.
+
+typedef struct LiveRange {
+    Slice name;
+    uint64_t first;                     // offsets in the body, first > last when it isn't used
+    uint64_t last;
+} LiveRange;
+
+// gives the locals in the symbol table (at -8 down to offset + 8) the slots they share,
+// returns the new offset below them
+int64_t shareSlots(Compiler* compiler, char const *body, char const *end, int64_t offset) {
+    uint64_t count = (uint64_t)(-8 - offset) / 8;
+    compiler -> stats -> frameBytesUnshared += count * 8;
+    if (count < 2 || compiler -> options.noShareSlots) {
+        compiler -> stats -> frameBytes += count * 8;
+        return offset;
+    }
+
+    LiveRange* ranges = (LiveRange*) (malloc(sizeof(LiveRange) * count));
+    uint64_t* order = (uint64_t*) (malloc(sizeof(uint64_t) * count));
+    uint64_t* slotEnds = (uint64_t*) (malloc(sizeof(uint64_t) * count));
+    uint64_t length = (uint64_t)(end - body);
+    uint64_t* loops = (uint64_t*) (malloc(sizeof(uint64_t) * (length / 2 + 1)));
+    statsAlloc(compiler -> stats, (sizeof(LiveRange) + 2 * sizeof(uint64_t)) * count + sizeof(uint64_t) * (length / 2 + 1));
+    for (uint64_t i = 0; i < count; i++) {
+        ranges[i] = (LiveRange) { sliceConstructorLen(0, 0), UINT64_MAX, 0 };
+    }
+
+    // the uses of the locals and where the loops start and end
+    uint64_t countLoops = 0;
+    for (char const *text = body; text < end; text++) {
+        if (!isalpha(*text) || isalnum(text[-1])) {
+            continue;
+        }
+        char const *nameEnd = text;
+        while (isalnum(*nameEnd)) {
+            nameEnd++;
+        }
+        Slice name = sliceConstructorEnd(text, nameEnd);
+        if (sliceEqualString(name, "while") || sliceEqualString(name, "pfor")) {
+            char const *open = strchr(nameEnd, '{');
+            if (open != NULL) {
+                loops[countLoops++] = (uint64_t)(text - body);
+                loops[countLoops++] = (uint64_t)(matchingBrace(open) - body);
+            }
+        }
+        else if (calledName(text).len == 0 && mapContains(compiler -> symbolTable, name)) {
+            int64_t slot = mapGet(compiler -> symbolTable, name);
+            if (slot < 0) {
+                LiveRange* range = &(ranges[(-8 - slot) / 8]);
+                uint64_t position = (uint64_t)(text - body);
+                range -> name = name;
+                range -> first = position < range -> first ? position : range -> first;
+                range -> last = position > range -> last ? position : range -> last;
+            }
+        }
+        text = nameEnd - 1;
+    }
+
+    // a local used in a loop is live in all of it, loops in loops can widen it again
+    bool widened = true;
+    while (widened) {
+        widened = false;
+        for (uint64_t i = 0; i < count; i++) {
+            LiveRange* range = &(ranges[i]);
+            for (uint64_t j = 0; j < countLoops; j += 2) {
+                uint64_t start = loops[j];
+                uint64_t stop = loops[j + 1];
+                if (range -> first <= stop && range -> last >= start && (range -> first > start || range -> last < stop)) {
+                    range -> first = range -> first < start ? range -> first : start;
+                    range -> last = range -> last > stop ? range -> last : stop;
+                    widened = true;
+                }
+            }
+        }
+    }
+
+    // by start, insertion sort keeps the order of the first pass between equal starts
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t j = i;
+        while (j > 0 && ranges[order[j - 1]].first > ranges[i].first) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+
+    uint64_t slots = 0;
+    for (uint64_t i = 0; i < count; i++) {
+        LiveRange* range = &(ranges[order[i]]);
+        if (range -> first > range -> last) {
+            // never read or written
+            break;
+        }
+        uint64_t slot = 0;
+        while (slot < slots && slotEnds[slot] >= range -> first) {
+            slot++;
+        }
+        if (slot == slots) {
+            slots++;
+        }
+        slotEnds[slot] = range -> last;
+        mapInsert(compiler -> symbolTable, range -> name, -8 - 8 * (int64_t) slot);
+    }
+
+    free(ranges);
+    free(order);
+    free(slotEnds);
+    free(loops);
+    compiler -> stats -> frameBytes += slots * 8;
+    return -8 - 8 * (int64_t) slots;
+}
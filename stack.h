@@ -0,0 +1,173 @@
+#pragma once
+
+// libc includes (available in both C and C++)
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Implementation includes
+#include "constant folding.h"
+
+// Program stack (-fstack-size=<bytes>)
+//
+// Deep recursion that isn't a tail call runs out of the 8MB the process gets
+// by default. With -fstack-size main mmaps a stack of the requested size
+// (MAP_NORESERVE, so only the pages used take memory) and runs ._.main on
+// it. The lowest STACK_GUARD bytes are made inaccessible; running into them
+// raises SIGSEGV, which is handled on a separate signal stack (the program's
+// own has no room left) and reported as
+//
+//     stack overflow at depth <n>
+//
+// on stderr, exiting with 1 after what was printed so far is flushed. The
+// depth is the number of frames on the %rbp chain when it happened, found
+// from the stack if it happened in libc code that doesn't keep one. Any other
+// SIGSEGV restores the default action and crashes as usual. If the stack
+// can't be mapped the program runs on the process stack.
+
+#define STACK_GUARD (1ul << 16)
+#define STACK_SIGNAL_SIZE (1ul << 16)
+
+// rounds up to whole pages and adds the guard
+uint64_t stackMappingSize(uint64_t stackSize) {
+    return ((stackSize + 4095) & ~4095ul) + STACK_GUARD;
+}
+
+// in main, before calling ._.main: maps the stack and switches to it
+void emitStackSwitch(Compiler* compiler) {
+    if (compiler -> options.stackSize == 0) {
+        return;
+    }
+    emitLine(compiler, "    mov %rsp, ._.savedStack(%rip)");
+    emitLine(compiler, "    mov %rbp, ._.savedFrame(%rip)");
+    emitLine(compiler, "    sub $8, %rsp");
+
+    // mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0)
+    emitLine(compiler, "    xor %edi, %edi");
+    emitf(compiler, "    mov $%lu, %%rsi\n", stackMappingSize(compiler -> options.stackSize));
+    emitLine(compiler, "    mov $3, %edx");
+    emitLine(compiler, "    mov $0x4022, %ecx");
+    emitLine(compiler, "    mov $-1, %r8");
+    emitLine(compiler, "    xor %r9d, %r9d");
+    emitLine(compiler, "    call mmap");
+    emitLine(compiler, "    cmp $-1, %rax");
+    emitLine(compiler, "    je ._.stackReady");
+    emitLine(compiler, "    mov %rax, ._.stackBase(%rip)");
+    emitf(compiler, "    lea %lu(%%rax), %%rcx\n", stackMappingSize(compiler -> options.stackSize));
+    emitLine(compiler, "    mov %rcx, ._.stackTop(%rip)");
+
+    // mprotect(base, STACK_GUARD, PROT_NONE)
+    emitLine(compiler, "    mov %rax, %rdi");
+    emitf(compiler, "    mov $%lu, %%esi\n", STACK_GUARD);
+    emitLine(compiler, "    xor %edx, %edx");
+    emitLine(compiler, "    call mprotect");
+
+    // the handler runs on ._.signalStack
+    emitLine(compiler, "    lea ._.signalStackInfo(%rip), %rdi");
+    emitLine(compiler, "    xor %esi, %esi");
+    emitLine(compiler, "    call sigaltstack");
+    emitLine(compiler, "    mov $11, %edi");
+    emitLine(compiler, "    lea ._.stackOverflowAction(%rip), %rsi");
+    emitLine(compiler, "    xor %edx, %edx");
+    emitLine(compiler, "    call sigaction");
+
+    emitLine(compiler, "    mov ._.stackTop(%rip), %rsp");
+    emitLine(compiler, "._.stackReady:");
+}
+
+// in main, after ._.main returns
+void emitStackRestore(Compiler* compiler) {
+    if (compiler -> options.stackSize == 0) {
+        return;
+    }
+    emitLine(compiler, "    mov ._.savedStack(%rip), %rsp");
+}
+
+// the SIGSEGV handler and the data it uses
+void emitStackOverflowHandler(Compiler* compiler) {
+    if (compiler -> options.stackSize == 0) {
+        return;
+    }
+
+    emitLine(compiler, "    .bss");
+    emitLine(compiler, "    .align 16");
+    emitLine(compiler, "._.signalStack:");
+    emitf(compiler, "    .zero %lu\n", STACK_SIGNAL_SIZE);
+    emitLine(compiler, "._.stackBase: .zero 8");
+    emitLine(compiler, "._.stackTop: .zero 8");
+    emitLine(compiler, "._.savedStack: .zero 8");
+    emitLine(compiler, "._.savedFrame: .zero 8");
+
+    emitLine(compiler, "    .data");
+    emitLine(compiler, "    .align 8");
+    // stack_t: ss_sp, ss_flags, ss_size
+    emitf(compiler, "._.signalStackInfo: .quad ._.signalStack, 0, %lu\n", STACK_SIGNAL_SIZE);
+    // struct sigaction: sa_sigaction, sa_mask, sa_flags (SA_SIGINFO | SA_ONSTACK), sa_restorer
+    emitLine(compiler, "._.stackOverflowAction: .quad ._.stackOverflow");
+    emitLine(compiler, "    .zero 128");
+    emitLine(compiler, "    .long 0x08000004, 0");
+    emitLine(compiler, "    .quad 0");
+    emitLine(compiler, "._.stackOverflowFormat: .string \"stack overflow at depth %lu\\n\"");
+
+    // (signal, siginfo_t*, ucontext_t*)
+    emitLine(compiler, "    .text");
+    emitLine(compiler, "._.stackOverflow:");
+    emitLine(compiler, "    mov 16(%rsi), %rax");                  // si_addr
+    emitLine(compiler, "    mov ._.stackBase(%rip), %rcx");
+    emitLine(compiler, "    sub %rcx, %rax");
+    emitf(compiler, "    cmp $%lu, %%rax\n", STACK_GUARD);
+    emitLine(compiler, "    jae ._.stackFault");
+    emitLine(compiler, "    push %rbx");
+
+    // count the frames of the %rbp chain, which ends at the frame ._.main was called from.
+    // It starts at the %rbp of the interrupted code (uc_mcontext.gregs[REG_RBP]), unless that
+    // code (in libc, say) uses %rbp for something else: then at the first word up from its
+    // %rsp (gregs[REG_RSP]) that is a link of the chain, the %rbp it saved.
+    emitLine(compiler, "    mov 160(%rdx), %r9");
+    emitLine(compiler, "    mov 120(%rdx), %rdx");
+    emitLine(compiler, "    mov ._.stackTop(%rip), %r8");
+    emitLine(compiler, "    mov ._.savedFrame(%rip), %r10");
+    emitLine(compiler, "._.stackOverflowChain:");
+    emitLine(compiler, "    xor %ebx, %ebx");
+    emitLine(compiler, "    cmp %rcx, %rdx");
+    emitLine(compiler, "    jb ._.stackOverflowNext");
+    emitLine(compiler, "    cmp %r8, %rdx");
+    emitLine(compiler, "    jae ._.stackOverflowNext");
+    emitLine(compiler, "._.stackOverflowFrame:");
+    emitLine(compiler, "    inc %rbx");
+    emitLine(compiler, "    mov (%rdx), %rax");
+    emitLine(compiler, "    cmp %r10, %rax");
+    emitLine(compiler, "    je ._.stackOverflowReport");
+    // links go up the stack and stay on it
+    emitLine(compiler, "    cmp %rdx, %rax");
+    emitLine(compiler, "    jbe ._.stackOverflowNext");
+    emitLine(compiler, "    cmp %r8, %rax");
+    emitLine(compiler, "    jae ._.stackOverflowNext");
+    emitLine(compiler, "    mov %rax, %rdx");
+    emitLine(compiler, "    jmp ._.stackOverflowFrame");
+    emitLine(compiler, "._.stackOverflowNext:");
+    emitLine(compiler, "    xor %ebx, %ebx");
+    emitLine(compiler, "    cmp %r8, %r9");
+    emitLine(compiler, "    jae ._.stackOverflowReport");
+    emitLine(compiler, "    mov (%r9), %rdx");
+    emitLine(compiler, "    add $8, %r9");
+    emitLine(compiler, "    jmp ._.stackOverflowChain");
+    emitLine(compiler, "._.stackOverflowReport:");
+    emitLine(compiler, "    mov stderr(%rip), %rdi");
+    emitLine(compiler, "    lea ._.stackOverflowFormat(%rip), %rsi");
+    emitLine(compiler, "    mov %rbx, %rdx");
+    emitLine(compiler, "    xor %eax, %eax");
+    emitLine(compiler, "    call fprintf");
+    emitLine(compiler, "    mov $1, %edi");
+    emitLine(compiler, "    call exit");
+
+    // not an overflow, the faulting instruction runs again and gets the default action
+    emitLine(compiler, "._.stackFault:");
+    emitLine(compiler, "    sub $8, %rsp");
+    emitLine(compiler, "    mov $11, %edi");
+    emitLine(compiler, "    xor %esi, %esi");
+    emitLine(compiler, "    call signal");
+    emitLine(compiler, "    add $8, %rsp");
+    emitLine(compiler, "    ret");
+}
@@ -0,0 +1,192 @@
+#pragma once
+
+// libc includes (available in both C and C++)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+// Compiler phases tracked by --time-report. Phases nest (a map lookup happens
+// inside codegen, for example); the time of a nested phase is not counted
+// towards its parent, so the per-phase times add up to the total.
+typedef enum Phase {
+    PHASE_READ,
+    PHASE_STRIP_COMMENTS,
+    PHASE_CALL_GRAPH,
+    PHASE_LOCAL_SCAN,
+    PHASE_CHECK_EXPRESSION,
+    PHASE_MAP,
+    PHASE_CODEGEN,
+    PHASE_OUTPUT,
+    PHASE_COUNT
+} Phase;
+
+static char const *const phaseNames[PHASE_COUNT] = {
+    "read",
+    "strip-comments",
+    "call-graph",
+    "local-scan",
+    "check-expression",
+    "map",
+    "codegen",
+    "output",
+};
+
+#define MAX_PHASE_DEPTH 16
+
+typedef struct PhaseStats {
+    uint64_t nanos;
+    uint64_t bytes;             // input/output bytes processed by the phase
+    uint64_t allocations;
+    uint64_t allocatedBytes;
+    uint64_t peakRss;           // peak resident set size (KB) seen at the end of the phase
+} PhaseStats;
+
+typedef struct Stats {
+    bool enabled;               // timing is only done when a report was requested
+    PhaseStats phases[PHASE_COUNT];
+
+    // stack of the phases currently running, the top one is being charged
+    Phase stack[MAX_PHASE_DEPTH];
+    size_t depth;
+    uint64_t started;
+
+    // counters
+    uint64_t tokens;
+    uint64_t mapProbes;
+    uint64_t foldedExpressions;
+    uint64_t instructions;
+
+    // optimizations, reported by --stats
+    uint64_t loopsEliminated;           // while loops replaced by their closed form (see scev.h)
+    uint64_t loopsUnrolled;             // counted while loops given several copies of the body (see unroll.h)
+    uint64_t functionsMemoized;         // functions given a result cache (see memo.h)
+    uint64_t foldedCalls;               // expressions with calls evaluated at compile time (see interpreter.h)
+    uint64_t functionsRemoved;          // functions main can't reach (see reach.h)
+    uint64_t bytesRemoved;              // of assembly they would have added
+    uint64_t frameBytes;                // locals in the frames of all functions (see slots.h)
+    uint64_t frameBytesUnshared;        // the same with a slot for every local
+} Stats;
+
+uint64_t statsNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+uint64_t statsPeakRss() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (uint64_t)usage.ru_maxrss;
+}
+
+void phaseBegin(Stats* stats, Phase phase) {
+    if (stats == NULL || !stats -> enabled || stats -> depth == MAX_PHASE_DEPTH) {
+        return;
+    }
+    uint64_t now = statsNow();
+    if (stats -> depth > 0) {
+        // pause the parent phase
+        stats -> phases[stats -> stack[stats -> depth - 1]].nanos += now - stats -> started;
+    }
+    stats -> stack[stats -> depth++] = phase;
+    stats -> started = now;
+}
+
+void phaseEnd(Stats* stats) {
+    if (stats == NULL || !stats -> enabled || stats -> depth == 0) {
+        return;
+    }
+    uint64_t now = statsNow();
+    Phase phase = stats -> stack[--(stats -> depth)];
+    stats -> phases[phase].nanos += now - stats -> started;
+    stats -> started = now;
+
+    // map operations are too frequent to sample rusage for each of them
+    if (phase != PHASE_MAP) {
+        uint64_t rss = statsPeakRss();
+        if (rss > stats -> phases[phase].peakRss) {
+            stats -> phases[phase].peakRss = rss;
+        }
+    }
+}
+
+// the phase currently being charged (codegen if nothing is running)
+Phase currentPhase(Stats* stats) {
+    if (stats -> depth == 0) {
+        return PHASE_CODEGEN;
+    }
+    return stats -> stack[stats -> depth - 1];
+}
+
+void statsBytes(Stats* stats, uint64_t bytes) {
+    if (stats == NULL) {
+        return;
+    }
+    stats -> phases[currentPhase(stats)].bytes += bytes;
+}
+
+void statsAlloc(Stats* stats, uint64_t bytes) {
+    if (stats == NULL) {
+        return;
+    }
+    PhaseStats* phase = &(stats -> phases[currentPhase(stats)]);
+    phase -> allocations++;
+    phase -> allocatedBytes += bytes;
+}
+
+void printTimeReport(Stats* stats, FILE* file) {
+    PhaseStats total = { 0, 0, 0, 0, 0 };
+
+    fprintf(file, "%-18s %12s %12s %10s %14s %14s\n", "phase", "time(ms)", "bytes", "allocs", "alloc-bytes", "peak-rss(KB)");
+    for (size_t i = 0; i < PHASE_COUNT; i++) {
+        PhaseStats* phase = &(stats -> phases[i]);
+        fprintf(file, "%-18s %12.3f %12lu %10lu %14lu %14lu\n", phaseNames[i], phase -> nanos / 1e6,
+                phase -> bytes, phase -> allocations, phase -> allocatedBytes, phase -> peakRss);
+        total.nanos += phase -> nanos;
+        total.allocations += phase -> allocations;
+        total.allocatedBytes += phase -> allocatedBytes;
+        if (phase -> peakRss > total.peakRss) {
+            total.peakRss = phase -> peakRss;
+        }
+    }
+    fprintf(file, "%-18s %12.3f %12s %10lu %14lu %14lu\n", "total", total.nanos / 1e6, "",
+            total.allocations, total.allocatedBytes, total.peakRss);
+
+    fprintf(file, "tokens: %lu\n", stats -> tokens);
+    fprintf(file, "map probes: %lu\n", stats -> mapProbes);
+    fprintf(file, "folded expressions: %lu\n", stats -> foldedExpressions);
+    fprintf(file, "instructions emitted: %lu\n", stats -> instructions);
+}
+
+void printTimeReportJson(Stats* stats, FILE* file) {
+    fprintf(file, "{\n  \"phases\": {\n");
+    for (size_t i = 0; i < PHASE_COUNT; i++) {
+        PhaseStats* phase = &(stats -> phases[i]);
+        fprintf(file, "    \"%s\": { \"nanos\": %lu, \"bytes\": %lu, \"allocations\": %lu, \"allocatedBytes\": %lu, \"peakRssKb\": %lu }%s\n",
+                phaseNames[i], phase -> nanos, phase -> bytes, phase -> allocations, phase -> allocatedBytes,
+                phase -> peakRss, (i + 1 < PHASE_COUNT) ? "," : "");
+    }
+    fprintf(file, "  },\n  \"counters\": {\n");
+    fprintf(file, "    \"tokens\": %lu,\n", stats -> tokens);
+    fprintf(file, "    \"mapProbes\": %lu,\n", stats -> mapProbes);
+    fprintf(file, "    \"foldedExpressions\": %lu,\n", stats -> foldedExpressions);
+    fprintf(file, "    \"instructions\": %lu\n", stats -> instructions);
+    fprintf(file, "  }\n}\n");
+}
+
+void printStats(Stats* stats, FILE* file) {
+    fprintf(file, "loops eliminated: %lu\n", stats -> loopsEliminated);
+    fprintf(file, "loops unrolled: %lu\n", stats -> loopsUnrolled);
+    fprintf(file, "functions memoized: %lu\n", stats -> functionsMemoized);
+    fprintf(file, "calls folded: %lu\n", stats -> foldedCalls);
+    fprintf(file, "functions removed: %lu (%lu bytes)\n", stats -> functionsRemoved, stats -> bytesRemoved);
+    fprintf(file, "frame bytes: %lu (%lu without shared slots)\n", stats -> frameBytes, stats -> frameBytesUnshared);
+}
@@ -0,0 +1,182 @@
+#pragma once
+
+// libc includes (available in both C and C++)
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+// Implementation includes
+#include "constant folding.h"
+
+// Streaming compilation (--stream)
+//
+// Normally the whole program is read, stripped of its comments and compiled
+// from memory. With --stream the input is read a line at a time into a chunk
+// that ends with the first line where all braces are closed again, usually
+// one top level fun. The chunk is compiled, its code written out, and the
+// next chunk is read over it, so memory grows with the largest function
+// rather than with the program:
+//
+//  - the name of a function is copied, the rest of its text is only kept if
+//    later calls can use it (it is pure, for compile time evaluation, or just
+//    returns an expression, for inlining) and there is room for it in
+//    STREAM_RETAINED_BYTES
+//  - a function that isn't kept is forgotten, calls to it compile like calls
+//    to a function declared further down
+//
+// Every function is emitted, reach.h needs the whole program. -fprofile-use
+// lays out the functions once they have all been compiled, so it can't be
+// combined with --stream.
+
+// text of the functions kept for the chunks after theirs
+#define STREAM_RETAINED_BYTES (1 << 20)
+
+typedef struct Source {
+    FILE* in;
+    char* text;                         // the chunk, without comments and NUL terminated
+    uint64_t length;
+    uint64_t capacity;
+    uint64_t line;                      // line of text[0] in the input
+    uint64_t lines;                     // lines in the chunk
+    uint64_t offset;                    // bytes without comments before the chunk
+    char* buffer;                       // the line being read
+    size_t bufferCapacity;
+} Source;
+
+Source sourceCreate(FILE* in, Stats* stats) {
+    Source source = { in, NULL, 0, 4096, 1, 0, 0, NULL, 0 };
+    source.text = (char*) (malloc(source.capacity));
+    statsAlloc(stats, source.capacity);
+    return source;
+}
+
+void sourceFree(Source* source) {
+    free(source -> text);
+    free(source -> buffer);
+}
+
+// reads the next chunk over the last one, false at the end of the input
+bool readChunk(Source* source, Stats* stats) {
+    phaseBegin(stats, PHASE_READ);
+    source -> line += source -> lines;
+    source -> offset += source -> length;
+    source -> lines = 0;
+    source -> length = 0;
+
+    int64_t depth = 0;
+    bool braces = false;
+    ssize_t read;
+    while ((read = getline(&(source -> buffer), &(source -> bufferCapacity), source -> in)) > 0) {
+        statsBytes(stats, (uint64_t) read);
+        source -> lines++;
+
+        // a comment goes up to the end of the line
+        char* line = source -> buffer;
+        uint64_t length = (uint64_t) read;
+        char* comment = (char*) (memchr(line, '#', length));
+        if (comment != NULL) {
+            bool newline = line[length - 1] == '\n';
+            length = (uint64_t)(comment - line);
+            if (newline) {
+                line[length++] = '\n';
+            }
+        }
+
+        if (source -> length + length + 1 > source -> capacity) {
+            while (source -> length + length + 1 > source -> capacity) {
+                source -> capacity *= 2;
+            }
+            source -> text = (char*) (realloc(source -> text, source -> capacity));
+            statsAlloc(stats, source -> capacity);
+        }
+        memcpy(source -> text + source -> length, line, length);
+        source -> length += length;
+
+        for (uint64_t i = 0; i < length; i++) {
+            if (line[i] == '{') {
+                depth++;
+                braces = true;
+            }
+            else if (line[i] == '}') {
+                depth--;
+            }
+        }
+        if (braces && depth == 0) {
+            break;
+        }
+    }
+    source -> text[source -> length] = 0;
+    phaseEnd(stats);
+    return source -> length > 0;
+}
+
+// the name of a function being declared, with --stream a copy that outlives the chunk
+Slice declaredName(Compiler* compiler, Slice name) {
+    if (!compiler -> options.stream) {
+        return name;
+    }
+    char* copy = (char*) (malloc(name.len));
+    statsAlloc(compiler -> stats, name.len);
+    memcpy(copy, name.start, name.len);
+    return sliceConstructorLen(copy, name.len);
+}
+
+void beginChunk(Compiler* compiler, Source* source) {
+    compiler -> program = source -> text;
+    compiler -> current = source -> text;
+    compiler -> programLine = source -> line;
+    compiler -> programOffset = source -> offset;
+    compiler -> lineCursor = source -> text;
+    compiler -> lineNumber = source -> line;
+
+    // they point into the last chunk
+    compiler -> foldExhaustedStart = NULL;
+    compiler -> foldExhaustedEnd = NULL;
+    forgetScans(compiler);
+}
+
+// where text that was at position in the chunk is in kept, NULL if it wasn't kept
+char* retainedText(Source* source, char* kept, char* position) {
+    if (kept == NULL || position == NULL) {
+        return NULL;
+    }
+    return kept + (position - source -> text);
+}
+
+// keeps or forgets the functions declared in the chunk, from first on
+void endChunk(Compiler* compiler, Source* source, uint64_t first) {
+    bool useful = false;
+    for (uint64_t i = first; i < compiler -> countFunctions; i++) {
+        FunctionInfo* function = &(compiler -> functions[i]);
+        useful = useful || function -> pure || function -> returnExpression != NULL;
+    }
+
+    char* kept = NULL;
+    if (useful && compiler -> retainedBytes + source -> length <= STREAM_RETAINED_BYTES) {
+        kept = (char*) (malloc(source -> length + 1));
+        statsAlloc(compiler -> stats, source -> length + 1);
+        memcpy(kept, source -> text, source -> length + 1);
+        compiler -> retainedBytes += source -> length;
+    }
+
+    // trees refer to functions by index, only the last one can go
+    if (kept == NULL && compiler -> countFunctions == first + 1) {
+        FunctionInfo* function = &(compiler -> functions[first]);
+        mapRemove(compiler -> functionTable, function -> name);
+        if (!compiler -> options.profile) {
+            // the counters name their function
+            free((char*) function -> name.start);
+        }
+        compiler -> countFunctions--;
+        return;
+    }
+
+    for (uint64_t i = first; i < compiler -> countFunctions; i++) {
+        FunctionInfo* function = &(compiler -> functions[i]);
+        function -> params = retainedText(source, kept, function -> params);
+        function -> returnExpression = retainedText(source, kept, function -> returnExpression);
+        function -> bodyText = retainedText(source, kept, function -> bodyText);
+    }
+}
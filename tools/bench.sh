@@ -0,0 +1,183 @@
+#!/bin/bash
+#
+# Runs the benchmark programs in bench/ and compares them against a baseline.
+#
+#   tools/bench.sh [-n runs] [-t threshold%] [-u] [-p]
+#
+# Every bench/<name>.fun is compiled with ./p3, checked against
+# bench/<name>.ok (or bench/<name>.cksum for large outputs) and then run
+# <runs> times. A program can give more flags for ./p3 in a comment line
+#
+#     # flags: -fmemoize
+#
+# The median and minimum wall time are reported, together with the
+# instructions retired when `perf stat` is available. "compile-stress" times
+# ./p3 itself on a large generated program.
+#
+# A benchmark whose median is more than <threshold> percent slower than the
+# one recorded in bench/baseline.txt is reported as a regression and makes
+# the script exit with 1. -u records the current medians as the new baseline,
+# with the machine they were measured on: times from another machine (another
+# cpu model or number of cpus) aren't compared, -u has to be run there first.
+#
+# With -p every program is also built with profile guided optimization: it
+# is compiled with -fprofile, run once to collect a profile, and compiled
+# again with -fprofile-use. These are reported as <name>/pgo together with
+# their speedup over the statically compiled program.
+
+RUNS=5
+THRESHOLD=10
+UPDATE=0
+PGO=0
+
+while getopts "n:t:up" opt; do
+    case $opt in
+        n) RUNS=$OPTARG ;;
+        t) THRESHOLD=$OPTARG ;;
+        u) UPDATE=1 ;;
+        p) PGO=1 ;;
+        *) echo "usage: $0 [-n runs] [-t threshold%] [-u] [-p]" >&2; exit 2 ;;
+    esac
+done
+
+BENCH_DIR=bench
+OUT_DIR=${BENCH_DIR}/out
+BASELINE=${BENCH_DIR}/baseline.txt
+RESULTS=${OUT_DIR}/results.txt
+
+mkdir -p ${OUT_DIR}
+: > ${RESULTS}
+
+# the cpu model and count, the times in the baseline are only comparable on the same
+MACHINE=$(awk -F': ' '/^model name/ { gsub(/ /, "_", $2); print $2; exit }' /proc/cpuinfo 2> /dev/null)x$(nproc)
+BASELINE_MACHINE=$(awk '$1 == "machine" { print $2 }' ${BASELINE} 2> /dev/null)
+COMPARE=0
+if [ ${UPDATE} -eq 0 ] && [ -f ${BASELINE} ]; then
+    if [ "${BASELINE_MACHINE}" == "${MACHINE}" ]; then
+        COMPARE=1
+    else
+        echo "${BASELINE} was measured on ${BASELINE_MACHINE:-another machine}, not on ${MACHINE}: not compared"
+        echo "(make bench_baseline records one for this machine)"
+    fi
+fi
+
+HAVE_PERF=0
+if which perf > /dev/null 2>&1 && perf stat -x, -e instructions:u true > /dev/null 2>&1; then
+    HAVE_PERF=1
+fi
+
+now_ns() {
+    date +%s%N
+}
+
+# instructions retired by "$@" (stdin/stdout as given by the caller), or "-"
+instructions() {
+    if [ ${HAVE_PERF} -eq 0 ]; then
+        echo "-"
+        return
+    fi
+    perf stat -x, -e instructions:u -o ${OUT_DIR}/perf.txt "$@" > /dev/null
+    awk -F, '/instructions/ { print $1 }' ${OUT_DIR}/perf.txt
+}
+
+# times "$@" RUNS times with the given stdin, prints "median_ms min_ms"
+measure() {
+    local input=$1
+    shift
+    for ((i = 0; i < RUNS; i++)); do
+        local start=$(now_ns)
+        "$@" < ${input} > /dev/null
+        local end=$(now_ns)
+        echo $(( (end - start) / 1000 ))
+    done | sort -n | awk '
+        { t[NR] = $1 }
+        END {
+            if (NR % 2) median = t[(NR + 1) / 2]; else median = (t[NR / 2] + t[NR / 2 + 1]) / 2
+            printf "%.3f %.3f\n", median / 1000, t[1] / 1000
+        }'
+}
+
+report() {
+    local name=$1 median=$2 min=$3 instr=$4
+    local status="-"
+    if [ -n "${SPEEDUP_OF}" ]; then
+        status=$(awk -v m=${median} -v s=${SPEEDUP_OF} 'BEGIN { printf "x%.2f vs static", s / m }')
+    fi
+    local base=$(awk -v n=${name} '$1 == n { print $2 }' ${BASELINE} 2> /dev/null)
+    if [ ${COMPARE} -eq 1 ] && [ -n "${base}" ]; then
+        status=$(awk -v m=${median} -v b=${base} -v t=${THRESHOLD} 'BEGIN {
+            change = (m - b) * 100 / b
+            if (change > t) printf "REGRESSION(%+.1f%%)", change
+            else printf "ok(%+.1f%%)", change
+        }')
+    fi
+    printf "%-16s %12s %12s %16s  %s\n" ${name} ${median} ${min} ${instr} "${status}"
+    echo "${name} ${median}" >> ${RESULTS}
+}
+
+# a large program for measuring the compiler itself
+generate_stress() {
+    for ((f = 0; f < 2000; f++)); do
+        echo "fun f${f}(a, b, c) {"
+        for ((l = 0; l < 10; l++)); do
+            echo "    x${l} = a * ${l} + (b - c) / (${l} + 1) % 97 + (a < b) * (c != ${f})"
+        done
+        echo "    while (a > b) {"
+        echo "        a = a - 1"
+        echo "    }"
+        echo "    return x0 + x9 + 1 + 2 + 3 + 4 + 5 + 6 + 7 + 8 + 9 + 10"
+        echo "}"
+    done
+    echo "fun main() {"
+    echo "    print(f0(1, 2, 3))"
+    echo "}"
+}
+
+make -s p3 || exit 1
+
+printf "%-16s %12s %12s %16s  %s\n" "benchmark" "median(ms)" "min(ms)" "instructions" "vs baseline"
+
+for fun in ${BENCH_DIR}/*.fun; do
+    name=$(basename ${fun} .fun)
+    flags=$(sed -n 's/^# flags: *//p' ${fun} | head -1)
+    ./p3 ${flags} < ${fun} > ${OUT_DIR}/${name}.s || { echo "${name}: compile failed"; exit 1; }
+    gcc -o ${OUT_DIR}/${name}.run -static ${OUT_DIR}/${name}.s 2> /dev/null || { echo "${name}: link failed"; exit 1; }
+
+    ${OUT_DIR}/${name}.run > ${OUT_DIR}/${name}.out
+    if [ -f ${BENCH_DIR}/${name}.ok ]; then
+        diff -q ${OUT_DIR}/${name}.out ${BENCH_DIR}/${name}.ok > /dev/null || { echo "${name}: wrong output"; exit 1; }
+    elif [ -f ${BENCH_DIR}/${name}.cksum ]; then
+        [ "$(cksum < ${OUT_DIR}/${name}.out)" == "$(cat ${BENCH_DIR}/${name}.cksum)" ] || { echo "${name}: wrong output"; exit 1; }
+    fi
+
+    results=($(measure /dev/null ${OUT_DIR}/${name}.run))
+    SPEEDUP_OF= report ${name} ${results[@]} $(instructions ${OUT_DIR}/${name}.run)
+
+    if [ ${PGO} -eq 1 ]; then
+        ./p3 ${flags} -fprofile < ${fun} > ${OUT_DIR}/${name}.prof.s
+        gcc -o ${OUT_DIR}/${name}.prof.run -static ${OUT_DIR}/${name}.prof.s 2> /dev/null
+        FUN_PROFILE=${OUT_DIR}/${name}.prof ${OUT_DIR}/${name}.prof.run > /dev/null
+        ./p3 ${flags} -fprofile-use=${OUT_DIR}/${name}.prof < ${fun} > ${OUT_DIR}/${name}.pgo.s || { echo "${name}: pgo compile failed"; exit 1; }
+        gcc -o ${OUT_DIR}/${name}.pgo.run -static ${OUT_DIR}/${name}.pgo.s 2> /dev/null || { echo "${name}: pgo link failed"; exit 1; }
+        ${OUT_DIR}/${name}.pgo.run | cmp -s - ${OUT_DIR}/${name}.out || { echo "${name}: wrong pgo output"; exit 1; }
+
+        SPEEDUP_OF=${results[0]} report ${name}/pgo $(measure /dev/null ${OUT_DIR}/${name}.pgo.run) $(instructions ${OUT_DIR}/${name}.pgo.run)
+    fi
+done
+
+generate_stress > ${OUT_DIR}/compile-stress.fun
+SPEEDUP_OF= report compile-stress $(measure ${OUT_DIR}/compile-stress.fun ./p3) $(instructions ./p3 < ${OUT_DIR}/compile-stress.fun)
+
+if [ ${UPDATE} -eq 1 ]; then
+    { echo "machine ${MACHINE}"; cat ${RESULTS}; } > ${BASELINE}
+    echo "baseline updated (${BASELINE})"
+    exit 0
+fi
+
+if [ ${COMPARE} -eq 1 ] && grep -q REGRESSION <(awk -v t=${THRESHOLD} '
+        NR == FNR { base[$1] = $2; next }
+        ($1 in base) && ($2 - base[$1]) * 100 / base[$1] > t { print "REGRESSION" }
+    ' ${BASELINE} ${RESULTS} 2> /dev/null); then
+    echo "regressions beyond ${THRESHOLD}% found"
+    exit 1
+fi
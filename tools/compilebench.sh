@@ -0,0 +1,73 @@
+#!/bin/bash
+#
+# Measures how fast ./p3 compiles large generated programs.
+#
+#   tools/compilebench.sh [-n runs] ["name:fungen flags"...]
+#
+# Every shape is generated by fungen and compiled <runs> times (5 by default);
+# the fastest run is reported in MB of source and functions per second. The
+# default shapes stress one thing each: many small functions (wide), many
+# locals (locals, the symbol table growing), deeply nested blocks (deep), long
+# expressions (long), deeply nested parentheses (parens) and long expressions
+# of literals that are folded (constant). The smallest program of every
+# shape is also run, and has to print the same with and without --stream.
+
+RUNS=5
+
+while getopts "n:" opt; do
+    case $opt in
+        n) RUNS=$OPTARG ;;
+        *) echo "usage: $0 [-n runs] [\"name:fungen flags\"...]" >&2; exit 2 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+SHAPES=("$@")
+if [ ${#SHAPES[@]} -eq 0 ]; then
+    SHAPES=(
+        "mixed:-f 200"
+        "wide:-f 4000 -l 4 -d 1 -e 4 -n 4"
+        "locals:-f 100 -l 500 -d 1 -e 6 -n 200"
+        "deep:-f 100 -d 64 -e 4 -n 100"
+        "long:-f 50 -e 400 -p 8 -n 20"
+        "parens:-f 50 -e 200 -p 64 -n 20"
+        "constant:-f 200 -e 200 -c 100 -n 20"
+    )
+fi
+
+OUT_DIR=bench/out
+mkdir -p ${OUT_DIR}
+make -s p3 fungen || exit 1
+
+# the fewest nanoseconds of RUNS compiles of $1
+measure() {
+    for ((i = 0; i < RUNS; i++)); do
+        local start=$(date +%s%N)
+        ./p3 < $1 > ${OUT_DIR}/compile.s || { echo "$1: compile failed" >&2; exit 1; }
+        local end=$(date +%s%N)
+        echo $((end - start))
+    done | sort -n | head -1
+}
+
+printf "%-8s %10s %10s %10s %10s %14s\n" "shape" "functions" "KB" "ms" "MB/s" "functions/s"
+for shape in "${SHAPES[@]}"; do
+    name=${shape%%:*}
+    flags=${shape#*:}
+
+    # a small one of the same shape has to compile to a program that works
+    ./fungen ${flags} -f 20 > ${OUT_DIR}/${name}-small.fun
+    for mode in whole stream; do
+        ./p3 $([ ${mode} = stream ] && echo --stream) < ${OUT_DIR}/${name}-small.fun > ${OUT_DIR}/${name}-small.s || { echo "${name}: compile failed"; exit 1; }
+        gcc -o ${OUT_DIR}/${name}-small.run -static ${OUT_DIR}/${name}-small.s 2> /dev/null || { echo "${name}: link failed"; exit 1; }
+        timeout 10 ${OUT_DIR}/${name}-small.run > ${OUT_DIR}/${name}-small.${mode} || { echo "${name}: run failed"; exit 1; }
+    done
+    cmp -s ${OUT_DIR}/${name}-small.whole ${OUT_DIR}/${name}-small.stream || { echo "${name}: --stream prints something else"; exit 1; }
+
+    ./fungen ${flags} > ${OUT_DIR}/${name}.fun
+    functions=$(grep -c '^fun ' ${OUT_DIR}/${name}.fun)
+    bytes=$(stat -c %s ${OUT_DIR}/${name}.fun)
+    ns=$(measure ${OUT_DIR}/${name}.fun) || exit 1
+    awk -v name=${name} -v f=${functions} -v b=${bytes} -v ns=${ns} 'BEGIN {
+        printf "%-8s %10d %10d %10.1f %10.2f %14.0f\n", name, f, b / 1024, ns / 1e6, b / 1048576 / (ns / 1e9), f / (ns / 1e9)
+    }'
+done
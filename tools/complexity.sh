@@ -0,0 +1,157 @@
+#!/bin/bash
+#
+# Checks that compile time grows linearly with the size of the program.
+#
+#   tools/complexity.sh [-n runs] [-r max_ratio] [shape...]
+#
+# Every shape is a program that is easy to make a compiler quadratic with:
+# a long line of calls (calls), a call with many arguments that calls itself
+# in a tail call (arguments), calls nested in the arguments of calls (nested,
+# pure for a function that can be inlined and intrinsics for min), nested
+# parentheses (parens), a long line of literals that is folded (constant) and
+# many functions with loops that are unrolled (functions). Each one is
+# generated at its size and four times that, compiled <runs> times (3 by
+# default) by ./p3, and the fastest compile of the large one may take at most
+# <max_ratio> (8 by default) times as long as the small one: 4 is linear, 16
+# quadratic. Calls nested past EXPRESSION_MAX_NESTING (4096) have to fail with
+# a message, so the nested shapes are also compiled 40000 deep once, which may
+# not crash.
+
+RUNS=3
+MAX_RATIO=8
+
+while getopts "n:r:" opt; do
+    case $opt in
+        n) RUNS=$OPTARG ;;
+        r) MAX_RATIO=$OPTARG ;;
+        *) echo "usage: $0 [-n runs] [-r max_ratio] [shape...]" >&2; exit 2 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+# shape and size, the sizes compile in tens of milliseconds (the nested ones stay under
+# EXPRESSION_MAX_NESTING at four times their size)
+SIZES=(calls:8000 arguments:8000 nested:1000 pure:1000 intrinsics:1000 parens:8000 constant:32000 functions:2000)
+TOO_DEEP=40000
+SHAPES=("$@")
+if [ ${#SHAPES[@]} -eq 0 ]; then
+    SHAPES=(${SIZES[@]%%:*})
+fi
+
+DIR=$(mktemp -d)
+trap "rm -rf ${DIR}" EXIT
+
+make -s p3 || exit 1
+
+# the program of shape $1 and size $2
+generate() {
+    awk -v shape=$1 -v n=$2 'BEGIN {
+        if (shape == "calls") {
+            printf "fun h(x) {\n    print(x)\n    return x\n}\nfun main() {\n    x = h(0)"
+            for (i = 1; i < n; i++) {
+                printf " + h(%d)", i % 10
+            }
+            printf "\n    print(x)\n}\n"
+        }
+        else if (shape == "arguments") {
+            printf "fun k(p0"
+            for (i = 1; i < n; i++) {
+                printf ", p%d", i
+            }
+            printf ") {\n    if (p0 == 0) {\n        return p1\n    }\n    return k(p0 - 1"
+            for (i = 1; i < n; i++) {
+                printf ", p%d + 1", i
+            }
+            printf ")\n}\nfun main() {\n    print(k(0"
+            for (i = 1; i < n; i++) {
+                printf ", %d", i % 5
+            }
+            printf "))\n}\n"
+        }
+        else if (shape == "nested" || shape == "pure" || shape == "intrinsics") {
+            if (shape == "nested") {
+                printf "fun h(x) {\n    print(x)\n    return x + 1\n}\n"
+            }
+            else if (shape == "pure") {
+                printf "fun h(x) {\n    return x * 3 + 1\n}\n"
+            }
+            printf "fun main() {\n    a = 1\n    print("
+            for (i = 0; i < n; i++) {
+                printf (shape == "intrinsics" ? "min(%d, " : "h("), i
+            }
+            printf "a"
+            for (i = 0; i < n; i++) {
+                printf ")"
+            }
+            printf ")\n}\n"
+        }
+        else if (shape == "parens") {
+            printf "fun main() {\n    a = 1\n    print("
+            for (i = 0; i < n; i++) {
+                printf "("
+            }
+            printf "a"
+            for (i = 0; i < n; i++) {
+                printf " + 1)"
+            }
+            printf ")\n}\n"
+        }
+        else if (shape == "constant") {
+            printf "fun main() {\n    print(0"
+            for (i = 1; i < n; i++) {
+                printf " + %d", i % 7
+            }
+            printf ")\n}\n"
+        }
+        else if (shape == "functions") {
+            for (i = 0; i < n; i++) {
+                printf "fun f%d(a) {\n    i = 0\n    while (i < 3) {\n        a = a + i\n        i = i + 1\n    }\n    return a\n}\n", i
+            }
+            printf "fun main() {\n    print(f%d(1))\n}\n", n - 1
+        }
+    }'
+}
+
+# the fewest microseconds of RUNS compiles of $1
+measure() {
+    for ((i = 0; i < RUNS; i++)); do
+        local start=$(date +%s%N)
+        ./p3 < $1 > ${DIR}/compile.s || { echo "$1: compile failed" >&2; exit 1; }
+        local end=$(date +%s%N)
+        echo $(( (end - start) / 1000 ))
+    done | sort -n | head -1
+}
+
+status=0
+printf "%-10s %8s %10s %10s %8s\n" "shape" "size" "ms" "ms at 4x" "ratio"
+for shape in ${SHAPES[@]}; do
+    size=
+    for s in ${SIZES[@]}; do
+        [ ${s%%:*} = ${shape} ] && size=${s#*:}
+    done
+    if [ -z "${size}" ]; then
+        echo "${shape}: no such shape" >&2
+        exit 2
+    fi
+    generate ${shape} ${size} > ${DIR}/small.fun
+    generate ${shape} $((size * 4)) > ${DIR}/large.fun
+    small=$(measure ${DIR}/small.fun) || exit 1
+    large=$(measure ${DIR}/large.fun) || exit 1
+    awk -v shape=${shape} -v n=${size} -v s=${small} -v l=${large} -v max=${MAX_RATIO} 'BEGIN {
+        ratio = l / (s > 0 ? s : 1)
+        printf "%-10s %8d %10.1f %10.1f %8.1f%s\n", shape, n, s / 1000, l / 1000, ratio, (ratio > max ? "  not linear" : "")
+        exit (ratio > max)
+    }' || status=1
+    case ${shape} in
+        nested|pure|intrinsics)
+            generate ${shape} ${TOO_DEEP} > ${DIR}/deep.fun
+            ./p3 < ${DIR}/deep.fun > ${DIR}/compile.s 2>&1
+            code=$?
+            if [ ${code} -ne 1 ] || ! grep -q "^failed at line" ${DIR}/compile.s; then
+                echo "${shape}: ${TOO_DEEP} deep exited with ${code} instead of failing" >&2
+                status=1
+            fi
+            ;;
+    esac
+done
+exit ${status}
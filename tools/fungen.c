@@ -0,0 +1,254 @@
+// Generator of large fun programs for measuring the compiler.
+//
+//     fungen [-f functions] [-l locals] [-d depth] [-e operands] [-p parens] [-c percent] [-n lines] [-s seed]
+//
+// Prints a program of <functions> functions (1000 by default) to stdout. Every
+// function has three parameters and <locals> locals (8), and a body of about
+// <lines> statements (40) in blocks nested <depth> deep (3), alternating while
+// loops and if/else (the four outermost loops run three times, the others
+// once). Every expression has <operands> operands (8), with parentheses nested
+// up to <parens> deep (2), and <percent> percent of the assignments (none)
+// have only literals, like t0.fun's val(), so they are folded while compiling.
+// Each function calls the one before it once.
+// The same flags and <seed> always give the same program. The program is
+// valid, ends and prints a checksum, so it can be run as well as compiled.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PARAMETERS 3
+#define LOOP_ITERATIONS 3
+#define LOOPS_REPEATED 4                // loops nested deeper run once
+
+typedef struct Generator {
+    uint64_t functions;
+    uint64_t locals;
+    uint64_t depth;
+    uint64_t operands;
+    uint64_t parens;
+    uint64_t constants;                 // percent of the assignments
+    uint64_t lines;
+    uint64_t seed;
+
+    uint64_t function;                  // the one being generated
+    uint64_t loops;                     // counters of the loops we are in
+    bool constant;                      // the expression being generated has only literals
+} Generator;
+
+char const *const parameterNames[PARAMETERS] = { "a", "b", "c" };
+char const *const operators[] = { "+", "-", "*", "&", "|", "^", "<<", ">>", "<", "==", "!=", ">=" };
+
+// xorshift, the same sequence everywhere
+uint64_t randomBelow(Generator* generator, uint64_t n) {
+    generator -> seed ^= generator -> seed << 13;
+    generator -> seed ^= generator -> seed >> 7;
+    generator -> seed ^= generator -> seed << 17;
+    return generator -> seed % n;
+}
+
+void indent(uint64_t depth) {
+    for (uint64_t i = 0; i <= depth; i++) {
+        fputs("    ", stdout);
+    }
+}
+
+// a parameter, a local, a loop counter or a literal
+void operand(Generator* generator) {
+    if (generator -> constant) {
+        printf("%lu", randomBelow(generator, 1000));
+        return;
+    }
+    uint64_t pick = randomBelow(generator, PARAMETERS + generator -> locals + generator -> loops + 2);
+    if (pick < PARAMETERS) {
+        fputs(parameterNames[pick], stdout);
+    }
+    else if (pick < PARAMETERS + generator -> locals) {
+        printf("x%lu", pick - PARAMETERS);
+    }
+    else if (pick < PARAMETERS + generator -> locals + generator -> loops) {
+        printf("w%lu", pick - PARAMETERS - generator -> locals);
+    }
+    else {
+        printf("%lu", randomBelow(generator, 1000));
+    }
+}
+
+// operands operands joined by operators, some of them in parentheses
+void expression(Generator* generator, uint64_t operands, uint64_t parens) {
+    uint64_t done = 0;
+    while (done < operands) {
+        if (done > 0) {
+            if (randomBelow(generator, 8) == 0) {
+                // a division by an odd number, never zero
+                printf(" / (");
+                operand(generator);
+                printf(" | 1) + ");
+            }
+            else {
+                printf(" %s ", operators[randomBelow(generator, sizeof(operators) / sizeof(operators[0]))]);
+            }
+        }
+        uint64_t left = operands - done;
+        if (parens > 0 && left > 1 && randomBelow(generator, 3) == 0) {
+            uint64_t inner = 2 + randomBelow(generator, left - 1);
+            putchar('(');
+            expression(generator, inner, parens - 1);
+            putchar(')');
+            done += inner;
+        }
+        else {
+            operand(generator);
+            done++;
+        }
+    }
+}
+
+void assignment(Generator* generator, uint64_t depth) {
+    indent(depth);
+    printf("x%lu = ", randomBelow(generator, generator -> locals));
+    generator -> constant = generator -> constants > 0 && randomBelow(generator, 100) < generator -> constants;
+    expression(generator, generator -> operands, generator -> parens);
+    generator -> constant = false;
+    putchar('\n');
+}
+
+// lines statements at depth, around a block one deeper while depth allows
+void block(Generator* generator, uint64_t depth, uint64_t lines) {
+    uint64_t here = lines / (generator -> depth - depth + 1);
+    if (here == 0) {
+        here = 1;
+    }
+    for (uint64_t i = 0; i < here / 2; i++) {
+        assignment(generator, depth);
+    }
+    if (depth < generator -> depth) {
+        uint64_t inner = lines > here ? lines - here : 1;
+        if (depth % 2 == 0) {
+            uint64_t counter = generator -> loops;
+            indent(depth);
+            printf("w%lu = 0\n", counter);
+            indent(depth);
+            printf("while (w%lu < %d) {\n", counter, counter < LOOPS_REPEATED ? LOOP_ITERATIONS : 1);
+            generator -> loops++;
+            block(generator, depth + 1, inner);
+            indent(depth + 1);
+            printf("w%lu = w%lu + 1\n", counter, counter);
+            generator -> loops--;
+            indent(depth);
+            printf("}\n");
+        }
+        else {
+            indent(depth);
+            printf("if (");
+            expression(generator, generator -> operands, generator -> parens);
+            printf(") {\n");
+            block(generator, depth + 1, inner - inner / 2);
+            indent(depth);
+            printf("}\n");
+            indent(depth);
+            printf("else {\n");
+            // only one of the arms nests, so the program grows with depth instead of 2^depth
+            for (uint64_t i = 0; i < (inner / 2 > 0 ? inner / 2 : 1); i++) {
+                assignment(generator, depth + 1);
+            }
+            indent(depth);
+            printf("}\n");
+        }
+    }
+    for (uint64_t i = here / 2; i < here; i++) {
+        assignment(generator, depth);
+    }
+}
+
+void function(Generator* generator) {
+    uint64_t f = generator -> function;
+    printf("fun f%lu(a, b, c) {\n", f);
+    for (uint64_t i = 0; i < generator -> locals; i++) {
+        indent(0);
+        printf("x%lu = %s + %lu\n", i, parameterNames[i % PARAMETERS], i);
+    }
+    if (f > 0) {
+        // the call is an operand among the others
+        indent(0);
+        printf("x0 = f%lu(", f - 1);
+        expression(generator, generator -> operands, generator -> parens);
+        printf(", b, c) + ");
+        expression(generator, generator -> operands, generator -> parens);
+        putchar('\n');
+    }
+    block(generator, 0, generator -> lines);
+
+    // a print that never happens keeps the function from being evaluated at compile time
+    indent(0);
+    printf("if (x0 == 1234567) {\n");
+    indent(1);
+    printf("print(x0)\n");
+    indent(0);
+    printf("}\n");
+    indent(0);
+    printf("return x0");
+    for (uint64_t i = 1; i < generator -> locals; i++) {
+        printf(" + x%lu", i);
+    }
+    printf("\n}\n\n");
+}
+
+int main(int argc, char* argv[]) {
+    Generator generator = { .functions = 1000, .locals = 8, .depth = 3, .operands = 8, .parens = 2, .lines = 40, .seed = 1 };
+    for (int i = 1; i < argc; i++) {
+        uint64_t* value = NULL;
+        if (i + 1 < argc && strlen(argv[i]) == 2 && argv[i][0] == '-') {
+            switch (argv[i][1]) {
+                case 'f': value = &generator.functions; break;
+                case 'l': value = &generator.locals; break;
+                case 'd': value = &generator.depth; break;
+                case 'e': value = &generator.operands; break;
+                case 'p': value = &generator.parens; break;
+                case 'c': value = &generator.constants; break;
+                case 'n': value = &generator.lines; break;
+                case 's': value = &generator.seed; break;
+            }
+        }
+        if (value == NULL) {
+            fprintf(stderr, "usage: %s [-f functions] [-l locals] [-d depth] [-e operands] [-p parens] [-c percent] [-n lines] [-s seed]\n", argv[0]);
+            return 2;
+        }
+        *value = strtoull(argv[++i], NULL, 10);
+    }
+    if (generator.functions == 0 || generator.locals == 0 || generator.operands == 0) {
+        fprintf(stderr, "%s: -f, -l and -e need at least 1\n", argv[0]);
+        return 2;
+    }
+    if (generator.seed == 0) {
+        generator.seed = 1;
+    }
+
+    printf("# generated by fungen -f %lu -l %lu -d %lu -e %lu -p %lu -c %lu -n %lu\n\n", generator.functions,
+           generator.locals, generator.depth, generator.operands, generator.parens, generator.constants, generator.lines);
+    for (generator.function = 0; generator.function < generator.functions; generator.function++) {
+        function(&generator);
+    }
+
+    // main calls every function with arguments the compiler can't see, the last one runs them all
+    uint64_t step = generator.functions > 64 ? generator.functions / 64 : 1;
+    printf("fun main() {\n");
+    indent(0);
+    printf("v = array(1)\n");
+    indent(0);
+    printf("v[0] = 3\n");
+    indent(0);
+    printf("s = 0\n");
+    for (uint64_t f = 0; f < generator.functions; f += step) {
+        indent(0);
+        printf("s = s + f%lu(v[0], %lu, v[0] + %lu)\n", f, f, f);
+    }
+    indent(0);
+    printf("s = s + f%lu(v[0], 1, 2)\n", generator.functions - 1);
+    indent(0);
+    printf("print(s)\n");
+    printf("}\n");
+    return 0;
+}
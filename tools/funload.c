@@ -0,0 +1,173 @@
+// Load generator for the compile server (p3 --serve).
+//
+//     funload [-c clients] [-n requests] [--spawn] socket prog.fun...
+//
+// <clients> threads each open a connection and send <requests> compile
+// requests, cycling through the given programs, and the latency of every
+// request is recorded. With --spawn every request starts ./p3 instead, which
+// is what the build farm does without a server.
+//
+// Prints the throughput and the p50, p99 and worst latencies.
+
+#include <spawn.h>
+#include <sys/wait.h>
+
+#include "../server.h"
+
+extern char** environ;
+
+typedef struct Program {
+    char const *path;
+    char* source;
+    size_t length;
+} Program;
+
+typedef struct Client {
+    char const *socket;
+    Program* programs;
+    size_t countPrograms;
+    uint64_t requests;
+    bool spawn;
+    uint64_t offset;            // first program this client sends
+    uint64_t* latencies;        // nanoseconds, one per request
+    uint64_t failures;
+} Client;
+
+// compiles with a new p3 process, true if it succeeded
+bool spawnCompile(Program* program) {
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, 0, program -> path, O_RDONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, 1, "/dev/null", O_WRONLY, 0);
+    char* argv[] = { "./p3", NULL };
+    pid_t pid;
+    int rc = posix_spawn(&pid, argv[0], &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    int status;
+    return rc == 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+void* runClient(void* arg) {
+    Client* client = (Client*) arg;
+    int fd = client -> spawn ? -1 : unixSocket(client -> socket, false);
+    if (!client -> spawn && fd < 0) {
+        client -> failures = client -> requests;
+        return NULL;
+    }
+
+    char* response = NULL;
+    uint64_t responseCapacity = 0;
+    for (uint64_t i = 0; i < client -> requests; i++) {
+        Program* program = &(client -> programs[(client -> offset + i) % client -> countPrograms]);
+        uint64_t start = statsNow();
+
+        if (client -> spawn) {
+            client -> failures += !spawnCompile(program);
+        }
+        else {
+            uint64_t length = program -> length;
+            uint8_t status;
+            if (!transfer(fd, &length, sizeof(length), true) || !transfer(fd, program -> source, length, true) ||
+                    !transfer(fd, &status, 1, false) || !transfer(fd, &length, sizeof(length), false)) {
+                client -> failures += client -> requests - i;
+                break;
+            }
+            if (length > responseCapacity) {
+                responseCapacity = length * 2;
+                response = (char*) (realloc(response, responseCapacity));
+            }
+            if (!transfer(fd, response, length, false)) {
+                client -> failures += client -> requests - i;
+                break;
+            }
+            client -> failures += status != SERVE_OK;
+        }
+        client -> latencies[i] = statsNow() - start;
+    }
+    free(response);
+    if (fd >= 0) {
+        close(fd);
+    }
+    return NULL;
+}
+
+int compareLatencies(void const *a, void const *b) {
+    uint64_t x = *(uint64_t const *) a;
+    uint64_t y = *(uint64_t const *) b;
+    return (x > y) - (x < y);
+}
+
+void usageLoad(char const *name) {
+    fprintf(stderr, "usage: %s [-c clients] [-n requests] [--spawn] socket prog.fun...\n", name);
+    exit(2);
+}
+
+int main(int argc, char* argv[]) {
+    uint64_t countClients = 8;
+    uint64_t requests = 200;
+    bool spawn = false;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            countClients = (uint64_t) atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            requests = (uint64_t) atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--spawn") == 0) {
+            spawn = true;
+        }
+        else {
+            usageLoad(argv[0]);
+        }
+    }
+    if (argc - i < 2 || countClients == 0 || requests == 0) {
+        usageLoad(argv[0]);
+    }
+    char const *socket = argv[i++];
+
+    size_t countPrograms = (size_t)(argc - i);
+    Program* programs = (Program*) (calloc(countPrograms, sizeof(Program)));
+    for (size_t p = 0; p < countPrograms; p++) {
+        programs[p].path = argv[i + p];
+        FILE* file = fopen(programs[p].path, "r");
+        if (file == NULL) {
+            fprintf(stderr, "can't read %s\n", programs[p].path);
+            return 2;
+        }
+        FILE* text = open_memstream(&(programs[p].source), &(programs[p].length));
+        int c;
+        while ((c = fgetc(file)) != EOF) {
+            fputc(c, text);
+        }
+        fclose(text);
+        fclose(file);
+    }
+
+    Client* clients = (Client*) (calloc(countClients, sizeof(Client)));
+    pthread_t* threads = (pthread_t*) (malloc(sizeof(pthread_t) * countClients));
+    uint64_t* latencies = (uint64_t*) (malloc(sizeof(uint64_t) * countClients * requests));
+    uint64_t start = statsNow();
+    for (uint64_t c = 0; c < countClients; c++) {
+        clients[c] = (Client) { socket, programs, countPrograms, requests, spawn, c, latencies + c * requests, 0 };
+        pthread_create(&threads[c], NULL, runClient, &clients[c]);
+    }
+    uint64_t failures = 0;
+    for (uint64_t c = 0; c < countClients; c++) {
+        pthread_join(threads[c], NULL);
+        failures += clients[c].failures;
+    }
+    double seconds = (statsNow() - start) / 1e9;
+
+    uint64_t total = countClients * requests;
+    qsort(latencies, total, sizeof(uint64_t), compareLatencies);
+    printf("%s: %lu clients x %lu requests in %.3fs, %.0f compiles/s\n", spawn ? "spawn" : "serve",
+           countClients, requests, seconds, total / seconds);
+    printf("latency p50 %.3fms  p99 %.3fms  max %.3fms\n", latencies[total / 2] / 1e6,
+           latencies[total * 99 / 100] / 1e6, latencies[total - 1] / 1e6);
+    if (failures > 0) {
+        printf("%lu requests failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
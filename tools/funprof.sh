@@ -0,0 +1,88 @@
+#!/bin/bash
+#
+# Maps a profile written by a program compiled with -fprofile back to its source.
+#
+#   tools/funprof.sh prog.fun [fun.prof]
+#
+# Prints the source with the call count (and cycles, with -fprofile=cycles)
+# next to every function declaration, the iteration count next to every
+# while loop and how often each arm was taken next to every if, followed
+# by the functions and loops ordered by how hot they are and the cache hit
+# rate of memoized functions (-fmemoize).
+
+if [ $# -lt 1 ] || [ $# -gt 2 ]; then
+    echo "usage: $0 prog.fun [fun.prof]" >&2
+    exit 2
+fi
+
+SOURCE=$1
+PROFILE=${2:-fun.prof}
+
+awk '
+    NR == FNR {
+        if ($1 == "function") {
+            calls[$3] += $4
+            cycles[$3] += $5
+            name[$3] = $2
+            if ($5 > maxCycles) maxCycles = $5
+            functions[$2] = $3
+        }
+        else if ($1 == "loop") {
+            iterations[$3] += $4
+            loopFunction[$3] = $2
+            loops[$3] = 1
+        }
+        else if ($1 == "memo") {
+            hits[$2] += $4
+            misses[$2] += $5
+        }
+        else if ($1 == "if") {
+            thenCounts[$3] += $4
+            elseCounts[$3] += $5
+        }
+        next
+    }
+    {
+        count = ""
+        extra = ""
+        if (FNR in calls) {
+            count = calls[FNR] " calls"
+            if (cycles[FNR] > 0) extra = cycles[FNR] " cycles"
+        }
+        else if (FNR in iterations) {
+            count = iterations[FNR] " iter"
+        }
+        else if (FNR in thenCounts) {
+            count = thenCounts[FNR] " then"
+            extra = elseCounts[FNR] " else"
+        }
+        printf "%18s %18s %5d| %s\n", count, extra, FNR, $0
+    }
+    END {
+        print ""
+        print "functions by calls:"
+        for (f in functions) {
+            line = functions[f]
+            # cycles are inclusive, so compare against the outermost function
+            share = maxCycles > 0 ? sprintf("%6.2f%% of cycles", 100 * cycles[line] / maxCycles) : ""
+            printf "%18d  %-20s line %-6d %s\n", calls[line], f, line, share | "sort -rn"
+        }
+        close("sort -rn")
+        print ""
+        print "loops by iterations:"
+        for (line in loops) {
+            printf "%18d  in %-17s line %d\n", iterations[line], loopFunction[line], line | "sort -rn"
+        }
+        close("sort -rn")
+        if (length(hits) > 0) {
+            print ""
+            print "memoized functions:"
+            for (f in hits) {
+                lookups = hits[f] + misses[f]
+                rate = lookups > 0 ? 100 * hits[f] / lookups : 0
+                printf "%18d  %-20s %d hits %d misses (%.1f%% hit rate)\n", lookups, f, hits[f], misses[f], rate | "sort -rn"
+            }
+            close("sort -rn")
+        }
+    }
+' ${PROFILE} ${SOURCE}
@@ -0,0 +1,462 @@
+// Parallel test driver for the .fun/.ok suite.
+//
+//     funtest [-j jobs] [-t seconds] [-d dir] [--junit file] [--json file] [tests...]
+//
+// Every test <name>.fun is compiled in-process (no p3 process per test),
+// assembled and linked with gcc, run, and its output compared with <name>.ok.
+// Tests are spread over <jobs> worker threads (default: number of cores).
+//
+// A test can declare how long its program may run with a comment line
+//
+//     # budget: 2.5
+//
+// (seconds, default 7 or -t). A program still running when its budget is
+// used up is killed and the test reported as a timeout. A test can also cap
+// the size of the generated code, the runtime included,
+//
+//     # instructions: 160
+//
+// and fails if more instructions than that are emitted for it.
+//
+// The compile and run time of every test are printed, and a JUnit XML and/or
+// JSON summary can be written for CI. Generated files go to <dir>
+// (default .funtest). The exit status is 0 if every test passed.
+
+#include <pthread.h>
+#include <spawn.h>
+#include <signal.h>
+#include <string.h>
+#include <glob.h>
+#include <sys/wait.h>
+
+#include "../compiler.h"
+
+extern char** environ;
+
+#define PATH_LEN 1024
+
+typedef struct Test {
+    char* name;                 // path of the test without .fun
+    char* base;                 // name used for generated files
+    double budget;              // seconds the program may run
+    uint64_t maxInstructions;   // 0 for no limit
+    char const *result;         // pass, fail, timeout, compile-error, link-error, crash, no-ok
+    char message[2 * PATH_LEN + 64];
+    double compileSeconds;
+    double linkSeconds;
+    double runSeconds;
+    uint64_t instructions;
+} Test;
+
+typedef struct Suite {
+    Test* tests;
+    size_t count;
+    size_t next;                // next test to hand out to a worker
+    char const *dir;
+    pthread_mutex_t lock;
+} Suite;
+
+double secondsSince(uint64_t start) {
+    return (statsNow() - start) / 1e9;
+}
+
+// reads a whole file, NULL if it can't be opened
+char* readFile(char const *path, size_t* length) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        return NULL;
+    }
+    size_t capacity = 4096;
+    char* data = (char*)(malloc(capacity));
+    size_t len = 0;
+    size_t n;
+    while ((n = fread(data + len, 1, capacity - len, file)) > 0) {
+        len += n;
+        if (len == capacity) {
+            capacity *= 2;
+            data = (char*)(realloc(data, capacity));
+        }
+    }
+    fclose(file);
+    data[len] = 0;
+    *length = len;
+    return data;
+}
+
+bool writeFile(char const *path, char const *data, size_t length) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        return false;
+    }
+    fwrite(data, 1, length, file);
+    fclose(file);
+    return true;
+}
+
+// the text after "# <name>:" on a comment line, NULL if there is none
+char const *findDirective(char const *source, char const *name) {
+    size_t length = strlen(name);
+    char const *found = NULL;
+    char const *line = source;
+    while (line != NULL && *line != 0) {
+        char const *p = line;
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+        if (*p == '#') {
+            p++;
+            while (*p == ' ' || *p == '\t') {
+                p++;
+            }
+            if (strncmp(p, name, length) == 0 && p[length] == ':') {
+                found = p + length + 1;
+            }
+        }
+        line = strchr(line, '\n');
+        if (line != NULL) {
+            line++;
+        }
+    }
+    return found;
+}
+
+// looks for a "# budget: <seconds>" comment line
+double findBudget(char const *source, double budget) {
+    char const *value = findDirective(source, "budget");
+    return value == NULL ? budget : strtod(value, NULL);
+}
+
+// runs argv with stdout/stderr redirected, killing it after budget seconds (0 = no limit)
+// returns the wait status, or -1 if it timed out
+int spawnAndWait(char* const argv[], char const *outPath, char const *errPath, double budget, double* seconds) {
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, 1, outPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    posix_spawn_file_actions_addopen(&actions, 2, errPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    uint64_t start = statsNow();
+    pid_t pid;
+    int rc = posix_spawnp(&pid, argv[0], &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (rc != 0) {
+        *seconds = 0;
+        return 127 << 8;
+    }
+
+    int status;
+    while (true) {
+        pid_t done = waitpid(pid, &status, WNOHANG);
+        if (done == pid) {
+            *seconds = secondsSince(start);
+            return status;
+        }
+        if (budget > 0 && secondsSince(start) > budget) {
+            kill(pid, SIGKILL);
+            waitpid(pid, &status, 0);
+            *seconds = secondsSince(start);
+            return -1;
+        }
+        struct timespec pause = { 0, 1000000 };
+        nanosleep(&pause, NULL);
+    }
+}
+
+// compiles the test in-process, returns the assembly or NULL on a compile error
+char* compileTest(Test* test, char const *source, size_t length, size_t* asmLength) {
+    Stats stats = { 0 };
+    char* assembly = NULL;
+    FILE* out = open_memstream(&assembly, asmLength);
+
+    uint64_t start = statsNow();
+    char* prog = stripComments(source, length, &stats);
+    Compiler* compiler = compilerConstructor(prog, out, &stats);
+    UnorderedMap* topLevelTable = compiler -> symbolTable;
+    jmp_buf failJump;
+    compiler -> failJump = &failJump;
+
+    bool ok = false;
+    if (setjmp(failJump) == 0) {
+        run(compiler);
+        ok = true;
+    }
+    else {
+        compilerAbandon(compiler, out, topLevelTable);
+        snprintf(test -> message, sizeof(test -> message), "compile failed at line %lu (offset %ld)",
+                 lineOf(compiler, compiler -> current), (long)(compiler -> current - compiler -> program));
+    }
+    test -> compileSeconds = secondsSince(start);
+    test -> instructions = stats.instructions;
+
+    fclose(out);
+    compilerFree(compiler);
+    free(prog);
+    if (!ok) {
+        free(assembly);
+        return NULL;
+    }
+    return assembly;
+}
+
+void runTest(Suite* suite, Test* test) {
+    char path[PATH_LEN], sPath[PATH_LEN], runPath[PATH_LEN], outPath[PATH_LEN], errPath[PATH_LEN];
+    size_t length;
+
+    snprintf(path, sizeof(path), "%s.fun", test -> name);
+    char* source = readFile(path, &length);
+    if (source == NULL) {
+        test -> result = "compile-error";
+        snprintf(test -> message, sizeof(test -> message), "can't read %s", path);
+        return;
+    }
+    test -> budget = findBudget(source, test -> budget);
+    char const *maxInstructions = findDirective(source, "instructions");
+    test -> maxInstructions = maxInstructions == NULL ? 0 : strtoul(maxInstructions, NULL, 10);
+
+    size_t asmLength;
+    char* assembly = compileTest(test, source, length, &asmLength);
+    free(source);
+    if (assembly == NULL) {
+        test -> result = "compile-error";
+        return;
+    }
+    if (test -> maxInstructions > 0 && test -> instructions > test -> maxInstructions) {
+        free(assembly);
+        test -> result = "fail";
+        snprintf(test -> message, sizeof(test -> message), "%lu instructions emitted, at most %lu expected",
+                 test -> instructions, test -> maxInstructions);
+        return;
+    }
+
+    snprintf(sPath, sizeof(sPath), "%s/%s.s", suite -> dir, test -> base);
+    snprintf(runPath, sizeof(runPath), "%s/%s.run", suite -> dir, test -> base);
+    snprintf(outPath, sizeof(outPath), "%s/%s.out", suite -> dir, test -> base);
+    snprintf(errPath, sizeof(errPath), "%s/%s.err", suite -> dir, test -> base);
+    bool written = writeFile(sPath, assembly, asmLength);
+    free(assembly);
+    if (!written) {
+        test -> result = "link-error";
+        snprintf(test -> message, sizeof(test -> message), "can't write %s", sPath);
+        return;
+    }
+
+    char* linkArgs[] = { "gcc", "-o", runPath, "-static", sPath, NULL };
+    int status = spawnAndWait(linkArgs, "/dev/null", errPath, 0, &(test -> linkSeconds));
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        test -> result = "link-error";
+        snprintf(test -> message, sizeof(test -> message), "gcc failed, see %s", errPath);
+        return;
+    }
+
+    char* runArgs[] = { runPath, NULL };
+    status = spawnAndWait(runArgs, outPath, errPath, test -> budget, &(test -> runSeconds));
+    if (status == -1) {
+        test -> result = "timeout";
+        snprintf(test -> message, sizeof(test -> message), "still running after the %gs budget", test -> budget);
+        return;
+    }
+    if (WIFSIGNALED(status)) {
+        test -> result = "crash";
+        snprintf(test -> message, sizeof(test -> message), "killed by signal %d", WTERMSIG(status));
+        return;
+    }
+
+    size_t outLength, okLength;
+    snprintf(path, sizeof(path), "%s.ok", test -> name);
+    char* expected = readFile(path, &okLength);
+    if (expected == NULL) {
+        test -> result = "no-ok";
+        snprintf(test -> message, sizeof(test -> message), "can't read %s", path);
+        return;
+    }
+    char* output = readFile(outPath, &outLength);
+    if (output != NULL && outLength == okLength && memcmp(output, expected, okLength) == 0) {
+        test -> result = "pass";
+    }
+    else {
+        test -> result = "fail";
+        snprintf(test -> message, sizeof(test -> message), "output differs from %s (see %s)", path, outPath);
+    }
+    free(output);
+    free(expected);
+}
+
+void* worker(void* arg) {
+    Suite* suite = (Suite*) arg;
+    while (true) {
+        pthread_mutex_lock(&(suite -> lock));
+        size_t i = suite -> next++;
+        pthread_mutex_unlock(&(suite -> lock));
+        if (i >= suite -> count) {
+            return NULL;
+        }
+
+        Test* test = &(suite -> tests[i]);
+        runTest(suite, test);
+
+        pthread_mutex_lock(&(suite -> lock));
+        printf("%s ... %s [compile %.2fms, run %.3fs]%s%s\n", test -> name, test -> result,
+               test -> compileSeconds * 1e3, test -> runSeconds,
+               test -> message[0] ? " " : "", test -> message);
+        fflush(stdout);
+        pthread_mutex_unlock(&(suite -> lock));
+    }
+}
+
+// writes s with the characters that are special in XML and JSON escaped
+void printEscaped(FILE* file, char const *s, bool xml) {
+    for (; *s != 0; s++) {
+        if (xml && *s == '&') fputs("&amp;", file);
+        else if (xml && *s == '<') fputs("&lt;", file);
+        else if (xml && *s == '>') fputs("&gt;", file);
+        else if (xml && *s == '"') fputs("&quot;", file);
+        else if (!xml && (*s == '"' || *s == '\\')) fprintf(file, "\\%c", *s);
+        else fputc(*s, file);
+    }
+}
+
+void writeJunit(Suite* suite, char const *path, size_t failures, double total) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "can't write %s\n", path);
+        return;
+    }
+    fprintf(file, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+    fprintf(file, "<testsuite name=\"fun\" tests=\"%zu\" failures=\"%zu\" time=\"%.3f\">\n", suite -> count, failures, total);
+    for (size_t i = 0; i < suite -> count; i++) {
+        Test* test = &(suite -> tests[i]);
+        fprintf(file, "  <testcase classname=\"fun\" name=\"");
+        printEscaped(file, test -> name, true);
+        fprintf(file, "\" time=\"%.3f\">\n", test -> compileSeconds + test -> linkSeconds + test -> runSeconds);
+        fprintf(file, "    <system-out>compile %.6fs, link %.6fs, run %.6fs, budget %gs</system-out>\n",
+                test -> compileSeconds, test -> linkSeconds, test -> runSeconds, test -> budget);
+        if (strcmp(test -> result, "pass") != 0) {
+            fprintf(file, "    <failure type=\"%s\" message=\"", test -> result);
+            printEscaped(file, test -> message, true);
+            fprintf(file, "\"/>\n");
+        }
+        fprintf(file, "  </testcase>\n");
+    }
+    fprintf(file, "</testsuite>\n");
+    fclose(file);
+}
+
+void writeJson(Suite* suite, char const *path, size_t failures, double total) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "can't write %s\n", path);
+        return;
+    }
+    fprintf(file, "{\n  \"tests\": [\n");
+    for (size_t i = 0; i < suite -> count; i++) {
+        Test* test = &(suite -> tests[i]);
+        fprintf(file, "    { \"name\": \"");
+        printEscaped(file, test -> name, false);
+        fprintf(file, "\", \"result\": \"%s\", \"message\": \"", test -> result);
+        printEscaped(file, test -> message, false);
+        fprintf(file, "\", \"compileMs\": %.3f, \"linkMs\": %.3f, \"runMs\": %.3f, \"budgetMs\": %.0f, \"instructions\": %lu }%s\n",
+                test -> compileSeconds * 1e3, test -> linkSeconds * 1e3, test -> runSeconds * 1e3,
+                test -> budget * 1e3, test -> instructions, (i + 1 < suite -> count) ? "," : "");
+    }
+    fprintf(file, "  ],\n  \"passed\": %zu,\n  \"failed\": %zu,\n  \"seconds\": %.3f\n}\n",
+            suite -> count - failures, failures, total);
+    fclose(file);
+}
+
+void usage(char const *name) {
+    fprintf(stderr, "usage: %s [-j jobs] [-t seconds] [-d dir] [--junit file] [--json file] [tests...]\n", name);
+    exit(2);
+}
+
+int main(int argc, char* argv[]) {
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    double budget = 7;
+    char const *junitPath = NULL;
+    char const *jsonPath = NULL;
+    Suite suite = { NULL, 0, 0, ".funtest", PTHREAD_MUTEX_INITIALIZER };
+
+    char** names = (char**)(malloc(sizeof(char*) * (argc + 1)));
+    size_t count = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            jobs = atol(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            budget = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            suite.dir = argv[++i];
+        }
+        else if (strcmp(argv[i], "--junit") == 0 && i + 1 < argc) {
+            junitPath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            jsonPath = argv[++i];
+        }
+        else if (argv[i][0] == '-') {
+            usage(argv[0]);
+        }
+        else {
+            names[count++] = argv[i];
+        }
+    }
+
+    glob_t found = { 0 };
+    if (count == 0) {
+        glob("*.fun", 0, NULL, &found);
+        names = (char**)(realloc(names, sizeof(char*) * (found.gl_pathc + 1)));
+        for (size_t i = 0; i < found.gl_pathc; i++) {
+            names[count++] = found.gl_pathv[i];
+        }
+    }
+    if (jobs < 1) {
+        jobs = 1;
+    }
+
+    mkdir(suite.dir, 0755);
+
+    suite.tests = (Test*)(calloc(count, sizeof(Test)));
+    suite.count = count;
+    for (size_t i = 0; i < count; i++) {
+        Test* test = &(suite.tests[i]);
+        test -> name = strdup(names[i]);
+        size_t len = strlen(test -> name);
+        if (len > 4 && strcmp(test -> name + len - 4, ".fun") == 0) {
+            test -> name[len - 4] = 0;
+        }
+        test -> base = strdup(test -> name);
+        for (char* p = test -> base; *p != 0; p++) {
+            if (*p == '/') {
+                *p = '_';
+            }
+        }
+        test -> budget = budget;
+        test -> result = "not-run";
+    }
+
+    uint64_t start = statsNow();
+    pthread_t* threads = (pthread_t*)(malloc(sizeof(pthread_t) * jobs));
+    for (long i = 0; i < jobs; i++) {
+        pthread_create(&threads[i], NULL, worker, &suite);
+    }
+    for (long i = 0; i < jobs; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double total = secondsSince(start);
+
+    size_t failures = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (strcmp(suite.tests[i].result, "pass") != 0) {
+            failures++;
+        }
+    }
+    printf("%zu / %zu passed in %.3fs with %ld jobs\n", count - failures, count, total, jobs);
+
+    if (junitPath != NULL) {
+        writeJunit(&suite, junitPath, failures, total);
+    }
+    if (jsonPath != NULL) {
+        writeJson(&suite, jsonPath, failures, total);
+    }
+
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,212 @@
+// Concurrency test for libfun (lib/fun.h).
+//
+//     libtest [-j threads] [-n rounds] prog.fun...
+//
+// Every program, and a few that don't compile, is first compiled once on the
+// main thread with and without -fno-select. Then <threads> threads (8 by
+// default) compile all of them <rounds> times (20 by default) in an order of
+// their own, each with one context it keeps for all its compiles, and every
+// compile has to give the same assembly or the same diagnostic as the first
+// one. The exit status is 0 if they all did.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../lib/fun.h"
+
+#define MAX_PROGRAMS 256
+#define OPTION_SETS 2
+
+typedef struct Program {
+    char const *name;
+    char* source;
+    size_t length;
+
+    // the first compile with each option set
+    FunStatus status[OPTION_SETS];
+    char* output[OPTION_SETS];
+    size_t outputLength[OPTION_SETS];
+    FunDiagnostic diagnostic[OPTION_SETS];
+} Program;
+
+typedef struct Suite {
+    Program programs[MAX_PROGRAMS];
+    size_t countPrograms;
+    size_t rounds;
+    FunOptions options[OPTION_SETS];
+} Suite;
+
+typedef struct Worker {
+    Suite* suite;
+    pthread_t thread;
+    size_t index;
+    size_t compiles;
+    size_t mismatches;
+} Worker;
+
+// programs that don't compile, with the line they fail on
+char const *const brokenPrograms[] = {
+    "fun main() {\n    x = 1\n    else {\n    }\n}\n",
+    "fun main() {\n    print(1)\n",
+    "fun f(a) {\n    return a\n}\nfun main() {\n    pfor (i, 0, 10) {\n        return i\n    }\n}\n",
+    "print(1)\nx = 2\n",
+    "fun f(a) {\n    x = a + y = 1\n    return x\n}\n",
+};
+uint64_t const brokenLines[] = { 3, 3, 6, 2, 2 };
+
+char* readFile(char const *path, size_t* length) {
+    FILE* in = fopen(path, "r");
+    if (in == NULL) {
+        perror(path);
+        exit(2);
+    }
+    char* text = NULL;
+    FILE* out = open_memstream(&text, length);
+    int c;
+    while ((c = fgetc(in)) != EOF) {
+        fputc(c, out);
+    }
+    fclose(out);
+    fclose(in);
+    return text;
+}
+
+// true if the compile gave what the first one did
+bool sameResult(Program* program, size_t set, FunContext* context, FunStatus status) {
+    if (status != program -> status[set]) {
+        return false;
+    }
+    if (status == FUN_OK) {
+        size_t length;
+        char const *output = funOutput(context, &length);
+        return length == program -> outputLength[set] && memcmp(output, program -> output[set], length) == 0;
+    }
+    FunDiagnostic const *diagnostic = funDiagnostic(context, 0);
+    FunDiagnostic* expected = &(program -> diagnostic[set]);
+    return funDiagnosticCount(context) == 1 && diagnostic -> line == expected -> line &&
+           diagnostic -> column == expected -> column && diagnostic -> offset == expected -> offset &&
+           strcmp(diagnostic -> message, expected -> message) == 0 && strcmp(diagnostic -> text, expected -> text) == 0;
+}
+
+void* work(void* arg) {
+    Worker* worker = (Worker*) arg;
+    Suite* suite = worker -> suite;
+    FunContext* context = funContextCreate();
+    for (size_t round = 0; round < suite -> rounds; round++) {
+        for (size_t i = 0; i < suite -> countPrograms; i++) {
+            // every worker goes through the programs in a different order
+            Program* program = &(suite -> programs[(i * 7 + worker -> index * 3 + round) % suite -> countPrograms]);
+            size_t set = (i + worker -> index + round) % OPTION_SETS;
+            FunStatus status = funCompile(context, program -> source, program -> length, &(suite -> options[set]));
+            worker -> compiles++;
+            if (!sameResult(program, set, context, status)) {
+                fprintf(stderr, "%s: thread %zu compiled it differently\n", program -> name, worker -> index);
+                worker -> mismatches++;
+            }
+        }
+    }
+    funContextFree(context);
+    return NULL;
+}
+
+int main(int argc, char* argv[]) {
+    static Suite suite;
+    size_t threads = 8;
+    suite.rounds = 20;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            threads = (size_t) atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            suite.rounds = (size_t) atoi(argv[++i]);
+        }
+        else if (argv[i][0] == '-' || suite.countPrograms == MAX_PROGRAMS) {
+            fprintf(stderr, "usage: %s [-j threads] [-n rounds] prog.fun...\n", argv[0]);
+            return 2;
+        }
+        else {
+            Program* program = &(suite.programs[suite.countPrograms++]);
+            program -> name = argv[i];
+            program -> source = readFile(argv[i], &(program -> length));
+        }
+    }
+    size_t countBroken = sizeof(brokenPrograms) / sizeof(brokenPrograms[0]);
+    for (size_t i = 0; i < countBroken && suite.countPrograms < MAX_PROGRAMS; i++) {
+        Program* program = &(suite.programs[suite.countPrograms++]);
+        program -> name = "(broken)";
+        program -> source = strdup(brokenPrograms[i]);
+        program -> length = strlen(brokenPrograms[i]);
+    }
+    suite.options[1].noSelect = true;
+
+    int status = 0;
+    FunContext* context = funContextCreate();
+    for (size_t i = 0; i < suite.countPrograms; i++) {
+        Program* program = &(suite.programs[i]);
+        for (size_t set = 0; set < OPTION_SETS; set++) {
+            program -> status[set] = funCompile(context, program -> source, program -> length, &(suite.options[set]));
+            if (program -> status[set] == FUN_OK) {
+                char const *output = funOutput(context, &(program -> outputLength[set]));
+                program -> output[set] = (char*) (malloc(program -> outputLength[set]));
+                memcpy(program -> output[set], output, program -> outputLength[set]);
+            }
+            else {
+                FunDiagnostic const *diagnostic = funDiagnostic(context, 0);
+                program -> diagnostic[set] = *diagnostic;
+                program -> diagnostic[set].message = strdup(diagnostic -> message);
+                program -> diagnostic[set].text = strdup(diagnostic -> text);
+            }
+        }
+
+        // the broken programs fail where they should, the others compile
+        size_t broken = i + countBroken - suite.countPrograms;
+        bool expectBroken = i + countBroken >= suite.countPrograms;
+        if (expectBroken ? program -> status[0] != FUN_FAILED || program -> diagnostic[0].line != brokenLines[broken]
+                         : program -> status[0] != FUN_OK) {
+            fprintf(stderr, "%s: unexpected result of the first compile\n", program -> name);
+            status = 1;
+        }
+        if (program -> status[0] == FUN_FAILED) {
+            printf("%s: line %lu column %lu: %s\n", program -> name, program -> diagnostic[0].line,
+                   program -> diagnostic[0].column, program -> diagnostic[0].message);
+        }
+    }
+    funContextFree(context);
+
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    Worker* workers = (Worker*) (calloc(threads, sizeof(Worker)));
+    for (size_t i = 0; i < threads; i++) {
+        workers[i].suite = &suite;
+        workers[i].index = i;
+        pthread_create(&(workers[i].thread), NULL, work, &(workers[i]));
+    }
+    size_t compiles = 0;
+    size_t mismatches = 0;
+    for (size_t i = 0; i < threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        compiles += workers[i].compiles;
+        mismatches += workers[i].mismatches;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+
+    printf("%zu compiles of %zu programs on %zu threads in %.2fs, %zu different\n",
+           compiles, suite.countPrograms, threads, seconds, mismatches);
+    for (size_t i = 0; i < suite.countPrograms; i++) {
+        for (size_t set = 0; set < OPTION_SETS; set++) {
+            free(suite.programs[i].output[set]);
+            if (suite.programs[i].status[set] == FUN_FAILED) {
+                free((char*) suite.programs[i].diagnostic[set].message);
+                free((char*) suite.programs[i].diagnostic[set].text);
+            }
+        }
+        free(suite.programs[i].source);
+    }
+    free(workers);
+    return status != 0 || mismatches != 0;
+}
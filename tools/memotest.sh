@@ -0,0 +1,47 @@
+#!/bin/bash
+#
+# Checks -fmemoize on programs that need it to finish.
+#
+#   tools/memotest.sh [prog.fun...]
+#
+# Every program (bench/memo.fun by default) is compiled with -fmemoize, also
+# with -fno-fold-calls (nothing is evaluated at compile time) and with
+# -fno-select, and has to print its .ok within 10 seconds each time. Then it
+# is compiled with -fmemoize -fprofile: it has to print the same, and the
+# cache hits and misses of its functions are printed from the profile. A
+# function with more misses than a cache has entries (4096) evicted some.
+
+if [ $# -eq 0 ]; then
+    set -- bench/memo.fun
+fi
+
+DIR=$(mktemp -d)
+trap "rm -rf ${DIR}" EXIT
+
+make -s p3 || exit 1
+
+# compiles $1 with the flags in $2 and compares its output with the .ok
+check() {
+    local name=$(basename $1 .fun)
+    ./p3 $2 < $1 > ${DIR}/${name}.s || { echo "${name}: compile failed ($2)"; return 1; }
+    gcc -o ${DIR}/${name}.run -static ${DIR}/${name}.s 2> /dev/null || { echo "${name}: link failed ($2)"; return 1; }
+    FUN_PROFILE=${DIR}/${name}.prof timeout 10 ${DIR}/${name}.run | cmp -s - ${1%.fun}.ok || { echo "${name}: wrong output or too slow ($2)"; return 1; }
+}
+
+status=0
+for fun in "$@"; do
+    name=$(basename ${fun} .fun)
+    ok=1
+    for flags in "-fmemoize" "-fmemoize -fno-fold-calls" "-fmemoize -fno-select" "-fmemoize -fprofile"; do
+        check ${fun} "${flags}" || { ok=0; status=1; }
+    done
+    [ ${ok} -eq 1 ] || continue
+    if ! grep -q "^memo " ${DIR}/${name}.prof; then
+        echo "${name}: nothing memoized"
+        status=1
+        continue
+    fi
+    echo "${name} ... pass"
+    awk '$1 == "memo" { printf "    %-12s %10d hits %10d misses%s\n", $2, $4, $5, ($5 > 4096 ? " (evicts)" : "") }' ${DIR}/${name}.prof
+done
+exit ${status}
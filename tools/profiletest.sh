@@ -0,0 +1,48 @@
+#!/bin/bash
+#
+# Checks that -fprofile-use compiles programs that still print their .ok.
+#
+#   tools/profiletest.sh [test.fun...]
+#
+# Every test is compiled with -fprofile and run to write its profile, then
+# compiled again with -fprofile-use and run. The same is done with a damaged
+# profile: entries for lines far past the end of the program and garbage
+# lines. Both have to compile (a stale profile only gives worse decisions)
+# and print the test's .ok. The tests are t*.fun but t2 by default: with
+# -fprofile loops aren't put in closed form, and one of t2's runs 2^63 times.
+
+TESTS=("$@")
+if [ ${#TESTS[@]} -eq 0 ]; then
+    TESTS=($(ls t*.fun | grep -v '^t2\.fun$'))
+fi
+
+DIR=$(mktemp -d)
+trap "rm -rf ${DIR}" EXIT
+
+make -s p3 || exit 1
+
+# compiles $1 with the profile $2 and compares its output with the .ok
+check() {
+    local name=$(basename $1 .fun)
+    ./p3 -fprofile-use=$2 < $1 > ${DIR}/${name}.s
+    local code=$?
+    [ ${code} -eq 0 ] || { echo "${name}: compile with $(basename $2) failed (exit ${code})"; return 1; }
+    gcc -o ${DIR}/${name}.run -static ${DIR}/${name}.s 2> /dev/null || { echo "${name}: link with $(basename $2) failed"; return 1; }
+    timeout 10 ${DIR}/${name}.run | cmp -s - ${1%.fun}.ok || { echo "${name}: wrong output with $(basename $2)"; return 1; }
+}
+
+status=0
+for fun in ${TESTS[@]}; do
+    name=$(basename ${fun} .fun)
+    rm -f ${DIR}/good.prof
+    ./p3 -fprofile < ${fun} > ${DIR}/${name}.prof.s || { echo "${name}: -fprofile compile failed"; status=1; continue; }
+    gcc -o ${DIR}/${name}.prof.run -static ${DIR}/${name}.prof.s 2> /dev/null || { echo "${name}: -fprofile link failed"; status=1; continue; }
+    FUN_PROFILE=${DIR}/good.prof timeout 10 ${DIR}/${name}.prof.run > /dev/null || { echo "${name}: -fprofile run failed"; status=1; continue; }
+
+    cp ${DIR}/good.prof ${DIR}/bad.prof
+    printf "if main 99999999999999 5 5\nif main 18446744073709551615 5 5\nif main 18446744073709551616 1 1\n" >> ${DIR}/bad.prof
+    printf "if\nfunction\nloop main x y\n\n" >> ${DIR}/bad.prof
+
+    check ${fun} ${DIR}/good.prof && check ${fun} ${DIR}/bad.prof && echo "${name} ... pass" || status=1
+done
+exit ${status}
@@ -0,0 +1,62 @@
+#!/bin/bash
+#
+# Runs a program with pfor loops on 1, 2, 4, ... threads and reports how it
+# scales.
+#
+#   tools/scaling.sh [-n runs] [-j max_threads] prog.fun
+#
+# The program is compiled with ./p3 and run <runs> times for every thread
+# count (FUN_THREADS) up to <max_threads>, which defaults to the number of
+# cpus and is always measured itself. The median wall time is reported with
+# the speedup over one thread and the parallel efficiency (speedup per
+# thread). Every run has to print what the one thread run printed.
+
+RUNS=3
+MAX_THREADS=$(nproc)
+
+while getopts "n:j:" opt; do
+    case $opt in
+        n) RUNS=$OPTARG ;;
+        j) MAX_THREADS=$OPTARG ;;
+        *) echo "usage: $0 [-n runs] [-j max_threads] prog.fun" >&2; exit 2 ;;
+    esac
+done
+shift $((OPTIND - 1))
+if [ $# -ne 1 ]; then
+    echo "usage: $0 [-n runs] [-j max_threads] prog.fun" >&2
+    exit 2
+fi
+
+FUN=$1
+NAME=$(basename ${FUN} .fun)
+OUT_DIR=bench/out
+mkdir -p ${OUT_DIR}
+
+make -s p3 || exit 1
+./p3 < ${FUN} > ${OUT_DIR}/${NAME}.s || { echo "${NAME}: compile failed"; exit 1; }
+gcc -o ${OUT_DIR}/${NAME}.run -static ${OUT_DIR}/${NAME}.s 2> /dev/null || { echo "${NAME}: link failed"; exit 1; }
+FUN_THREADS=1 ${OUT_DIR}/${NAME}.run > ${OUT_DIR}/${NAME}.expected
+
+# median wall time in ms of RUNS runs with $1 threads
+measure() {
+    for ((i = 0; i < RUNS; i++)); do
+        local start=$(date +%s%N)
+        FUN_THREADS=$1 ${OUT_DIR}/${NAME}.run > ${OUT_DIR}/${NAME}.out
+        local end=$(date +%s%N)
+        cmp -s ${OUT_DIR}/${NAME}.out ${OUT_DIR}/${NAME}.expected || { echo "wrong output with $1 threads" >&2; exit 1; }
+        echo $(( (end - start) / 1000 ))
+    done | sort -n | awk '{ t[NR] = $1 } END { printf "%.3f\n", t[int((NR + 1) / 2)] / 1000 }'
+}
+
+THREADS=()
+for ((t = 1; t < MAX_THREADS; t *= 2)); do
+    THREADS+=(${t})
+done
+THREADS+=(${MAX_THREADS})
+
+printf "%-8s %12s %9s %11s\n" "threads" "median(ms)" "speedup" "efficiency"
+for t in ${THREADS[@]}; do
+    ms=$(measure ${t}) || exit 1
+    [ ${t} -eq 1 ] && base=${ms}
+    awk -v t=${t} -v m=${ms} -v b=${base} 'BEGIN { printf "%-8d %12.3f %8.2fx %10.0f%%\n", t, m, b / m, b / m / t * 100 }'
+done
@@ -0,0 +1,154 @@
+// Scanner throughput benchmark.
+//
+//     scanbench [-n runs] [prog.fun...]
+//
+// Splits the programs (or generated ones) into tokens the way the lexer does:
+// white space is skipped, an identifier or a number is one token, anything
+// else is a byte. This is done with the table of scan.h ("table") and with
+// the isspace/isalnum loops it replaced ("libc"). The best of <runs> is
+// printed in MB/s. Without programs there are two generated inputs: "code"
+// looks like bench.sh's compile-stress program, "long" has deep indentation
+// and long names and numbers. Both have to find the same tokens.
+
+#include <ctype.h>
+#include <string.h>
+#include <time.h>
+
+#include "../scan.h"
+#include "../stats.h"
+
+#define GENERATED_BYTES (16 << 20)
+
+typedef struct Input {
+    char const *name;
+    char* text;
+    size_t length;
+} Input;
+
+// token count and a hash of where they end
+typedef struct Tokens {
+    uint64_t count;
+    uint64_t hash;
+} Tokens;
+
+Tokens tokenize(char const *text, bool libc) {
+    Tokens tokens = { 0, 0 };
+    char const *p = text;
+    while (true) {
+        if (libc) {
+            while (isspace(*p)) {
+                p++;
+            }
+        }
+        else {
+            p = scanSpace(p);
+        }
+        if (*p == 0) {
+            break;
+        }
+
+        if (isAlphaByte(*p) || isDigitByte(*p)) {
+            ScanClass scanClass = isAlphaByte(*p) ? SCAN_ALNUM : SCAN_DIGIT;
+            if (libc) {
+                do {
+                    p++;
+                } while (scanClass == SCAN_ALNUM ? isalnum(*p) : isdigit(*p));
+            }
+            else {
+                p = scanRun(p + 1, scanClass);
+            }
+        }
+        else {
+            p++;
+        }
+        tokens.count++;
+        tokens.hash = tokens.hash * 31 + (uint64_t)(p - text);
+    }
+    return tokens;
+}
+
+Input generate(char const *name, bool longRuns) {
+    char* text = NULL;
+    size_t length = 0;
+    FILE* out = open_memstream(&text, &length);
+    char const *indent = longRuns ? "                                " : "    ";
+    char const *prefix = longRuns ? "aVeryLongVariableNameFromAGenerator" : "x";
+    for (uint64_t f = 0; length < GENERATED_BYTES; f++) {
+        fprintf(out, "fun f%lu(a, b, c) {\n", f);
+        for (uint64_t l = 0; l < 10; l++) {
+            fprintf(out, "%s%s%lu = a * %lu + (b - c) / (%lu + 1) %% 97 + (a < b) * (c != %lu)\n",
+                    indent, prefix, l, longRuns ? 12345678901234567ul * l : l, l, f);
+        }
+        fprintf(out, "%sreturn %s0 + %s9 + 1 + 2 + 3\n}\n", indent, prefix, prefix);
+        fflush(out);
+    }
+    fclose(out);
+    Input input = { name, text, length };
+    return input;
+}
+
+Input readInput(char const *path) {
+    FILE* in = fopen(path, "r");
+    if (in == NULL) {
+        perror(path);
+        exit(1);
+    }
+    char* text = NULL;
+    size_t length = 0;
+    FILE* out = open_memstream(&text, &length);
+    int c;
+    while ((c = fgetc(in)) != EOF) {
+        fputc(c, out);
+    }
+    fclose(out);
+    fclose(in);
+    Input input = { path, text, length };
+    return input;
+}
+
+int main(int argc, char* argv[]) {
+    int runs = 5;
+    Input inputs[64];
+    int countInputs = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            runs = atoi(argv[++i]);
+        }
+        else if (argv[i][0] == '-' || countInputs == 64) {
+            fprintf(stderr, "usage: %s [-n runs] [prog.fun...]\n", argv[0]);
+            return 2;
+        }
+        else {
+            inputs[countInputs++] = readInput(argv[i]);
+        }
+    }
+    if (countInputs == 0) {
+        inputs[countInputs++] = generate("code", false);
+        inputs[countInputs++] = generate("long", true);
+    }
+
+    printf("%-24s %10s %10s %10s   (MB/s)\n", "input", "MB", "libc", "table");
+    int status = 0;
+    for (int i = 0; i < countInputs; i++) {
+        Input* input = &(inputs[i]);
+        printf("%-24s %10.1f", input -> name, (double) input -> length / (1 << 20));
+        Tokens expected = tokenize(input -> text, true);
+        for (int libc = 1; libc >= 0; libc--) {
+            uint64_t best = UINT64_MAX;
+            for (int run = 0; run < runs; run++) {
+                uint64_t start = statsNow();
+                Tokens tokens = tokenize(input -> text, libc);
+                uint64_t nanos = statsNow() - start;
+                best = nanos < best ? nanos : best;
+                if (tokens.count != expected.count || tokens.hash != expected.hash) {
+                    fprintf(stderr, "%s: the table finds other tokens\n", input -> name);
+                    status = 1;
+                }
+            }
+            printf(" %10.1f", (double) input -> length / (1 << 20) / ((double) best / 1e9));
+        }
+        printf("\n");
+        free(input -> text);
+    }
+    return status;
+}
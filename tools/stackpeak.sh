@@ -0,0 +1,57 @@
+#!/bin/bash
+#
+# Measures how much stack programs need, with and without shared stack slots.
+#
+#   tools/stackpeak.sh prog.fun...
+#
+# Every program is compiled with -fstack-size=<n>k, and a binary search finds
+# the smallest <n> it runs in without a stack overflow. This is done once
+# with the usual stack slot sharing and once with -fno-share-slots. Every
+# run that fits has to print what the program prints on the process stack.
+
+if [ $# -eq 0 ]; then
+    echo "usage: $0 prog.fun..." >&2
+    exit 2
+fi
+
+OUT_DIR=bench/out
+mkdir -p ${OUT_DIR}
+make -s p3 || exit 1
+
+# true if $1 runs in $3 KB of stack compiled with the flags in $2
+fits() {
+    ./p3 $2 -fstack-size=$3k < $1 > ${OUT_DIR}/stack.s || exit 1
+    gcc -o ${OUT_DIR}/stack.run -static ${OUT_DIR}/stack.s 2> /dev/null || exit 1
+    ${OUT_DIR}/stack.run > ${OUT_DIR}/stack.out 2>&1
+    if grep -q "^stack overflow" ${OUT_DIR}/stack.out; then
+        return 1
+    fi
+    cmp -s ${OUT_DIR}/stack.out ${OUT_DIR}/stack.expected || { echo "$1: wrong output with $3KB of stack" >&2; exit 1; }
+}
+
+# the smallest stack in KB $1 runs in with the flags in $2
+peak() {
+    local low=4 high=1048576
+    fits $1 "$2" ${high} || { echo "-"; return; }
+    while [ $((high - low)) -gt 4 ]; do
+        local middle=$(( (low + high) / 2 ))
+        if fits $1 "$2" ${middle}; then
+            high=${middle}
+        else
+            low=${middle}
+        fi
+    done
+    echo ${high}
+}
+
+printf "%-28s %12s %12s %8s\n" "program" "shared(KB)" "unshared(KB)" "saved"
+for fun in "$@"; do
+    ./p3 < ${fun} > ${OUT_DIR}/stack.s || { echo "${fun}: compile failed"; exit 1; }
+    gcc -o ${OUT_DIR}/stack.run -static ${OUT_DIR}/stack.s 2> /dev/null || { echo "${fun}: link failed"; exit 1; }
+    ${OUT_DIR}/stack.run > ${OUT_DIR}/stack.expected
+
+    shared=$(peak ${fun} "")
+    unshared=$(peak ${fun} -fno-share-slots)
+    saved=$(awk -v s=${shared} -v u=${unshared} 'BEGIN { if (u + 0 > 0 && s + 0 > 0) printf "%.0f%%", (u - s) * 100 / u; else print "-" }')
+    printf "%-28s %12s %12s %8s\n" ${fun} ${shared} ${unshared} ${saved}
+done
@@ -0,0 +1,51 @@
+#!/bin/bash
+#
+# Checks the depth -fstack-size programs report when they overflow.
+#
+#   tools/stacktest.sh [-s stack_kb]
+#
+# A recursion that prints every level overflows inside printf (libc code that
+# doesn't keep an %rbp chain), one that prints every 1000th level overflows
+# in its own code. Compiled with -fstack-size=<stack_kb>k (1024 by default)
+# both have to exit with 1 and report "stack overflow at depth <n>", where <n>
+# is at least the last level printed and at most a level (or for the second
+# one, 1000 levels) plus a few frames more: ._.main's and those of libc that
+# keep %rbp.
+
+STACK=1024
+
+while getopts "s:" opt; do
+    case $opt in
+        s) STACK=$OPTARG ;;
+        *) echo "usage: $0 [-s stack_kb]" >&2; exit 2 ;;
+    esac
+done
+
+DIR=$(mktemp -d)
+trap "rm -rf ${DIR}" EXIT
+
+make -s p3 || exit 1
+
+# a recursion that prints the levels that are multiples of $1
+generate() {
+    printf "fun f(n) {\n    if (n %% $1 == 0) {\n        print(n)\n    }\n    return f(n + 1) + 1\n}\n"
+    printf "fun main() {\n    print(f(1))\n}\n"
+}
+
+status=0
+for every in 1 1000; do
+    generate ${every} > ${DIR}/deep.fun
+    ./p3 -fstack-size=${STACK}k < ${DIR}/deep.fun > ${DIR}/deep.s || { echo "every ${every}: compile failed"; exit 1; }
+    gcc -o ${DIR}/deep.run -static ${DIR}/deep.s 2> /dev/null || { echo "every ${every}: link failed"; exit 1; }
+    ${DIR}/deep.run > ${DIR}/deep.out 2> ${DIR}/deep.err
+    code=$?
+    last=$(tail -1 ${DIR}/deep.out)
+    depth=$(sed -n 's/^stack overflow at depth \([0-9]*\)$/\1/p' ${DIR}/deep.err)
+    if [ ${code} -ne 1 ] || [ -z "${depth}" ] || [ ${depth} -lt ${last} ] || [ ${depth} -gt $((last + every + 4)) ]; then
+        echo "every ${every}: exit ${code}, last printed ${last}, $(head -1 ${DIR}/deep.err)"
+        status=1
+    else
+        echo "every ${every}: last printed ${last}, stack overflow at depth ${depth}"
+    fi
+done
+exit ${status}
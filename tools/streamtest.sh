@@ -0,0 +1,69 @@
+#!/bin/bash
+#
+# Checks that --stream compiles a program larger than the memory it is given.
+#
+#   tools/streamtest.sh [-f functions] [-m limit_kb]
+#
+# A program with <functions> functions (200000 by default, about 22MB) is
+# compiled by ./p3 --stream under ulimit -v <limit_kb> (16384 by default, less
+# than the program itself) and every function has to be in the output. A
+# small program of the same shape, compiled with and without --stream, has
+# to print the same both ways.
+
+FUNCTIONS=200000
+LIMIT=16384
+
+while getopts "f:m:" opt; do
+    case $opt in
+        f) FUNCTIONS=$OPTARG ;;
+        m) LIMIT=$OPTARG ;;
+        *) echo "usage: $0 [-f functions] [-m limit_kb]" >&2; exit 2 ;;
+    esac
+done
+
+DIR=$(mktemp -d)
+trap "rm -rf ${DIR}" EXIT
+
+make -s p3 || exit 1
+
+# a program with $1 functions, main calls every $2nd one
+generate() {
+    awk -v n=$1 -v step=$2 'BEGIN {
+        for (i = 0; i < n; i++) {
+            printf "# function %d\n", i
+            printf "fun f%d(a) {\n", i
+            printf "    x = a + %d\n", i
+            printf "    while (x > 100) {\n"
+            printf "        x = x / 2\n"
+            printf "    }\n"
+            printf "    print(x)\n"
+            printf "    return x\n"
+            printf "}\n\n"
+        }
+        printf "fun main() {\n"
+        for (i = 0; i < n; i += step) {
+            printf "    f%d(%d)\n", i, i * 7
+        }
+        printf "}\n"
+    }'
+}
+
+generate 1000 7 > ${DIR}/small.fun
+for mode in whole stream; do
+    flags=$([ ${mode} = stream ] && echo --stream)
+    ./p3 ${flags} < ${DIR}/small.fun > ${DIR}/${mode}.s || { echo "small program: compile failed (${mode})"; exit 1; }
+    gcc -o ${DIR}/${mode}.run -static ${DIR}/${mode}.s 2> /dev/null || { echo "small program: link failed (${mode})"; exit 1; }
+    ${DIR}/${mode}.run > ${DIR}/${mode}.out
+done
+cmp -s ${DIR}/whole.out ${DIR}/stream.out || { echo "small program: --stream prints something else"; exit 1; }
+
+generate ${FUNCTIONS} 1000 > ${DIR}/big.fun
+size=$(( $(stat -c %s ${DIR}/big.fun) / 1024 ))
+(ulimit -v ${LIMIT}; exec ./p3 --stream < ${DIR}/big.fun) | grep -c '^\._\.f[0-9]*:$' > ${DIR}/emitted
+status=${PIPESTATUS[0]}
+emitted=$(cat ${DIR}/emitted)
+if [ ${status} -ne 0 ] || [ ${emitted} -ne ${FUNCTIONS} ]; then
+    echo "${size}KB program in ${LIMIT}KB: failed (exit ${status}, ${emitted} of ${FUNCTIONS} functions)"
+    exit 1
+fi
+echo "${size}KB program in ${LIMIT}KB: ${emitted} functions"
@@ -0,0 +1,85 @@
+#!/bin/bash
+#
+# Measures the cycles per loop iteration of programs at several unroll factors.
+#
+#   tools/unrollbench.sh [-n runs] [-f "factors"] prog.fun...
+#
+# Every program is compiled with -funroll=<factor> for each factor ("1 2 4 8"
+# by default, 1 is the loop without unrolling) and the fastest of <runs> runs
+# is divided by the loop iterations the program declares in a
+# "# iterations: <n>" comment. Cycles come from perf when it can count them,
+# otherwise from the time at the clock rate /proc/cpuinfo reports. Every
+# factor has to print what the program prints without unrolling.
+
+RUNS=5
+FACTORS="1 2 4 8"
+
+while getopts "n:f:" opt; do
+    case $opt in
+        n) RUNS=$OPTARG ;;
+        f) FACTORS=$OPTARG ;;
+        *) echo "usage: $0 [-n runs] [-f \"factors\"] prog.fun..." >&2; exit 2 ;;
+    esac
+done
+shift $((OPTIND - 1))
+if [ $# -eq 0 ]; then
+    echo "usage: $0 [-n runs] [-f \"factors\"] prog.fun..." >&2
+    exit 2
+fi
+
+OUT_DIR=bench/out
+mkdir -p ${OUT_DIR}
+make -s p3 || exit 1
+
+PERF=0
+if command -v perf > /dev/null && perf stat -x, -e cycles true 2>&1 | grep -q '^[0-9]'; then
+    PERF=1
+fi
+MHZ=$(awk -F: '/^cpu MHz/ { print $2 + 0; exit }' /proc/cpuinfo)
+
+# the fewest cycles of RUNS runs of $1
+measure() {
+    for ((i = 0; i < RUNS; i++)); do
+        if [ ${PERF} -eq 1 ]; then
+            perf stat -x, -e cycles -o ${OUT_DIR}/unroll.perf $1 > ${OUT_DIR}/unroll.out
+            awk -F, '$3 ~ /cycles/ { print $1 }' ${OUT_DIR}/unroll.perf
+        else
+            local start=$(date +%s%N)
+            $1 > ${OUT_DIR}/unroll.out
+            local end=$(date +%s%N)
+            awk -v ns=$((end - start)) -v mhz=${MHZ} 'BEGIN { printf "%.0f\n", ns * mhz / 1000 }'
+        fi
+        cmp -s ${OUT_DIR}/unroll.out ${OUT_DIR}/unroll.expected || { echo "$1: wrong output" >&2; exit 1; }
+    done | sort -n | head -1
+}
+
+printf "%-24s" "program"
+for factor in ${FACTORS}; do
+    printf " %10s" "x${factor}"
+done
+if [ ${PERF} -eq 1 ]; then
+    printf "   (cycles/iteration)\n"
+else
+    printf "   (cycles/iteration at %sMHz)\n" ${MHZ}
+fi
+
+for fun in "$@"; do
+    name=$(basename ${fun} .fun)
+    iterations=$(sed -n 's/^# iterations: *\([0-9]*\)$/\1/p' ${fun})
+    if [ -z "${iterations}" ]; then
+        echo "${fun}: no \"# iterations: <n>\" comment"
+        exit 1
+    fi
+    ./p3 -funroll=1 < ${fun} > ${OUT_DIR}/${name}.s || { echo "${fun}: compile failed"; exit 1; }
+    gcc -o ${OUT_DIR}/${name}.run -static ${OUT_DIR}/${name}.s 2> /dev/null || { echo "${fun}: link failed"; exit 1; }
+    ${OUT_DIR}/${name}.run > ${OUT_DIR}/unroll.expected
+
+    printf "%-24s" ${fun}
+    for factor in ${FACTORS}; do
+        ./p3 -funroll=${factor} < ${fun} > ${OUT_DIR}/${name}.s || { echo "${fun}: compile failed"; exit 1; }
+        gcc -o ${OUT_DIR}/${name}.run -static ${OUT_DIR}/${name}.s 2> /dev/null || { echo "${fun}: link failed"; exit 1; }
+        cycles=$(measure ${OUT_DIR}/${name}.run) || exit 1
+        awk -v c=${cycles} -v n=${iterations} 'BEGIN { printf " %10.2f", c / n }'
+    done
+    printf "\n"
+done
@@ -0,0 +1,222 @@
+#pragma once
+
+// libc includes (available in both C and C++)
+#include <stdlib.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Implementation includes
+#include "constant folding.h"
+#include "ast.h"
+#include "select.h"
+#include "profile.h"
+#include "scev.h"
+#include "reach.h"
+
+// Counted loop unrolling (-funroll=<n>)
+//
+// A while loop is counted when its condition compares a variable i with a
+// bound (< <= > >=, the bound on either side) and its body steps i towards
+// the bound with one "i = i + c" that isn't inside an if or a loop, assigns
+// nothing the bound reads and has no loops of its own. Comparisons are
+// unsigned, so once the condition holds the distance to the bound is exact,
+// and when it leaves room for n more steps the next n conditions all hold:
+//
+//     .LstartWhile:  condition, out if false
+//                    distance <= (n - 1) * c: to .LrestWhile
+//                    body x n
+//                    jmp .LstartWhile
+//     .LrestWhile:   body
+//                    jmp .LstartWhile
+//
+// The last (at most n - 1) iterations go one at a time through .LrestWhile.
+// Other loops are compiled as before. -funroll=1 turns this off.
+
+#define UNROLL_FACTOR 4
+#define UNROLL_MAX_FACTOR 16
+#define UNROLL_MAX_STEP (1 << 20)
+
+typedef struct CountedLoop {
+    int64_t offset;                     // of the induction variable
+    uint64_t step;                      // what it moves by each iteration, towards the bound
+    bool up;                            // i < bound or i <= bound
+    bool inclusive;                     // <= or >=
+    Ast* bound;
+    char const *end;                    // the "}" of the body
+    AstPool pool;                       // holds bound, freed by the caller
+} CountedLoop;
+
+// the statement at text assigns to a variable: its name, or an empty slice
+Slice assignedName(char const *text) {
+    char const *end = text;
+    while (isalnum(*end)) {
+        end++;
+    }
+    char const *next = end;
+    while (*next == ' ') {
+        next++;
+    }
+    if (end == text || !isalpha(*text) || next[0] != '=' || next[1] == '=') {
+        return sliceConstructorLen(0, 0);
+    }
+    return sliceConstructorEnd(text, end);
+}
+
+// true if the tree reads a variable the body between body and end assigns
+bool boundAssigned(Ast* ast, char const *body, char const *end) {
+    if (ast == NULL) {
+        return false;
+    }
+    if (ast -> kind == AST_VAR) {
+        for (char const *text = body; text < end; text++) {
+            if (!isalnum(text[-1]) && sliceEqualSlice(assignedName(text), ast -> name)) {
+                return true;
+            }
+        }
+        return false;
+    }
+    return boundAssigned(ast -> left, body, end) || boundAssigned(ast -> right, body, end);
+}
+
+// reads the condition ("(" is next) and body of a while loop, true if it is counted
+bool countedLoop(LoopAnalysis* analysis, CountedLoop* loop) {
+    Compiler* compiler = analysis -> compiler;
+    AstPool* pool = &(analysis -> pool);
+    Ast* left = NULL;
+    Ast* right = NULL;
+    Comparison comparison = COMPARE_NE;
+    if (!analyzeCondition(analysis, &left, &right, &comparison) ||
+            comparison == COMPARE_EQ || comparison == COMPARE_NE) {
+        return false;
+    }
+    skip(compiler);
+    if (*compiler -> current != '{') {
+        return false;
+    }
+    char const *body = compiler -> current + 1;
+    char const *end = matchingBrace(compiler -> current);
+
+    // the variable goes on the left
+    if (left -> kind != AST_VAR || (right -> kind == AST_VAR && !boundAssigned(left, body, end))) {
+        Ast* swap = left;
+        left = right;
+        right = swap;
+        comparison = comparison == COMPARE_LT ? COMPARE_GT :
+                     comparison == COMPARE_LE ? COMPARE_GE :
+                     comparison == COMPARE_GT ? COMPARE_LT : COMPARE_LE;
+    }
+    uint64_t coefficient = 0;
+    if (left -> kind != AST_VAR || !linearCoefficient(right, left -> name, &coefficient) || coefficient != 0 ||
+            boundAssigned(right, body, end)) {
+        return false;
+    }
+
+    // the one assignment to the variable, directly in the body
+    bool found = false;
+    uint64_t depth = 0;
+    int64_t step = 0;
+    for (char const *text = body; text < end; text++) {
+        if (*text == '{') {
+            depth++;
+            continue;
+        }
+        if (*text == '}') {
+            depth--;
+            continue;
+        }
+        if (!isalpha(*text) || isalnum(text[-1])) {
+            continue;
+        }
+        char const *nameEnd = text;
+        while (isalnum(*nameEnd)) {
+            nameEnd++;
+        }
+        Slice name = sliceConstructorEnd(text, nameEnd);
+        if (sliceEqualString(name, "while") || sliceEqualString(name, "pfor")) {
+            return false;
+        }
+        Slice assigned = assignedName(text);
+        if (assigned.len != 0 && sliceEqualSlice(assigned, left -> name)) {
+            if (found || depth != 0) {
+                return false;
+            }
+            compiler -> current = (char*) nameEnd;
+            consume(compiler, "=");
+            Ast* value = parseSum(compiler, pool);
+            if (value == NULL || !atLineEnd(compiler) || !astVariablesKnown(compiler, value) ||
+                    !linearCoefficient(value, left -> name, &coefficient) || coefficient != 1) {
+                return false;
+            }
+            Ast* increment = substituteZero(pool, value, left -> name);
+            if (increment -> kind != AST_CONST) {
+                return false;
+            }
+            step = (int64_t)(increment -> value);
+            found = true;
+        }
+        text = nameEnd - 1;
+    }
+
+    // moving away from the bound the loop only ends by wrapping around
+    bool up = comparison == COMPARE_LT || comparison == COMPARE_LE;
+    if (!found || step == 0 || (step > 0) != up || step > UNROLL_MAX_STEP || step < -UNROLL_MAX_STEP) {
+        return false;
+    }
+    loop -> offset = mapGet(compiler -> symbolTable, left -> name);
+    loop -> step = up ? (uint64_t) step : (uint64_t)(-step);
+    loop -> up = up;
+    loop -> inclusive = comparison == COMPARE_LE || comparison == COMPARE_GE;
+    loop -> bound = right;
+    loop -> end = end;
+    return true;
+}
+
+// the copies of the body of the while loop whose condition starts at condition, 1 if it
+// isn't counted; fills loop for emitUnrollGuard either way
+uint64_t unrollFactor(Compiler* compiler, char* condition, CountedLoop* loop) {
+    uint64_t factor = compiler -> options.unroll == 0 ? UNROLL_FACTOR : compiler -> options.unroll;
+    char* savedPointer = compiler -> current;
+    LoopAnalysis* analysis = (LoopAnalysis*) (malloc(sizeof(LoopAnalysis)));
+    statsAlloc(compiler -> stats, sizeof(LoopAnalysis));
+    analysis -> compiler = compiler;
+    analysis -> pool = astPoolCreate(compiler -> stats);
+    analysis -> countVariables = 0;
+
+    compiler -> current = condition;
+    bool counted = factor > 1 && !compiler -> options.profile && countedLoop(analysis, loop) &&
+                   (uint64_t)(loop -> end - condition) <= UNROLL_MAX_BYTES;
+
+    loop -> pool = analysis -> pool;
+    free(analysis);
+    compiler -> current = savedPointer;
+    if (counted) {
+        compiler -> stats -> loopsUnrolled++;
+    }
+    return counted ? factor : 1;
+}
+
+// after the condition: jumps to .LrestWhile<label> unless factor more iterations are left
+void emitUnrollGuard(Compiler* compiler, CountedLoop* loop, uint64_t factor, uint64_t label) {
+    if (loop -> bound -> kind == AST_CONST) {
+        emitf(compiler, "    mov $%lu, %%rax\n", loop -> bound -> value);
+    }
+    else if (loop -> bound -> kind == AST_VAR) {
+        emitf(compiler, "    mov %ld(%%rbp), %%rax\n", mapGet(compiler -> symbolTable, loop -> bound -> name));
+    }
+    else {
+        selectPush(compiler, loop -> bound);
+        emitLine(compiler, "    pop %rax");
+    }
+    if (loop -> up) {
+        emitf(compiler, "    sub %ld(%%rbp), %%rax\n", loop -> offset);
+    }
+    else {
+        emitf(compiler, "    mov %ld(%%rbp), %%rdx\n", loop -> offset);
+        emitLine(compiler, "    sub %rax, %rdx");
+        emitLine(compiler, "    mov %rdx, %rax");
+    }
+    // the last of the factor conditions holds if the distance is more than (factor - 1) * step
+    emitf(compiler, "    cmp $%lu, %%rax\n", (factor - 1) * loop -> step);
+    emitf(compiler, "    j%s .LrestWhile%lu\n", loop -> inclusive ? "b" : "be", label);
+}